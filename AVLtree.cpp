@@ -1,6 +1,7 @@
 #include <assert.h>
 
 #include "AVLtree.hpp"
+#include "epoch.hpp"
 
 static uint32_t max_node(uint32_t lhs, uint32_t rhs) {
     return lhs < rhs ? rhs : lhs;
@@ -115,6 +116,38 @@ AVLNode *avl_off_set(AVLNode *node, int64_t offset) {
     return node;
 }
 
+// 0-based in-order position, the subtree sizes on the way up give it in O(log n)
+int64_t avl_rank(AVLNode *node) {
+    int64_t rank = avl_cnt(node->left);
+    for (AVLNode *parent = node->parent; parent; node = parent, parent = node->parent) {
+        if (parent->right == node) {
+            rank += avl_cnt(parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+// in-order successor; a full walk touches each edge twice, so O(1) amortized per step
+AVLNode *avl_next(AVLNode *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) node = node->left;
+        return node;
+    }
+    while (node->parent && node->parent->right == node) node = node->parent;
+    return node->parent;
+}
+
+AVLNode *avl_prev(AVLNode *node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) node = node->right;
+        return node;
+    }
+    while (node->parent && node->parent->left == node) node = node->parent;
+    return node->parent;
+}
+
 static AVLNode *avl_lazy_del(AVLNode *node) {
     assert(!node->left || !node->right);
 
@@ -162,3 +195,59 @@ AVLNode *avl_del(AVLNode *node) {
     *from = victim;
     return root;
 }
+
+// The _ro walks, for reader threads, load the links atomically as the writer
+// may be rotating under them, and give up as soon as it has moved: what they
+// return is only good if seq_read_retry(seq) is still false afterwards.
+
+static AVLNode *link_ro(AVLNode **link) {
+    return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t cnt_ro(AVLNode *node) {
+    return node ? __atomic_load_n(&node->cnt, __ATOMIC_RELAXED) : 0;
+}
+
+AVLNode *avl_off_set_ro(AVLNode *node, int64_t offset, uint64_t seq) {
+    int64_t pos = 0;
+    while (offset != pos) {
+        if (seq_read_retry(seq)) {
+            return NULL;
+        }
+        AVLNode *left = link_ro(&node->left);
+        AVLNode *right = link_ro(&node->right);
+        if (pos < offset && pos + cnt_ro(right) >= offset) {
+            node = right;
+            pos += cnt_ro(link_ro(&node->left)) + 1;
+        }
+        else if (pos > offset && pos - cnt_ro(left) <= offset) {
+            node = left;
+            pos -= cnt_ro(link_ro(&node->right)) + 1;
+        }
+        else {
+            AVLNode *parent = link_ro(&node->parent);
+            if (!parent) return NULL;
+            if (link_ro(&parent->right) == node) {
+                pos -= cnt_ro(left) + 1;
+            } else {
+                pos += cnt_ro(right) + 1;
+            }
+            node = parent;
+        }
+    }
+    return node;
+}
+
+AVLNode *avl_next_ro(AVLNode *node, uint64_t seq) {
+    AVLNode *next = link_ro(&node->right);
+    if (next) {
+        for (AVLNode *left; !seq_read_retry(seq) && (left = link_ro(&next->left)); next = left) {}
+        return next;
+    }
+    AVLNode *parent = link_ro(&node->parent);
+    while (parent && link_ro(&parent->right) == node && !seq_read_retry(seq)) {
+        node = parent;
+        parent = link_ro(&node->parent);
+    }
+    return parent;
+}
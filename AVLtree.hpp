@@ -26,3 +26,9 @@ inline uint32_t avl_height(AVLNode *node) { return node ? node->height : 0; }
 AVLNode *avl_del(AVLNode *node);
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_off_set(AVLNode *node, int64_t offset);
+int64_t avl_rank(AVLNode *node);
+AVLNode *avl_next(AVLNode *node);
+AVLNode *avl_prev(AVLNode *node);
+// for reader threads, see h_find_ro()
+AVLNode *avl_off_set_ro(AVLNode *node, int64_t offset, uint64_t seq);
+AVLNode *avl_next_ro(AVLNode *node, uint64_t seq);
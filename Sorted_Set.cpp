@@ -3,25 +3,26 @@
 #include <string.h>
 #include "Sorted_Set.hpp"
 #include "usual.hpp"
+#include "epoch.hpp"
+#include "defrag.hpp"
 
 
-struct HKey {
-    HNode node;
-    const char *name = NULL;
-    size_t len = 0;
-};
-
-static void ssnode_del(SSNode *node) {
-    free(node);
-}
-
 static size_t min_node(size_t lhs, size_t rhs) {
     return lhs < rhs ? lhs : rhs;
 }
 
 
+static size_t ssnode_size(size_t len) {
+    return sizeof(SSNode) + len;
+}
+
+static void ssnode_del(SSNode *node) {
+    defrag_note_free(node, ssnode_size(node->len));
+    epoch_retire(node, &free);
+}
+
 static SSNode *ssnode_new(const char *name, size_t len, double score) {
-    SSNode *node = (SSNode *)malloc(sizeof(SSNode) + len);
+    SSNode *node = (SSNode *)malloc(ssnode_size(len));
     assert(node);  
     avl_init(&node->tree);
     node->hmap.next = NULL;
@@ -29,9 +30,12 @@ static SSNode *ssnode_new(const char *name, size_t len, double score) {
     node->score = score;
     node->len = len;
     memcpy(&node->name[0], name, len);
+    defrag_note_alloc(node, ssnode_size(len));
     return node;
 }
 
+static bool ssless(AVLNode *lhs, double score, const char *name, size_t len);
+
 static bool ssless(AVLNode *lhs, AVLNode *rhs) {
     SSNode *zr = container_of(rhs, SSNode, tree);
     return ssless(lhs, zr->score, zr->name, zr->len);
@@ -50,6 +54,19 @@ static bool ssless(AVLNode *lhs, double score, const char *name, size_t len){
     return zl->len < len;
 }
 
+static bool ssgreater(AVLNode *lhs, double score, const char *name, size_t len) {
+    SSNode *zl = container_of(lhs, SSNode, tree);
+    if (zl->score != score) {
+        return zl->score > score;
+    }
+    int rv = memcmp(zl->name, name, min_node(zl->len, len));
+    if (rv != 0) {
+        return rv > 0;
+    }
+    return zl->len > len;
+}
+
+// rotations relink nodes under the readers, see epoch.hpp
 static void tree_insert(Sorted_Set *sset, SSNode *node) {
     AVLNode *parent = NULL;         
     AVLNode **from = &sset->root;   
@@ -57,9 +74,30 @@ static void tree_insert(Sorted_Set *sset, SSNode *node) {
         parent = *from;
         from = ssless(&node->tree, parent) ? &parent->left : &parent->right;
     }
+    seq_write_begin();
     *from = &node->tree;            
     node->tree.parent = parent;
     sset->root = avl_fix(&node->tree);
+    if (!sset->first || ssless(&node->tree, &sset->first->tree)) {
+        sset->first = node;
+    }
+    if (!sset->last || ssless(&sset->last->tree, &node->tree)) {
+        sset->last = node;
+    }
+    seq_write_end();
+}
+
+// the neighbour of an extreme is at most a step away, so this stays O(1)
+static void tree_remove(Sorted_Set *sset, SSNode *node) {
+    seq_write_begin();
+    if (sset->first == node) {
+        sset->first = ssnode_next(node);
+    }
+    if (sset->last == node) {
+        sset->last = ssnode_prev(node);
+    }
+    sset->root = avl_del(&node->tree);
+    seq_write_end();
 }
 
 
@@ -67,10 +105,12 @@ static void sset_update(Sorted_Set *sset, SSNode *node, double score) {
     if (node->score == score) {
         return;
     }
-    sset->root = avl_del(&node->tree);
+    seq_write_begin();  // the score changes in place
+    tree_remove(sset, node);
     avl_init(&node->tree);
     node->score = score;
     tree_insert(sset, node);
+    seq_write_end();
 }
 
 bool sset_insert(Sorted_Set *sset, const char *name, size_t len, double score) {
@@ -80,7 +120,8 @@ bool sset_insert(Sorted_Set *sset, const char *name, size_t len, double score) {
         return false;
     } else {
         node = ssnode_new(name, len, score);
-        hm_insert(&sset->hmap, &node->hmap);
+        sset->mem += ssnode_size(len);
+        sset->hmap.insert(node);
         tree_insert(sset, node);
         return true;
     }
@@ -88,43 +129,33 @@ bool sset_insert(Sorted_Set *sset, const char *name, size_t len, double score) {
 
 
 void sset_delete(Sorted_Set *sset, SSNode *node) {
+    SSNode *found = sset->hmap.remove(SSNodeTraits::key(node), node->hmap.hashcode);
+    assert(found == node);
     
-    HKey key;
-    key.node.hashcode = node->hmap.hashcode;
-    key.name = node->name;
-    key.len = node->len;
-    HNode *found = hm_delete(&sset->hmap, &key.node, &hcmp);
-    assert(found);
-    
-    sset->root = avl_del(&node->tree);
+    tree_remove(sset, node);
+    sset->mem -= ssnode_size(node->len);
     ssnode_del(node);
 }
 
 
-static bool hcmp(HNode *node, HNode *key) {
-    SSNode *ssnode = container_of(node, SSNode, hmap);
-    HKey *hkey = container_of(key, HKey, node);
-    if (ssnode->len != hkey->len) {
-        return false;
-    }
-    return 0 == memcmp(ssnode->name, hkey->name, ssnode->len);
-}
-
 SSNode *sset_lookup(Sorted_Set *sset, const char *name, size_t len) {
-    if (!sset->root) {
+    if (sset->hmap.size() == 0) {
         return NULL;
     }
-
-    HKey key;
-    key.node.hashcode = str_hash((uint8_t *)name, len);
-    key.name = name;
-    key.len = len;
-    HNode *found = hm_lookup(&sset->hmap, &key.node, &hcmp);
-    return found ? container_of(found, SSNode, hmap) : NULL;
+    return sset->hmap.lookup(SSKey{name, len});
 }
 
 
+// for reader threads, see h_find_ro()
+SSNode *sset_lookup_ro(Sorted_Set *sset, const char *name, size_t len, uint64_t seq) {
+    SSKey key{name, len};
+    return sset->hmap.lookup_ro(key, SSNodeTraits::hash(key), seq);
+}
+
 SSNode *sset_seekge(Sorted_Set *sset, double score, const char *name, size_t len) {
+    if (sset->first && !ssless(&sset->first->tree, score, name, len)) {
+        return sset->first;     // a peek at the minimum, e.g. from -inf
+    }
     AVLNode *found = NULL;
     for (AVLNode *node = sset->root; node; ) {
         if (ssless(node, score, name, len)) {
@@ -138,11 +169,97 @@ SSNode *sset_seekge(Sorted_Set *sset, double score, const char *name, size_t len
 }
 
 
+SSNode *sset_seekge_ro(Sorted_Set *sset, double score, const char *name, size_t len, uint64_t seq) {
+    SSNode *first = __atomic_load_n(&sset->first, __ATOMIC_ACQUIRE);
+    if (first && !ssless(&first->tree, score, name, len)) {
+        return first;
+    }
+    AVLNode *found = NULL;
+    AVLNode *node = __atomic_load_n(&sset->root, __ATOMIC_ACQUIRE);
+    while (node && !seq_read_retry(seq)) {
+        if (ssless(node, score, name, len)) {
+            node = __atomic_load_n(&node->right, __ATOMIC_ACQUIRE);
+        } else {
+            found = node;
+            node = __atomic_load_n(&node->left, __ATOMIC_ACQUIRE);
+        }
+    }
+    return found ? container_of(found, SSNode, tree) : NULL;
+}
+
+// the last node <= (score, name), the starting point of reverse range queries
+SSNode *sset_seekle(Sorted_Set *sset, double score, const char *name, size_t len) {
+    if (sset->last && !ssgreater(&sset->last->tree, score, name, len)) {
+        return sset->last;
+    }
+    AVLNode *found = NULL;
+    for (AVLNode *node = sset->root; node; ) {
+        if (ssgreater(node, score, name, len)) {
+            node = node->left;
+        } else {
+            found = node;
+            node = node->right;
+        }
+    }
+    return found ? container_of(found, SSNode, tree) : NULL;
+}
+
+// the first node with a score strictly above `score`, whatever its name
+SSNode *sset_seekgt(Sorted_Set *sset, double score) {
+    AVLNode *found = NULL;
+    for (AVLNode *node = sset->root; node; ) {
+        if (container_of(node, SSNode, tree)->score <= score) {
+            node = node->right;
+        } else {
+            found = node;
+            node = node->left;
+        }
+    }
+    return found ? container_of(found, SSNode, tree) : NULL;
+}
+
 SSNode *ssnode_offset(SSNode *node, int64_t offset) {
     AVLNode *tnode = node ? avl_off_set(&node->tree, offset) : NULL;
     return tnode ? container_of(tnode, SSNode, tree) : NULL;
 }
 
+// use these instead of ssnode_offset(node, +-1) to walk a range
+SSNode *ssnode_next(SSNode *node) {
+    AVLNode *tnode = avl_next(&node->tree);
+    return tnode ? container_of(tnode, SSNode, tree) : NULL;
+}
+
+SSNode *ssnode_offset_ro(SSNode *node, int64_t offset, uint64_t seq) {
+    AVLNode *tnode = node ? avl_off_set_ro(&node->tree, offset, seq) : NULL;
+    return tnode ? container_of(tnode, SSNode, tree) : NULL;
+}
+
+SSNode *ssnode_next_ro(SSNode *node, uint64_t seq) {
+    AVLNode *tnode = avl_next_ro(&node->tree, seq);
+    return tnode ? container_of(tnode, SSNode, tree) : NULL;
+}
+
+SSNode *ssnode_prev(SSNode *node) {
+    AVLNode *tnode = avl_prev(&node->tree);
+    return tnode ? container_of(tnode, SSNode, tree) : NULL;
+}
+
+SSNode *sset_first(Sorted_Set *sset) {
+    return sset->first;
+}
+
+SSNode *sset_last(Sorted_Set *sset) {
+    return sset->last;
+}
+
+int64_t ssnode_rank(SSNode *node) {
+    return avl_rank(&node->tree);
+}
+
+size_t sset_size(Sorted_Set *sset) {
+    return avl_cnt(sset->root);
+}
+
 static void tree_dispose(AVLNode *node) {
     if (!node) {
         return;
@@ -154,7 +271,103 @@ static void tree_dispose(AVLNode *node) {
 
 
 void sset_clear(Sorted_Set *sset) {
-    hm_clear(&sset->hmap);
+    sset->hmap.clear();
     tree_dispose(sset->root);
     sset->root = NULL;
+    sset->first = sset->last = NULL;
+    sset->mem = 0;
+}
+
+// Bulk loading of an empty set: sset_build_add() creates the members and
+// only hashes them, so they can still be looked up and rescored; once they
+// are all in and sorted by ssnode_less(), sset_build_link() links the tree
+// in O(n) instead of rebalancing on every insert.
+SSNode *sset_build_add(Sorted_Set *sset, const char *name, size_t len, double score) {
+    SSNode *node = ssnode_new(name, len, score);
+    sset->mem += ssnode_size(len);
+    sset->hmap.insert(node);
+    return node;
+}
+
+bool ssnode_less(SSNode *lhs, SSNode *rhs) {
+    return ssless(&lhs->tree, &rhs->tree);
+}
+
+// a perfectly balanced subtree of the nodes [lo, hi)
+static AVLNode *tree_build(SSNode **sorted, size_t lo, size_t hi, AVLNode *parent) {
+    if (lo == hi) {
+        return NULL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    AVLNode *node = &sorted[mid]->tree;
+    node->parent = parent;
+    node->left = tree_build(sorted, lo, mid, node);
+    node->right = tree_build(sorted, mid + 1, hi, node);
+    uint32_t lh = avl_height(node->left), rh = avl_height(node->right);
+    node->height = 1 + (lh > rh ? lh : rh);
+    node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+    return node;
+}
+
+void sset_build_link(Sorted_Set *sset, SSNode **sorted, size_t n) {
+    assert(!sset->root && n == sset->hmap.size());
+    sset->root = tree_build(sorted, 0, n, NULL);
+    sset->first = n ? sorted[0] : NULL;
+    sset->last = n ? sorted[n - 1] : NULL;
+}
+
+// frees the members of a build that will not be linked
+void sset_build_abort(Sorted_Set *sset, SSNode **nodes, size_t n) {
+    assert(!sset->root);
+    sset->hmap.clear();
+    for (size_t i = 0; i < n; i++) {
+        ssnode_del(nodes[i]);
+    }
+    sset->mem = 0;
+}
+
+// Moves `node` to a fuller page if it is worth it, then fixes up the links
+// to it: the parent's child link (or the root), the children's parent links
+// and the hash chain predecessor. Returns where the node is now.
+SSNode *ssnode_defrag(Sorted_Set *sset, SSNode *node) {
+    if (!defrag_sparse(node)) {
+        return node;
+    }
+    size_t size = ssnode_size(node->len);
+    SSNode *fresh = (SSNode *)defrag_alloc(node, size, &malloc, &free);
+    if (!fresh) {
+        return node;
+    }
+    memcpy(fresh, node, size);
+    seq_write_begin();
+    AVLNode *tree = &fresh->tree;
+    if (!tree->parent) {
+        sset->root = tree;
+    } else if (tree->parent->left == &node->tree) {
+        tree->parent->left = tree;
+    } else {
+        tree->parent->right = tree;
+    }
+    if (tree->left) {
+        tree->left->parent = tree;
+    }
+    if (tree->right) {
+        tree->right->parent = tree;
+    }
+    if (sset->first == node) {
+        sset->first = fresh;
+    }
+    if (sset->last == node) {
+        sset->last = fresh;
+    }
+    bool found = sset->hmap.replace(node, fresh);
+    assert(found);
+    seq_write_end();
+    defrag_note_move(node, fresh, size);
+    epoch_retire(node, &free);  // readers may still be on it
+    return fresh;
+}
+
+size_t sset_mem_usage(Sorted_Set *sset) {
+    return sset->mem + sset->hmap.mem_usage();
 }
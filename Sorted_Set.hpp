@@ -1,15 +1,11 @@
 #pragma once
 
+#include <string.h>
 #include "hashtable.hpp"
 #include "AVLtree.hpp"
+#include "usual.hpp"
 
 
-struct 
-Sorted_Set {
-    AVLNode *root = NULL;  
-    HMap hmap;              
-};
-
 struct 
 SSNode {
     AVLNode tree;
@@ -19,9 +15,56 @@ SSNode {
     char name[0];       
 };
 
+// members are looked up by name
+struct 
+SSKey {
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+struct 
+SSNodeTraits {
+    typedef SSKey Key;
+    static HNode *node(SSNode *node) { return &node->hmap; }
+    static SSNode *owner(HNode *node) { return container_of(node, SSNode, hmap); }
+    static SSKey key(const SSNode *node) { return SSKey{node->name, node->len}; }
+    static uint64_t hash(const SSKey &key) { return str_hash((uint8_t *)key.name, key.len); }
+    static bool eq(const SSKey &lhs, const SSKey &rhs) {
+        return lhs.len == rhs.len && memcmp(lhs.name, rhs.name, lhs.len) == 0;
+    }
+};
+
+struct 
+Sorted_Set {
+    AVLNode *root = NULL;  
+    HashMap<SSNode, SSNodeTraits> hmap;
+    SSNode *first = NULL;   // the extremes, cached for sset_first/sset_last
+    SSNode *last = NULL;
+    size_t mem = 0;         // bytes of all SSNodes
+};
+
 SSNode *sset_lookup(Sorted_Set *sset, const char *name, size_t len);
+SSNode *sset_lookup_ro(Sorted_Set *sset, const char *name, size_t len, uint64_t seq);
 bool sset_insert(Sorted_Set *sset, const char *name, size_t len, double score);
 SSNode *sset_seekge(Sorted_Set *sset, double score, const char *name, size_t len);
+SSNode *sset_seekle(Sorted_Set *sset, double score, const char *name, size_t len);
+SSNode *sset_seekgt(Sorted_Set *sset, double score);
 void sset_delete(Sorted_Set *sset, SSNode *node);
 void sset_clear(Sorted_Set *sset);
+SSNode *sset_build_add(Sorted_Set *sset, const char *name, size_t len, double score);
+bool ssnode_less(SSNode *lhs, SSNode *rhs);
+void sset_build_link(Sorted_Set *sset, SSNode **sorted, size_t n);
+void sset_build_abort(Sorted_Set *sset, SSNode **nodes, size_t n);
 SSNode *ssnode_offset(SSNode *node, int64_t offset);
+SSNode *ssnode_next(SSNode *node);
+// for reader threads, see avl_off_set_ro()
+SSNode *sset_seekge_ro(Sorted_Set *sset, double score, const char *name, size_t len, uint64_t seq);
+SSNode *ssnode_offset_ro(SSNode *node, int64_t offset, uint64_t seq);
+SSNode *ssnode_next_ro(SSNode *node, uint64_t seq);
+SSNode *ssnode_prev(SSNode *node);
+SSNode *sset_first(Sorted_Set *sset);
+SSNode *sset_last(Sorted_Set *sset);
+int64_t ssnode_rank(SSNode *node);
+size_t sset_size(Sorted_Set *sset);
+size_t sset_mem_usage(Sorted_Set *sset);
+SSNode *ssnode_defrag(Sorted_Set *sset, SSNode *node);
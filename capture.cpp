@@ -0,0 +1,129 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include "capture.hpp"
+#include "usual.hpp"
+
+
+const size_t k_capture_flush = 64 * 1024;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *g_fp = NULL;
+static std::vector<uint8_t> g_buf;     // records not yet written out
+static uint64_t g_last_us = 0;
+
+static uint64_t now_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static void put_varint(std::vector<uint8_t> &buf, uint64_t val) {
+    while (val >= 0x80) {
+        buf.push_back((uint8_t)(val | 0x80));
+        val >>= 7;
+    }
+    buf.push_back((uint8_t)val);
+}
+
+bool capture_open(const char *path) {
+    g_fp = fopen(path, "wb");
+    if (!g_fp) {
+        return false;
+    }
+    fwrite(k_capture_magic, 1, sizeof(k_capture_magic), g_fp);
+    g_last_us = now_usec();
+    return true;
+}
+
+static void flush_locked() {
+    if (!g_buf.empty()) {
+        fwrite(g_buf.data(), 1, g_buf.size(), g_fp);
+        fflush(g_fp);
+        g_buf.clear();
+    }
+}
+
+// the timestamp is taken under the lock, so records are in time order
+void capture_record(uint32_t conn_id, uint32_t proto, const uint8_t *request, size_t len,
+    const uint8_t *reply, size_t reply_len, bool has_reply)
+{
+    uint64_t hash = has_reply ? str_hash(reply, reply_len) : 0;
+    pthread_mutex_lock(&g_lock);
+    uint64_t now_us = now_usec();
+    put_varint(g_buf, now_us - g_last_us);
+    g_last_us = now_us;
+    put_varint(g_buf, conn_id);
+    put_varint(g_buf, len);
+    g_buf.insert(g_buf.end(), request, request + len);
+    g_buf.push_back((has_reply ? 1 : 0) | (proto == 2 ? 2 : 0));
+    if (has_reply) {
+        g_buf.insert(g_buf.end(), (const uint8_t *)&hash, (const uint8_t *)&hash + 8);
+    }
+    if (g_buf.size() >= k_capture_flush) {
+        flush_locked();
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+void capture_flush() {
+    pthread_mutex_lock(&g_lock);
+    if (g_fp) {
+        flush_locked();
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+FILE *capture_open_read(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    char magic[sizeof(k_capture_magic)];
+    if (fp && (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+            || memcmp(magic, k_capture_magic, sizeof(magic)) != 0)) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+static bool get_varint(FILE *fp, uint64_t &val) {
+    val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(fp);
+        if (c == EOF) {
+            return false;
+        }
+        val |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the file may only end between records, a record cut short is malformed
+int capture_read(FILE *fp, CaptureRecord &rec) {
+    int c = fgetc(fp);
+    if (c == EOF) {
+        return ferror(fp) ? -1 : 0;
+    }
+    ungetc(c, fp);
+    uint64_t delta = 0, conn_id = 0, len = 0;
+    if (!get_varint(fp, delta) || !get_varint(fp, conn_id) || !get_varint(fp, len)
+        || len > (64 << 20)) {
+        return -1;
+    }
+    rec.ts_us += delta;
+    rec.conn_id = (uint32_t)conn_id;
+    rec.request.resize(len);
+    if (fread(&rec.request[0], 1, len, fp) != len) {
+        return -1;
+    }
+    int flags = fgetc(fp);
+    rec.has_hash = flags != EOF && (flags & 1);
+    rec.proto = flags != EOF && (flags & 2) ? 2 : 1;
+    if (flags == EOF || (rec.has_hash && fread(&rec.reply_hash, 8, 1, fp) != 1)) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+
+// Traffic capture files: a header, then one record per request, in the order
+// the server executed them:
+//   varint  microseconds since the previous record
+//   varint  connection ID
+//   varint  request length, then the request (the frame without its length)
+//   u8      flags: 1 if the reply hash follows, 2 for a protocol v2 request
+//   u64     str_hash() of the reply without its v2 request ID, absent for
+//           streamed replies
+// Varints are LEB128, integers little-endian.
+
+const char k_capture_magic[8] = {'K', 'V', 'C', 'A', 'P', 'v', '1', '\n'};
+
+struct 
+CaptureRecord {
+    uint64_t ts_us = 0;     // since the capture started
+    uint32_t conn_id = 0;
+    uint32_t proto = 1;
+    bool has_hash = false;
+    uint64_t reply_hash = 0;
+    std::string request;
+};
+
+// recording, may be called from any thread
+bool capture_open(const char *path);
+void capture_record(uint32_t conn_id, uint32_t proto, const uint8_t *request, size_t len,
+    const uint8_t *reply, size_t reply_len, bool has_reply);
+void capture_flush();
+
+// replaying; returns 0 at the end, -1 on a malformed file
+FILE *capture_open_read(const char *path);
+int capture_read(FILE *fp, CaptureRecord &rec);
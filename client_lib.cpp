@@ -0,0 +1,804 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <memory>
+#include "client_lib.hpp"
+#include "cluster.hpp"
+
+
+const size_t k_max_message = 32 << 20;
+
+static ClientConn *conn_open(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    if (connect(fd, addr, addrlen)) {
+        close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    ClientConn *conn = new ClientConn();
+    conn->fd = fd;
+    return conn;
+}
+
+ClientConn *client_connect_tcp(const char *host, int port) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    return conn_open(fd, (const struct sockaddr *)&addr, sizeof(addr));
+}
+
+ClientConn *client_connect_unix(const char *path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    return conn_open(fd, (const struct sockaddr *)&addr, sizeof(addr));
+}
+
+static void reply_fail(ReplyFn &fn) {
+    Response resp;
+    resp.status = k_client_io_error;
+    resp.reply.tag = TAG_ERR;
+    fn(resp);
+}
+
+// no reply can be matched to a request any more
+static void conn_fail(ClientConn *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->outgoing.clear();
+    conn->incoming.reset();
+    conn->incoming_pos = 0;
+    conn->pending_ids.clear();
+    while (!conn->pending.empty()) {
+        ReplyFn fn = std::move(conn->pending.front());
+        conn->pending.pop_front();
+        reply_fail(fn);
+    }
+}
+
+// within a callback of the conn, it is only freed when the poll is done
+void client_close(ClientConn *conn) {
+    conn->busy++;
+    conn_fail(conn);    // the callbacks may close it again
+    conn->busy--;
+    conn->closing = true;
+    if (conn->busy == 0) {
+        delete conn;
+    }
+}
+
+static void buf_append_u32(std::vector<uint8_t> &buf, uint32_t val) {
+    buf.insert(buf.end(), (const uint8_t *)&val, (const uint8_t *)&val + 4);
+}
+
+// the v2 request ID and opcode, before the number of arguments
+static void frame_begin_v2(ClientConn *conn, uint8_t op) {
+    uint32_t id = conn->next_id++;
+    if (id == k_client_push_id) {
+        id = conn->next_id++;
+    }
+    buf_append_u32(conn->outgoing, id);
+    conn->outgoing.push_back(op);
+    conn->pending_ids.push_back(id);
+}
+
+void client_send(ClientConn *conn, const std::vector<std::string> &args, ReplyFn fn) {
+    bool v2 = conn->proto == 2;
+    size_t len = 4 + (v2 ? 5 + args.size() : 0);
+    for (const std::string &s : args) {
+        len += 4 + s.size();
+    }
+    if (conn->fd < 0 || len > k_max_message) {
+        return reply_fail(fn);
+    }
+    buf_append_u32(conn->outgoing, (uint32_t)len);
+    if (v2) {
+        frame_begin_v2(conn, OP_NAMED);
+    }
+    buf_append_u32(conn->outgoing, (uint32_t)args.size());
+    for (const std::string &s : args) {
+        if (v2) {
+            conn->outgoing.push_back(TAG_STR);
+        }
+        buf_append_u32(conn->outgoing, (uint32_t)s.size());
+        conn->outgoing.insert(conn->outgoing.end(), s.begin(), s.end());
+    }
+    conn->pending.push_back(std::move(fn));
+}
+
+// v2 only, numbers go out as fixed-width values
+void client_send_typed(ClientConn *conn, uint8_t op, const std::vector<ClientArg> &args, ReplyFn fn) {
+    size_t len = 9;
+    for (const ClientArg &arg : args) {
+        len += 1 + (arg.tag == TAG_STR ? 4 + arg.str.size() : 8);
+    }
+    if (conn->fd < 0 || conn->proto != 2 || len > k_max_message) {
+        return reply_fail(fn);
+    }
+    buf_append_u32(conn->outgoing, (uint32_t)len);
+    frame_begin_v2(conn, op);
+    buf_append_u32(conn->outgoing, (uint32_t)args.size());
+    for (const ClientArg &arg : args) {
+        conn->outgoing.push_back(arg.tag);
+        if (arg.tag == TAG_STR) {
+            buf_append_u32(conn->outgoing, (uint32_t)arg.str.size());
+            conn->outgoing.insert(conn->outgoing.end(), arg.str.begin(), arg.str.end());
+        } else if (arg.tag == TAG_INT) {
+            conn->outgoing.insert(conn->outgoing.end(),
+                (const uint8_t *)&arg.ival, (const uint8_t *)&arg.ival + 8);
+        } else {
+            conn->outgoing.insert(conn->outgoing.end(),
+                (const uint8_t *)&arg.dval, (const uint8_t *)&arg.dval + 8);
+        }
+    }
+    conn->pending.push_back(std::move(fn));
+}
+
+// an already encoded request in the connection's protocol, for replays
+void client_send_frame(ClientConn *conn, const std::string &request, ReplyFn fn) {
+    if (conn->fd < 0 || request.size() > k_max_message
+        || (conn->proto == 2 && request.size() < 4)) {
+        return reply_fail(fn);
+    }
+    buf_append_u32(conn->outgoing, (uint32_t)request.size());
+    conn->outgoing.insert(conn->outgoing.end(), request.begin(), request.end());
+    if (conn->proto == 2) {
+        uint32_t id = 0;
+        memcpy(&id, request.data(), 4);
+        conn->pending_ids.push_back(id);
+    }
+    conn->pending.push_back(std::move(fn));
+}
+
+// returns the bytes consumed, or -1 for a malformed reply
+int32_t reply_parse(const uint8_t *data, size_t size, Reply &out) {
+    if (size < 1) {
+        return -1;
+    }
+    out.tag = data[0];
+    switch (data[0]) {
+    case TAG_NIL:
+        return 1;
+    case TAG_ERR:
+        if (size < 9) {
+            return -1;
+        }
+        memcpy(&out.code, &data[1], 4);
+        memcpy(&out.len, &data[5], 4);
+        if (size - 9 < out.len) {
+            return -1;
+        }
+        out.str = (const char *)&data[9];
+        return 9 + out.len;
+    case TAG_STR:
+        if (size < 5) {
+            return -1;
+        }
+        memcpy(&out.len, &data[1], 4);
+        if (size - 5 < out.len) {
+            return -1;
+        }
+        out.str = (const char *)&data[5];
+        return 5 + out.len;
+    case TAG_INT:
+        if (size < 9) {
+            return -1;
+        }
+        memcpy(&out.ival, &data[1], 8);
+        return 9;
+    case TAG_DBL:
+        if (size < 9) {
+            return -1;
+        }
+        memcpy(&out.dval, &data[1], 8);
+        return 9;
+    case TAG_ARR: {
+        if (size < 5) {
+            return -1;
+        }
+        uint32_t n = 0;
+        memcpy(&n, &data[1], 4);
+        if (n > size) {
+            return -1;  // every element takes at least a byte
+        }
+        out.elems.resize(n);
+        size_t pos = 5;
+        for (uint32_t i = 0; i < n; i++) {
+            int32_t rv = reply_parse(&data[pos], size - pos, out.elems[i]);
+            if (rv < 0) {
+                return -1;
+            }
+            pos += (size_t)rv;
+        }
+        return (int32_t)pos;
+    }
+    default:
+        return -1;
+    }
+}
+
+static void conn_write(ClientConn *conn) {
+    if (conn->outgoing.empty()) {
+        return;
+    }
+    ssize_t rv = write(conn->fd, conn->outgoing.data(), conn->outgoing.size());
+    if (rv < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (rv < 0) {
+        return conn_fail(conn);
+    }
+    conn->outgoing.erase(conn->outgoing.begin(), conn->outgoing.begin() + rv);
+}
+
+// The buffer to append read bytes to. One that replies still point into is
+// left to them, and the bytes not dispatched yet, a partial frame at most,
+// move to a new one.
+static std::vector<uint8_t> &conn_incoming(ClientConn *conn) {
+    std::shared_ptr<std::vector<uint8_t>> &buf = conn->incoming;
+    if (!buf || buf.use_count() > 1) {
+        auto fresh = std::make_shared<std::vector<uint8_t>>();
+        if (buf) {
+            fresh->assign(buf->begin() + conn->incoming_pos, buf->end());
+        }
+        buf = fresh;
+    } else {
+        buf->erase(buf->begin(), buf->begin() + conn->incoming_pos);
+    }
+    conn->incoming_pos = 0;
+    return *buf;
+}
+
+// Dispatches every complete reply, returns how many. Each frame is taken
+// off `incoming` before its callback runs, so a callback that reads from
+// the conn again starts after it.
+static int conn_read(ClientConn *conn) {
+    uint8_t buf[64 * 1024];
+    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    if (rv < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if (rv <= 0) {
+        conn_fail(conn);
+        return 0;
+    }
+    std::vector<uint8_t> &incoming = conn_incoming(conn);
+    incoming.insert(incoming.end(), buf, buf + rv);
+
+    int nreplies = 0;
+    while (conn->fd >= 0) {
+        std::shared_ptr<std::vector<uint8_t>> data = conn->incoming;
+        size_t pos = conn->incoming_pos;
+        if (data->size() - pos < 4) {
+            break;
+        }
+        uint32_t len = 0;
+        memcpy(&len, &(*data)[pos], 4);
+        if (len > k_max_message) {
+            conn_fail(conn);
+            break;
+        }
+        if (data->size() - pos - 4 < len) {
+            break;
+        }
+        conn->incoming_pos = pos + 4 + len;
+        Response resp;
+        const uint8_t *frame = &(*data)[pos + 4];
+        bool push = conn->proto == 2 && len >= 4 && !memcmp(frame, &k_client_push_id, 4);
+        if (push) {
+            resp.id = k_client_push_id;
+            frame += 4;
+            len -= 4;
+        } else if (conn->pending.empty()) {
+            conn_fail(conn);
+            break;
+        } else if (conn->proto == 2) {
+            // replies come in order, so the ID only confirms the match
+            if (len < 4 || memcmp(frame, &conn->pending_ids.front(), 4) != 0) {
+                conn_fail(conn);
+                break;
+            }
+            memcpy(&resp.id, frame, 4);
+            conn->pending_ids.pop_front();
+            frame += 4;
+            len -= 4;
+        }
+        if (reply_parse(frame, len, resp.reply) != (int32_t)len) {
+            conn_fail(conn);
+            break;
+        }
+        resp.data = std::move(data);
+        resp.frame = frame;
+        resp.frame_len = len;
+        if (push) {
+            if (conn->on_push) {
+                conn->on_push(resp);
+            }
+            continue;
+        }
+        ReplyFn fn = std::move(conn->pending.front());
+        conn->pending.pop_front();
+        fn(resp);   // may queue more requests on this connection
+        nreplies++;
+    }
+    return nreplies;
+}
+
+static int conns_poll(ClientConn **conns, size_t n, int timeout_ms) {
+    std::vector<struct pollfd> pfds;
+    std::vector<ClientConn *> polled;
+    for (size_t i = 0; i < n; i++) {
+        ClientConn *conn = conns[i];
+        if (conn->fd >= 0) {
+            conn_write(conn);   // skip the poll() round trip when the socket has room
+        }
+        if (conn->fd < 0 || (conn->pending.empty() && !conn->on_push)) {
+            continue;
+        }
+        struct pollfd pfd = {conn->fd, POLLIN, 0};
+        if (!conn->outgoing.empty()) {
+            pfd.events |= POLLOUT;
+        }
+        pfds.push_back(pfd);
+        polled.push_back(conn);
+    }
+    if (pfds.empty()) {
+        return -1;
+    }
+    int rv = poll(pfds.data(), (nfds_t)pfds.size(), timeout_ms);
+    if (rv < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    int nreplies = 0;
+    for (size_t i = 0; i < pfds.size(); i++) {
+        ClientConn *conn = polled[i];
+        if ((pfds[i].revents & POLLOUT) && conn->fd >= 0) {
+            conn_write(conn);
+        }
+        if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) && conn->fd >= 0) {
+            nreplies += conn_read(conn);
+        }
+    }
+    return nreplies;
+}
+
+// Drives the connections: flushes queued requests and dispatches replies.
+// Returns the number of replies dispatched, or -1 if none of the
+// connections has anything in flight to wait for.
+int client_poll(ClientConn **conns, size_t n, int timeout_ms) {
+    for (size_t i = 0; i < n; i++) {
+        conns[i]->busy++;
+    }
+    int rv = conns_poll(conns, n, timeout_ms);
+    for (size_t i = 0; i < n; i++) {
+        ClientConn *conn = conns[i];
+        if (--conn->busy == 0 && conn->closing) {
+            delete conn;    // closed by one of its callbacks
+        }
+    }
+    return rv;
+}
+
+// switches the protocol of an idle connection, false if the server refused
+bool client_hello(ClientConn *conn, uint32_t proto) {
+    assert(conn->pending.empty());
+    Response resp = client_call(conn, {"hello", std::to_string(proto)});
+    if (resp.status != k_client_ok || resp.reply.tag != TAG_INT
+        || resp.reply.ival != (int64_t)proto) {
+        return false;
+    }
+    conn->proto = proto;
+    return true;
+}
+
+void client_wait(ClientConn *conn) {
+    while (!conn->pending.empty() && client_poll(&conn, 1, -1) >= 0) {}
+}
+
+struct AsyncCall {
+    Response resp;
+    bool done = false;
+};
+
+// get() drives the connection itself if nothing else has resolved the call
+std::future<Response> client_call_async(ClientConn *conn, const std::vector<std::string> &args) {
+    std::shared_ptr<AsyncCall> call = std::make_shared<AsyncCall>();
+    client_send(conn, args, [call](Response &resp) {
+        call->resp = std::move(resp);
+        call->done = true;
+    });
+    return std::async(std::launch::deferred, [conn, call]() mutable {
+        while (!call->done && client_poll(&conn, 1, -1) >= 0) {}
+        assert(call->done);
+        return std::move(call->resp);
+    });
+}
+
+Response client_call(ClientConn *conn, const std::vector<std::string> &args) {
+    return client_call_async(conn, args).get();
+}
+
+static ClientConn *pool_connect(ClientPool *pool) {
+    if (!pool->path.empty()) {
+        return client_connect_unix(pool->path.c_str());
+    }
+    return client_connect_tcp(pool->host.c_str(), pool->port);
+}
+
+static ClientPool *pool_fill(ClientPool *pool, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        ClientConn *conn = pool_connect(pool);
+        if (!conn) {
+            pool_free(pool);
+            return NULL;
+        }
+        pool->conns.push_back(conn);
+    }
+    return pool;
+}
+
+ClientPool *pool_new_tcp(const char *host, int port, size_t size) {
+    ClientPool *pool = new ClientPool();
+    pool->host = host;
+    pool->port = port;
+    return pool_fill(pool, size);
+}
+
+ClientPool *pool_new_unix(const char *path, size_t size) {
+    ClientPool *pool = new ClientPool();
+    pool->path = path;
+    return pool_fill(pool, size);
+}
+
+void pool_free(ClientPool *pool) {
+    for (ClientConn *conn : pool->conns) {
+        client_close(conn);
+    }
+    delete pool;
+}
+
+// the connection with the fewest requests in flight, failed ones are
+// reconnected once they have nothing pending
+ClientConn *pool_pick(ClientPool *pool) {
+    assert(!pool->conns.empty());
+    ClientConn *best = NULL;
+    for (ClientConn *&conn : pool->conns) {
+        if (conn->fd < 0 && conn->pending.empty()) {
+            if (ClientConn *fresh = pool_connect(pool)) {
+                client_close(conn);
+                conn = fresh;
+            }
+        }
+        if (conn->fd >= 0 && (!best || conn->pending.size() < best->pending.size())) {
+            best = conn;
+        }
+    }
+    return best ? best : pool->conns[0];   // a failed conn fails the request
+}
+
+int pool_poll(ClientPool *pool, int timeout_ms) {
+    return client_poll(pool->conns.data(), pool->conns.size(), timeout_ms);
+}
+
+void pool_wait(ClientPool *pool) {
+    while (pool_poll(pool, -1) >= 0) {}
+}
+
+const size_t k_cluster_max_redirects = 5;
+const size_t k_cluster_max_tries = 200;     // TRYAGAIN replies, about 2s of them
+const uint64_t k_cluster_retry_ms = 10;
+
+// a request until a node answers it with something else than a redirect
+struct ClusterRequest {
+    std::vector<std::string> args;
+    std::string frame;      // instead of `args`, see client_send_frame()
+    ReplyFn fn;
+    uint32_t slot = 0;
+    size_t redirects = 0;
+    size_t tries = 0;
+    uint64_t retry_ms = 0;  // when it is due again after TRYAGAIN
+};
+
+static uint64_t clock_msec() {
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint16_t cluster_node(ClusterConn *cc, const std::string &addr) {
+    for (size_t i = 0; i < cc->addrs.size(); i++) {
+        if (cc->addrs[i] == addr) {
+            return (uint16_t)i;
+        }
+    }
+    cc->addrs.push_back(addr);
+    cc->conns.push_back(NULL);
+    return (uint16_t)(cc->addrs.size() - 1);
+}
+
+// connected if need be, NULL if the node cannot be reached
+static ClientConn *cluster_conn(ClusterConn *cc, uint16_t node) {
+    ClientConn *&conn = cc->conns[node];
+    if (conn && conn->fd < 0 && conn->pending.empty()) {
+        cc->closed.push_back(conn);     // client_poll() may still hold it
+        conn = NULL;
+    }
+    const std::string &addr = cc->addrs[node];
+    size_t colon = addr.rfind(':');
+    if (!conn && colon != std::string::npos) {
+        conn = client_connect_tcp(addr.substr(0, colon).c_str(), atoi(addr.c_str() + colon + 1));
+        if (conn && cc->proto != 1 && !client_hello(conn, cc->proto)) {
+            client_close(conn);
+            conn = NULL;
+        }
+    }
+    return conn;
+}
+
+static void cluster_dispatch(ClusterConn *cc, std::shared_ptr<ClusterRequest> req,
+                             uint16_t node, bool asking);
+
+static void cluster_on_reply(ClusterConn *cc, std::shared_ptr<ClusterRequest> &req, Response &resp) {
+    const Reply &reply = resp.reply;
+    if (resp.status == k_client_ok && reply.tag == TAG_ERR && reply.code == ERR_TRYAGAIN
+        && req->tries < k_cluster_max_tries) {
+        req->tries++;
+        req->retry_ms = clock_msec() + k_cluster_retry_ms;
+        cc->retries.push_back(req);
+        return;
+    }
+    if (resp.status != k_client_ok || reply.tag != TAG_ERR
+        || (reply.code != ERR_MOVED && reply.code != ERR_ASK)
+        || req->redirects == k_cluster_max_redirects) {
+        return req->fn(resp);
+    }
+    std::string msg(reply.str, reply.len);
+    unsigned slot = 0;
+    char addr[64];
+    if (sscanf(msg.c_str(), "%*s %u %63s", &slot, addr) != 2 || slot >= k_cluster_slots) {
+        return req->fn(resp);
+    }
+    req->redirects++;
+    cc->redirects++;
+    uint16_t node = cluster_node(cc, addr);
+    if (reply.code == ERR_MOVED) {
+        cc->slots[slot] = node;
+    }
+    cluster_dispatch(cc, req, node, reply.code == ERR_ASK);
+}
+
+static void cluster_dispatch(ClusterConn *cc, std::shared_ptr<ClusterRequest> req,
+                             uint16_t node, bool asking) {
+    ClientConn *conn = cluster_conn(cc, node);
+    if (!conn) {
+        return reply_fail(req->fn);
+    }
+    if (asking) {
+        client_send(conn, {"asking"}, [](Response &) {});
+    }
+    ReplyFn fn = [cc, req](Response &resp) mutable {
+        cluster_on_reply(cc, req, resp);
+    };
+    if (req->frame.empty()) {
+        client_send(conn, req->args, std::move(fn));
+    } else {
+        client_send_frame(conn, req->frame, std::move(fn));
+    }
+}
+
+// the slot map from any node that answers, false if none did
+bool cluster_refresh(ClusterConn *cc) {
+    for (size_t i = 0; i < cc->addrs.size(); i++) {
+        ClientConn *conn = cluster_conn(cc, (uint16_t)i);
+        if (!conn) {
+            continue;
+        }
+        Response resp = client_call(conn, {"cluster", "slots"});
+        if (resp.status != k_client_ok || resp.reply.tag != TAG_ARR) {
+            continue;
+        }
+        for (const Reply &range : resp.reply.elems) {
+            if (range.tag != TAG_ARR || range.elems.size() != 3 || range.elems[2].tag != TAG_STR) {
+                continue;
+            }
+            uint16_t node = cluster_node(cc, std::string(range.elems[2].str, range.elems[2].len));
+            for (int64_t slot = range.elems[0].ival;
+                 slot >= 0 && slot <= range.elems[1].ival && slot < k_cluster_slots; slot++) {
+                cc->slots[(size_t)slot] = node;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+// `host:port` is any node; with no map from it, all requests go there
+ClusterConn *cluster_connect(const char *host, int port) {
+    ClusterConn *cc = new ClusterConn();
+    cluster_node(cc, std::string(host) + ":" + std::to_string(port));
+    cc->slots.assign(k_cluster_slots, 0);
+    if (!cluster_conn(cc, 0)) {
+        cluster_close(cc);
+        return NULL;
+    }
+    cluster_refresh(cc);
+    return cc;
+}
+
+void cluster_close(ClusterConn *cc) {
+    for (ClientConn *conn : cc->conns) {
+        if (conn) {
+            client_close(conn);
+        }
+    }
+    for (ClientConn *conn : cc->closed) {
+        client_close(conn);
+    }
+    for (std::shared_ptr<ClusterRequest> &req : cc->retries) {
+        reply_fail(req->fn);
+    }
+    delete cc;
+}
+
+// for the connections made from now on too; they must all be idle
+bool cluster_hello(ClusterConn *cc, uint32_t proto) {
+    for (ClientConn *conn : cc->conns) {
+        if (conn && conn->fd >= 0 && !client_hello(conn, proto)) {
+            return false;
+        }
+    }
+    cc->proto = proto;
+    return true;
+}
+
+void cluster_send(ClusterConn *cc, const std::vector<std::string> &args, ReplyFn fn) {
+    std::shared_ptr<ClusterRequest> req = std::make_shared<ClusterRequest>();
+    req->args = args;
+    req->fn = std::move(fn);
+    req->slot = args.size() >= 2 ? key_slot(args[1].data(), args[1].size()) : 0;
+    cluster_dispatch(cc, req, cc->slots[req->slot], false);
+}
+
+// the 2nd argument of an encoded request, if it is a string
+static bool frame_key(const std::string &request, uint32_t proto, const char *&key, uint32_t &len) {
+    size_t pos = proto == 2 ? 5 : 0;    // the v2 request ID and opcode
+    uint32_t nargs = 0;
+    if (request.size() < pos + 4) {
+        return false;
+    }
+    memcpy(&nargs, &request[pos], 4);
+    pos += 4;
+    bool named = proto != 2 || request[4] == OP_NAMED;
+    if (nargs < (named ? 2u : 1u)) {
+        return false;
+    }
+    for (uint32_t i = named ? 0 : 1; i < 2; i++) {
+        uint8_t tag = TAG_STR;
+        if (proto == 2) {
+            if (pos >= request.size()) {
+                return false;
+            }
+            tag = (uint8_t)request[pos++];
+        }
+        if (tag != TAG_STR) {
+            if (i == 1) {
+                return false;
+            }
+            pos += 8;
+            continue;
+        }
+        if (request.size() < pos + 4) {
+            return false;
+        }
+        memcpy(&len, &request[pos], 4);
+        pos += 4;
+        if (request.size() - pos < len) {
+            return false;
+        }
+        key = &request[pos];
+        pos += len;
+    }
+    return true;
+}
+
+// an already encoded request in the cluster's protocol, for replays
+void cluster_send_frame(ClusterConn *cc, const std::string &request, ReplyFn fn) {
+    std::shared_ptr<ClusterRequest> req = std::make_shared<ClusterRequest>();
+    req->frame = request;
+    req->fn = std::move(fn);
+    const char *key = NULL;
+    uint32_t len = 0;
+    req->slot = frame_key(request, cc->proto, key, len) ? key_slot(key, len) : 0;
+    cluster_dispatch(cc, req, cc->slots[req->slot], false);
+}
+
+Response cluster_call(ClusterConn *cc, const std::vector<std::string> &args) {
+    Response out;
+    bool done = false;
+    cluster_send(cc, args, [&out, &done](Response &resp) {
+        out = std::move(resp);
+        done = true;
+    });
+    while (!done && cluster_poll(&cc, 1, -1) >= 0) {}
+    assert(done);
+    return out;
+}
+
+size_t cluster_pending(ClusterConn *cc) {
+    size_t n = cc->retries.size();
+    for (ClientConn *conn : cc->conns) {
+        n += conn ? conn->pending.size() : 0;
+    }
+    return n;
+}
+
+// client_poll() over the connections of all of them, after sending the
+// retries that are due; it waits no longer than the next one
+int cluster_poll(ClusterConn **ccs, size_t n, int timeout_ms) {
+    std::vector<ClientConn *> conns;
+    uint64_t now_ms = clock_msec();
+    uint64_t due_ms = UINT64_MAX;
+    for (size_t i = 0; i < n; i++) {
+        ClusterConn *cc = ccs[i];
+        while (!cc->retries.empty() && cc->retries.front()->retry_ms <= now_ms) {
+            std::shared_ptr<ClusterRequest> req = std::move(cc->retries.front());
+            cc->retries.pop_front();
+            cluster_dispatch(cc, req, cc->slots[req->slot], false);
+        }
+        if (!cc->retries.empty()) {
+            due_ms = std::min(due_ms, cc->retries.front()->retry_ms);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (ClientConn *conn : ccs[i]->closed) {
+            client_close(conn);
+        }
+        ccs[i]->closed.clear();
+        for (ClientConn *conn : ccs[i]->conns) {
+            if (conn) {
+                conns.push_back(conn);
+            }
+        }
+    }
+    if (due_ms != UINT64_MAX) {
+        int wait_ms = (int)(due_ms - now_ms);
+        timeout_ms = timeout_ms < 0 ? wait_ms : std::min(timeout_ms, wait_ms);
+    }
+    int rv = client_poll(conns.data(), conns.size(), timeout_ms);
+    if (rv < 0 && due_ms != UINT64_MAX) {
+        usleep((useconds_t)(due_ms - now_ms) * 1000);   // nothing else to wait on
+        return 0;
+    }
+    return rv;
+}
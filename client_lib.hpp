@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+enum {
+    TAG_NIL = 0,
+    TAG_ERR = 1,
+    TAG_STR = 2,
+    TAG_INT = 3,
+    TAG_DBL = 4,
+    TAG_ARR = 5,
+};
+
+// protocol v2 opcodes, see server.cpp
+enum {
+    OP_NAMED        = 0,    // the command name is the first argument
+    OP_GET          = 1,
+    OP_SET          = 2,
+    OP_DEL          = 3,
+    OP_KEYS         = 4,
+    OP_INCR         = 5,
+    OP_DECR         = 6,
+    OP_INCRBY       = 7,
+    OP_DECRBY       = 8,
+    OP_INCRBYFLOAT  = 9,
+    OP_SADD         = 10,
+    OP_SREM         = 11,
+    OP_SSCORE       = 12,
+    OP_SQUERY       = 13,
+    OP_SREVQUERY    = 14,
+    OP_ZRANK        = 15,
+    OP_ZREVRANK     = 16,
+    OP_ZCOUNT       = 17,
+    OP_MEMORY       = 18,
+    OP_MAINT        = 19,
+    OP_SLOWLOG      = 20,
+    OP_HELLO        = 21,
+    OP_ZUNIONSTORE  = 22,
+    OP_ZINTERSTORE  = 23,
+    OP_ZPOPMIN      = 24,
+    OP_ZPOPMAX      = 25,
+    OP_SUBSCRIBE    = 26,
+    OP_UNSUBSCRIBE  = 27,
+    OP_PUBLISH      = 28,
+};
+
+// error codes the client acts on, see server.cpp
+enum {
+    ERR_MOVED       = 6,    // "MOVED <slot> <addr>", the slot is served there
+    ERR_ASK         = 7,    // "ASK <slot> <addr>", only this request goes there
+    ERR_TRYAGAIN    = 9,    // the keys are being migrated, retried a little later
+};
+
+// a typed v2 request argument, TAG_STR, TAG_INT or TAG_DBL
+struct 
+ClientArg {
+    uint8_t tag = TAG_STR;
+    std::string str;
+    int64_t ival = 0;
+    double dval = 0;
+};
+
+inline ClientArg arg_str(const std::string &s) {
+    ClientArg arg;
+    arg.str = s;
+    return arg;
+}
+
+inline ClientArg arg_int(int64_t val) {
+    ClientArg arg;
+    arg.tag = TAG_INT;
+    arg.ival = val;
+    return arg;
+}
+
+inline ClientArg arg_dbl(double val) {
+    ClientArg arg;
+    arg.tag = TAG_DBL;
+    arg.dval = val;
+    return arg;
+}
+
+// a decoded reply; `str` points into the frame of the owning Response
+struct 
+Reply {
+    uint8_t tag = TAG_NIL;
+    int32_t code = 0;           // TAG_ERR, `str` holds the message
+    const char *str = NULL;     // TAG_STR and TAG_ERR
+    uint32_t len = 0;
+    int64_t ival = 0;           // TAG_INT
+    double dval = 0;            // TAG_DBL
+    std::vector<Reply> elems;   // TAG_ARR
+};
+
+const int32_t k_client_ok = 0;
+const int32_t k_client_io_error = -1;   // the request failed, or its connection did
+const uint32_t k_client_push_id = UINT32_MAX;   // the v2 request ID of pub/sub messages
+
+// The frame is not copied out of the buffer it was read into; `data` keeps
+// that buffer, shared with the other replies of the same reads, alive for
+// as long as any Response from it is.
+struct 
+Response {
+    int32_t status = k_client_ok;
+    uint32_t id = 0;                // the request ID under protocol v2
+    std::shared_ptr<const std::vector<uint8_t>> data;
+    const uint8_t *frame = NULL;    // in `data`, without the request ID
+    size_t frame_len = 0;
+    Reply reply;
+};
+
+typedef std::function<void(Response &)> ReplyFn;
+
+// Requests are queued and go out coalesced in as few writes as possible the
+// next time the connection is driven; replies are matched to them in order.
+// After client_hello(conn, 2) every request is sent as v2, string ones
+// with OP_NAMED, and gets the next request ID. Messages of subscribed
+// channels, which only v2 conns may have, go to `on_push` or are dropped.
+//
+// Callbacks may send more requests, and wait for them with client_call()
+// or a future's get(), on any connection. They may also client_close()
+// their own connection, which is then freed once the outermost
+// client_poll() driving it returns, so nothing may use it after that.
+struct 
+ClientConn {
+    int fd = -1;
+    uint32_t proto = 1;
+    uint32_t next_id = 0;
+    std::vector<uint8_t> outgoing;
+    std::shared_ptr<std::vector<uint8_t>> incoming;
+    size_t incoming_pos = 0;    // the bytes before it are dispatched
+    std::deque<ReplyFn> pending;
+    std::deque<uint32_t> pending_ids;   // v2 only
+    ReplyFn on_push;    // polled for even with nothing pending when set
+    uint32_t busy = 0;  // in client_poll() or client_close()
+    bool closing = false;
+};
+
+ClientConn *client_connect_tcp(const char *host, int port);
+ClientConn *client_connect_unix(const char *path);
+void client_close(ClientConn *conn);
+bool client_hello(ClientConn *conn, uint32_t proto);
+void client_send(ClientConn *conn, const std::vector<std::string> &args, ReplyFn fn);
+void client_send_typed(ClientConn *conn, uint8_t op, const std::vector<ClientArg> &args, ReplyFn fn);
+void client_send_frame(ClientConn *conn, const std::string &request, ReplyFn fn);
+std::future<Response> client_call_async(ClientConn *conn, const std::vector<std::string> &args);
+Response client_call(ClientConn *conn, const std::vector<std::string> &args);
+int client_poll(ClientConn **conns, size_t n, int timeout_ms);
+void client_wait(ClientConn *conn);
+int32_t reply_parse(const uint8_t *data, size_t size, Reply &out);
+
+// connections to one server; requests go to the least busy one
+struct 
+ClientPool {
+    std::string host;
+    int port = 0;
+    std::string path;   // Unix socket instead of host:port when set
+    std::vector<ClientConn *> conns;
+};
+
+ClientPool *pool_new_tcp(const char *host, int port, size_t size);
+ClientPool *pool_new_unix(const char *path, size_t size);
+void pool_free(ClientPool *pool);
+ClientConn *pool_pick(ClientPool *pool);
+int pool_poll(ClientPool *pool, int timeout_ms);
+void pool_wait(ClientPool *pool);
+
+// A connection to each node of a cluster, see cluster.hpp. Requests go
+// straight to the node serving the slot of their key, the 2nd argument,
+// by a slot map loaded with `cluster slots` and corrected by each MOVED
+// redirect; an ASK redirect is followed for that request only. Nodes are
+// connected to when first used. A request turned away with TRYAGAIN is sent
+// again by cluster_poll() a few milliseconds later. Against a server not in
+// cluster mode every request goes to it.
+struct ClusterRequest;
+
+struct 
+ClusterConn {
+    uint32_t proto = 1;
+    std::vector<std::string> addrs;     // "addr:port" by node index
+    std::vector<ClientConn *> conns;    // by node index, NULL until used
+    std::vector<ClientConn *> closed;   // replaced while polled, freed later
+    std::vector<uint16_t> slots;        // node index by slot
+    std::deque<std::shared_ptr<ClusterRequest>> retries;    // by due time
+    uint64_t redirects = 0;
+};
+
+ClusterConn *cluster_connect(const char *host, int port);
+void cluster_close(ClusterConn *cc);
+bool cluster_refresh(ClusterConn *cc);
+bool cluster_hello(ClusterConn *cc, uint32_t proto);
+void cluster_send(ClusterConn *cc, const std::vector<std::string> &args, ReplyFn fn);
+void cluster_send_frame(ClusterConn *cc, const std::string &request, ReplyFn fn);
+Response cluster_call(ClusterConn *cc, const std::vector<std::string> &args);
+size_t cluster_pending(ClusterConn *cc);
+int cluster_poll(ClusterConn **ccs, size_t n, int timeout_ms);
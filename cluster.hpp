@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "usual.hpp"
+
+
+// Cluster mode splits the keyspace into fixed hash slots, each served by one
+// server process. A key's slot comes from str_hash() of the key, or only of
+// its first `{tag}` if that is not empty, so that keys sharing a tag share a
+// slot and a server. The server and the client library must agree on it.
+
+const uint32_t k_cluster_slots = 16384;
+
+inline uint32_t key_slot(const char *key, size_t len) {
+    const char *open = (const char *)memchr(key, '{', len);
+    if (open) {
+        size_t rest = len - (size_t)(open + 1 - key);
+        const char *close = (const char *)memchr(open + 1, '}', rest);
+        if (close && close > open + 1) {
+            key = open + 1;
+            len = (size_t)(close - key);
+        }
+    }
+    // the low bits of FNV only depend on the low bits of each step
+    uint64_t h = str_hash((const uint8_t *)key, len);
+    return (uint32_t)((h ^ h >> 16) % k_cluster_slots);
+}
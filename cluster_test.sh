@@ -0,0 +1,203 @@
+#!/bin/bash
+# Cluster mode end to end: starts 3 nodes on local ports and checks the
+# redirects (MOVED, ASK and `asking`, CROSSSLOT, TRYAGAIN) and a slot
+# migration under concurrent writes.
+#
+#   ./cluster_test.sh [DIR]     DIR holds the `server` and `client` binaries
+#
+# PORT (default 7101) is the first of the 3 ports. Exits non-zero on the
+# first failed check and leaves the node logs in a temporary directory.
+
+DIR=${1:-.}
+SERVER=$DIR/server
+CLIENT=$DIR/client
+PORT=${PORT:-7101}
+P1=$PORT
+P2=$((PORT + 1))
+P3=$((PORT + 2))
+A1=127.0.0.1:$P1
+A2=127.0.0.1:$P2
+A3=127.0.0.1:$P3
+MAP="0-5460=$A1 5461-10922=$A2 10923-16383=$A3"
+LOGS=$(mktemp -d)
+PIDS=()
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -CONT "$pid" 2>/dev/null
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    echo "logs in $LOGS"
+    exit 1
+}
+
+# expect WANT CMD...: the first line of CMD's output starts with WANT
+expect() {
+    local want=$1
+    shift
+    local got
+    got=$("$@" 2>&1 | head -n 1)
+    [[ "$got" == "$want"* ]] || fail "$*: got '$got', want '$want...'"
+}
+
+cli() {
+    local port=$1
+    shift
+    "$CLIENT" -p "$port" "$@"
+}
+
+# the value of a `cluster info` stat
+info() {
+    cli "$1" cluster info | grep -A 1 -x "(str) $2" | tail -n 1 | cut -d ' ' -f 2
+}
+
+# stat_is PORT NAME VALUE
+stat_is() {
+    [[ $(info "$1" "$2") == "$3" ]]
+}
+
+slot_of() {
+    cli "$P1" cluster keyslot "$1" | cut -d ' ' -f 2
+}
+
+# a key whose slot is in [lo, hi], made of the prefix and a counter
+key_in() {
+    local prefix=$1 lo=$2 hi=$3 i=0 slot
+    while true; do
+        slot=$(slot_of "$prefix$i")
+        if ((slot >= lo && slot <= hi)); then
+            echo "$prefix$i"
+            return
+        fi
+        i=$((i + 1))
+    done
+}
+
+# the bytes of a v1 request, for what takes more than one request per
+# connection: u32 length, u32 count, then (u32 length, bytes) per argument
+le32() {
+    printf -v "$1" '\\x%02x\\x%02x\\x%02x\\x%02x' $(($2 & 255)) $((($2 >> 8) & 255)) \
+        $((($2 >> 16) & 255)) $((($2 >> 24) & 255))
+}
+
+frame() {
+    local body len arg hex
+    le32 body $#
+    len=4
+    for arg in "$@"; do
+        le32 hex ${#arg}
+        body+=$hex$arg
+        len=$((len + 4 + ${#arg}))
+    done
+    le32 hex $len
+    printf '%b' "$hex$body"
+}
+
+wait_for() {
+    local what=$1 tries=$2 i
+    shift 2
+    for ((i = 0; i < tries; i++)); do
+        "$@" && return 0
+        sleep 0.05
+    done
+    fail "timed out waiting for $what"
+}
+
+[[ -x $SERVER && -x $CLIENT ]] || fail "no $SERVER or $CLIENT, build them first"
+for port in $P1 $P2 $P3; do
+    # small batches, so that the migration takes long enough to watch
+    "$SERVER" --port "$port" --cluster yes --cluster-map "$MAP" \
+        --cluster-migrate-batch 10 --logfile "$LOGS/$port.log" &
+    PIDS+=($!)
+done
+for port in $P1 $P2 $P3; do
+    wait_for "node $port" 50 cli "$port" cluster info >/dev/null 2>&1
+done
+
+echo "redirects"
+K2=$(key_in k 5461 10922)
+expect "(err) 6 MOVED $(slot_of "$K2") $A2" cli "$P1" set "$K2" v
+expect "(nil)" cli "$P1" -C set "$K2" v
+expect "(str) v" cli "$P3" -C get "$K2"
+K1=$(key_in k 0 5460)
+expect "(err) 8" cli "$P1" zunionstore "$K1" 1 "$K2"
+expect "(int) 0" cli "$P1" zunionstore "{$K1}d" 1 "{$K1}s"
+
+# an importing slot takes a request only right after `asking`
+K1B=$(key_in ask 0 5460)
+S1B=$(slot_of "$K1B")
+expect "(nil)" cli "$P2" cluster importing "$S1B" "$A1"
+expect "(err) 6 MOVED $S1B $A1" cli "$P2" get "$K1B"
+exec 3<>"/dev/tcp/127.0.0.1/$P2"
+{ frame asking; frame set "$K1B" imported; } >&3
+got=$(head -c 10 <&3 | od -An -tx1 | tr -d ' \n')
+exec 3>&-
+[[ $got == 01000000000100000000 ]] || fail "asking then set: got $got"
+expect "(nil)" cli "$P2" cluster setslot "$S1B" "$A1"
+
+echo "migration"
+# one slot full of keys, moved from node 1 to node 2 under writes
+TAG=$(key_in t 0 5460)
+SLOT=$(slot_of "$TAG")
+NKEYS=20000
+{
+    for ((i = 0; i < NKEYS; i++)); do
+        frame set "{$TAG}k$i" "v$i"
+    done
+} > "$LOGS/load.bin"
+exec 3<>"/dev/tcp/127.0.0.1/$P1"
+cat "$LOGS/load.bin" >&3
+got=$(head -c $((5 * NKEYS)) <&3 | tr -d '\000' | tr -s '\001')
+exec 3>&-
+[[ $got == $'\001' ]] || fail "loading the slot"
+
+NWRITERS=4
+NINCR=150
+for ((w = 0; w < NWRITERS; w++)); do
+    (
+        for ((i = 0; i < NINCR; i++)); do
+            out=$(cli "$P1" -C incr "{$TAG}c$w")
+            [[ $out == "(int) "* ]] || echo "$out" >> "$LOGS/writer.err"
+        done
+    ) &
+    WRITERS+=($!)
+done
+sleep 0.2
+
+expect "(nil)" cli "$P1" cluster migrate "$SLOT" "$A2"
+wait_for "the slot to migrate" 50 stat_is "$P1" slots.migrating 1
+# with the target stopped the migration stalls halfway
+kill -STOP "${PIDS[1]}"
+expect "(err) 7 ASK $SLOT $A2" cli "$P1" get "{$TAG}absent"
+tryagain=
+for ((i = 0; i < NKEYS && !tryagain; i += 97)); do
+    out=$(cli "$P1" zunionstore "{$TAG}dst" 2 "{$TAG}k$i" "{$TAG}absent")
+    [[ $out == "(err) 9 "* ]] && tryagain=1
+done
+[[ $tryagain ]] || fail "no TRYAGAIN while migrating"
+sleep 1.5
+kill -CONT "${PIDS[1]}"
+
+wait_for "the migration to finish" 100 stat_is "$P1" migrate.done 1
+for pid in "${WRITERS[@]}"; do
+    wait "$pid"
+done
+[[ -s $LOGS/writer.err ]] && fail "writes failed: $(head -n 3 "$LOGS/writer.err")"
+expect "(err) 6 MOVED $SLOT $A2" cli "$P1" get "{$TAG}k0"
+expect "(str) v0" cli "$P2" get "{$TAG}k0"
+expect "(str) v$((NKEYS - 1))" cli "$P3" -C get "{$TAG}k$((NKEYS - 1))"
+for ((w = 0; w < NWRITERS; w++)); do
+    expect "(str) $NINCR" cli "$P1" -C get "{$TAG}c$w"
+done
+left=$(cli "$P1" keys | grep -cF "{$TAG}")
+[[ $left == 0 ]] || fail "$left keys of the slot left on the source"
+moved=$(cli "$P2" keys | grep -cF "{$TAG}")
+[[ $moved == $((NKEYS + NWRITERS)) ]] || fail "$moved keys of the slot on the target"
+
+echo "ok"
@@ -0,0 +1,120 @@
+#include <assert.h>
+#include <unordered_map>
+#include <vector>
+#include "defrag.hpp"
+
+
+struct 
+Rejected {
+    void *ptr = NULL;
+    void (*dealloc)(void *) = NULL;
+};
+
+static bool g_enabled = false;
+static std::unordered_map<uintptr_t, uint32_t> g_pages;    // live bytes by page
+static size_t g_live = 0;
+static uint64_t g_moved = 0;
+static uint64_t g_reclaimed = 0;
+static std::vector<Rejected> g_rejected;    // held so the allocator offers others
+
+const size_t k_defrag_tries = 8;    // blocks looked at per defrag_alloc()
+
+static uintptr_t page_of(void *ptr) {
+    return (uintptr_t)ptr / k_defrag_page;
+}
+
+static size_t page_live(void *ptr) {
+    auto it = g_pages.find(page_of(ptr));
+    return it == g_pages.end() ? 0 : it->second;
+}
+
+void defrag_enable() {
+    g_enabled = true;
+}
+
+bool defrag_enabled() {
+    return g_enabled;
+}
+
+// a block spanning two pages is counted on the first
+void defrag_note_alloc(void *ptr, size_t size) {
+    if (!g_enabled) {
+        return;
+    }
+    g_pages[page_of(ptr)] += (uint32_t)size;
+    g_live += size;
+}
+
+static bool page_sub(void *ptr, size_t size) {
+    auto it = g_pages.find(page_of(ptr));
+    assert(it != g_pages.end() && it->second >= size);
+    g_live -= size;
+    it->second -= (uint32_t)size;
+    if (it->second == 0) {
+        g_pages.erase(it);
+        return true;
+    }
+    return false;
+}
+
+void defrag_note_free(void *ptr, size_t size) {
+    if (g_enabled) {
+        page_sub(ptr, size);
+    }
+}
+
+void defrag_note_move(void *old, void *ptr, size_t size) {
+    defrag_note_alloc(ptr, size);
+    if (page_sub(old, size)) {
+        g_reclaimed += k_defrag_page;
+    }
+    g_moved++;
+}
+
+// less full than the average page, as with jemalloc's defrag hint
+bool defrag_sparse(void *ptr) {
+    return g_enabled && !g_pages.empty() && page_live(ptr) * g_pages.size() < g_live;
+}
+
+// A block for moving `old` into, on a page fuller than its own, or NULL if
+// none of the blocks the allocator offers is. The rejected ones are held
+// until defrag_alloc_done(), or the allocator would offer them again.
+void *defrag_alloc(void *old, size_t size, void *(*alloc)(size_t), void (*dealloc)(void *)) {
+    size_t old_live = page_live(old);
+    for (size_t i = 0; i < k_defrag_tries; i++) {
+        void *ptr = alloc(size);
+        assert(ptr);
+        if (page_of(ptr) != page_of(old) && page_live(ptr) >= old_live) {
+            return ptr;
+        }
+        Rejected rej;
+        rej.ptr = ptr;
+        rej.dealloc = dealloc;
+        g_rejected.push_back(rej);
+    }
+    return NULL;
+}
+
+void defrag_alloc_done() {
+    for (Rejected &rej : g_rejected) {
+        rej.dealloc(rej.ptr);
+    }
+    g_rejected.clear();
+}
+
+size_t defrag_live_bytes() {
+    return g_live;
+}
+
+// the footprint of the counted blocks, in whole pages
+size_t defrag_page_bytes() {
+    return g_pages.size() * k_defrag_page;
+}
+
+uint64_t defrag_moved() {
+    return g_moved;
+}
+
+uint64_t defrag_reclaimed() {
+    return g_reclaimed;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Active defragmentation support. The allocator tells nothing about how full
+// its pages are, so the owners of movable allocations (Entry, SSNode) report
+// them here and the live bytes of each page are counted. To move one, get a
+// block on a fuller page from defrag_alloc(), copy it, fix up the pointers to
+// it and report the old one freed. Nothing is counted until defrag_enable().
+
+const size_t k_defrag_page = 4096;
+
+void defrag_enable();
+bool defrag_enabled();
+void defrag_note_alloc(void *ptr, size_t size);
+void defrag_note_free(void *ptr, size_t size);
+void defrag_note_move(void *old, void *ptr, size_t size);
+bool defrag_sparse(void *ptr);
+void *defrag_alloc(void *old, size_t size, void *(*alloc)(size_t), void (*dealloc)(void *));
+void defrag_alloc_done();
+size_t defrag_live_bytes();
+size_t defrag_page_bytes();
+uint64_t defrag_moved();
+uint64_t defrag_reclaimed();    // bytes of the pages emptied by moves
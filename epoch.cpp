@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <sched.h>
+#include <vector>
+#include "epoch.hpp"
+
+
+struct alignas(64) 
+EpochSlot {
+    uint64_t epoch = 0;     // 0 while the reader is outside
+};
+
+struct 
+Retired {
+    void *ptr = NULL;
+    void (*fn)(void *) = NULL;
+    uint64_t epoch = 0;
+};
+
+static uint64_t g_epoch = 1;
+static uint32_t g_nreaders = 0;
+static EpochSlot g_slots[k_max_readers];
+static std::vector<Retired> g_limbo;    // oldest first, writer only
+
+static uint64_t g_seq = 0;  // odd while the writer is modifying the keyspace
+static uint32_t g_seq_depth = 0;    // writer only, nested sections count once
+
+void epoch_init(uint32_t nreaders) {
+    assert(nreaders <= k_max_readers);
+    g_nreaders = nreaders;
+}
+
+void epoch_enter(uint32_t reader) {
+    uint64_t epoch = __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_slots[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(uint32_t reader) {
+    __atomic_store_n(&g_slots[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void *ptr, void (*fn)(void *)) {
+    if (g_nreaders == 0) {
+        return fn(ptr);
+    }
+    g_limbo.push_back(Retired{ptr, fn, g_epoch});
+}
+
+// called by the writer between modifications
+void epoch_reclaim() {
+    if (g_limbo.empty()) {
+        return;
+    }
+    // a reader that enters from now on cannot reach anything retired so far
+    uint64_t oldest = __atomic_add_fetch(&g_epoch, 1, __ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < g_nreaders; i++) {
+        uint64_t epoch = __atomic_load_n(&g_slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    size_t n = 0;
+    while (n < g_limbo.size() && g_limbo[n].epoch < oldest) {
+        g_limbo[n].fn(g_limbo[n].ptr);
+        n++;
+    }
+    g_limbo.erase(g_limbo.begin(), g_limbo.begin() + n);
+}
+
+void seq_write_begin() {
+    if (g_seq_depth++ > 0) {
+        return;
+    }
+    __atomic_store_n(&g_seq, g_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seq_write_end() {
+    assert(g_seq_depth > 0);
+    if (--g_seq_depth > 0) {
+        return;
+    }
+    __atomic_store_n(&g_seq, g_seq + 1, __ATOMIC_RELEASE);
+}
+
+const uint32_t k_seq_spins = 64;
+
+uint64_t seq_read_begin() {
+    for (uint32_t i = 0; ; i++) {
+        uint64_t seq = __atomic_load_n(&g_seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            return seq;
+        }
+        if (i >= k_seq_spins) {
+            sched_yield();  // the writer may be preempted mid-write
+        }
+    }
+}
+
+// true if the writer has been active since seq_read_begin() returned `seq`
+bool seq_read_retry(uint64_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&g_seq, __ATOMIC_RELAXED) != seq;
+}
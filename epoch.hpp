@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Concurrent-read support: one writer thread modifies the keyspace, reader
+// threads look it up without locks.
+// - new nodes are published with release stores and removed ones unlinked
+//   the same way, which readers may see at any time;
+// - the writer brackets the steps that readers could misread, relinking
+//   nodes that stay reachable and changing values in place, with
+//   seq_write_begin/end, which nest; readers check seq_read_retry() before
+//   trusting what they read and start over;
+// - memory unlinked by the writer goes through epoch_retire() and is freed
+//   only once no reader that could still reach it is inside epoch_enter/exit.
+// With no reader threads configured epoch_retire() frees right away.
+
+const uint32_t k_max_readers = 64;
+
+void epoch_init(uint32_t nreaders);
+void epoch_enter(uint32_t reader);
+void epoch_exit(uint32_t reader);
+void epoch_retire(void *ptr, void (*fn)(void *));
+void epoch_reclaim();
+
+void seq_write_begin();
+void seq_write_end();
+uint64_t seq_read_begin();
+bool seq_read_retry(uint64_t seq);
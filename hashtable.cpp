@@ -1,6 +1,7 @@
 #include <stdlib.h>   
 #include <assert.h>
 #include "hashtable.hpp"
+#include "epoch.hpp"
 
 static void h_init(HTab *htab, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);
@@ -9,62 +10,37 @@ static void h_init(HTab *htab, size_t n) {
     htab->size = 0;
 }
 
-static HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    if (!htab->slots) {
-        return NULL;
-    }
-
-    size_t pos = key->hashcode & htab->mask;
-    HNode **from = &htab->slots[pos];    
-    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
-        if (cur->hashcode == key->hashcode && eq(cur, key)) {
-            return from;                
-        }
-    }
-    return NULL;
-}
-
 static void h_insert(HTab *htab, HNode *node) {
     size_t pos = node->hashcode & htab->mask;
     HNode *next = htab->slots[pos];
     node->next = next;
-    htab->slots[pos] = node;
+    __atomic_store_n(&htab->slots[pos], node, __ATOMIC_RELEASE);    // seen by readers
     htab->size++;
 }
 
+// the C-style API, for tables whose comparator is only known at run time;
+// HashMap in the header inlines it instead
 
-static HNode *h_detach(HTab *htab, HNode **from) {
-    HNode *node = *from;    
-    *from = node->next;     
-    htab->size--;
-    return node;
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    auto match = [key, eq](HNode *node) { return eq(node, key); };
+    return hm_find(hmap, key->hashcode, match);
 }
 
-static bool h_foreach(HTab *htab, bool (*fptr)(HNode *, void *), void *arg) {
-    for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {
-        for (HNode *node = htab->slots[i]; node != NULL; node = node->next) {
-            if (!fptr(node, arg)) {
-                return false;
-            }
-        }
-    }
-    return true;
+HNode *hm_lookup_ro(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *), uint64_t seq) {
+    auto match = [key, eq](HNode *node) { return eq(node, key); };
+    return hm_find_ro(hmap, key->hashcode, match, seq);
 }
 
-const size_t k_rehashing_work = 256;    
-
-HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
-    HNode **from = h_lookup(&hmap->bigger, key, eq);
-    if (!from) {
-        from = h_lookup(&hmap->smaller, key, eq);
+// Moves up to `nwork` nodes of an unfinished rehash, returns how many it did.
+// A moved node links into another chain, which would lead a reader on it
+// astray, hence the write section.
+size_t hm_rehash(HMap *hmap, size_t nwork) {
+    if (!hmap->smaller.slots) {
+        return 0;
     }
-    return from ? *from : NULL;
-}
-
-static void hm_help_rehashing(HMap *hmap) {
-    size_t nwork = 0;
-    while (nwork < k_rehashing_work && hmap->smaller.size > 0) {
+    size_t done = 0;
+    seq_write_begin();
+    while (done < nwork && hmap->smaller.size > 0) {
         
         HNode **from = &hmap->smaller.slots[hmap->mig_ptr];
         if (!*from) {
@@ -73,21 +49,25 @@ static void hm_help_rehashing(HMap *hmap) {
         }
         
         h_insert(&hmap->bigger, h_detach(&hmap->smaller, from));
-        nwork++;
+        done++;
     }
     
     if (hmap->smaller.size == 0 && hmap->smaller.slots) {
-        free(hmap->smaller.slots);
+        epoch_retire(hmap->smaller.slots, &free);
         hmap->smaller = HTab{};
     }
+    seq_write_end();
+    return done;
 }
 
 static void hm_trigger_rehashing(HMap *hmap) {
     assert(hmap->smaller.slots == NULL);
     
+    seq_write_begin();
     hmap->smaller = hmap->bigger;
     h_init(&hmap->bigger, (hmap->bigger.mask + 1) * 2);
     hmap->mig_ptr = 0;
+    seq_write_end();
 }
 
 
@@ -109,20 +89,81 @@ void hm_insert(HMap *hmap, HNode *node) {
 }
 
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
-    if (HNode **from = h_lookup(&hmap->bigger, key, eq)) {
-        return h_detach(&hmap->bigger, from);
+    auto match = [key, eq](HNode *node) { return eq(node, key); };
+    return hm_take(hmap, key->hashcode, match);
+}
+
+const size_t k_shrink_load_factor = 4;     // the load a shrunk table starts at
+
+static bool hm_underloaded(HMap *hmap) {
+    size_t nslots = hmap->bigger.mask + 1;
+    return hmap->bigger.slots && nslots > 4 && hmap->bigger.size < nslots;
+}
+
+// Only deletes get the load below 1, since growing keeps it at 8 or more.
+// Shrinking reuses the migration: `bigger` is simply the newer table.
+bool hm_shrink(HMap *hmap) {
+    if (hmap->smaller.slots || !hm_underloaded(hmap)) {
+        return false;
+    }
+    size_t nslots = 4;
+    while (nslots * k_shrink_load_factor < hmap->bigger.size) {
+        nslots *= 2;
+    }
+    seq_write_begin();
+    hmap->smaller = hmap->bigger;
+    h_init(&hmap->bigger, nslots);
+    hmap->mig_ptr = 0;
+    seq_write_end();
+    return true;
+}
+
+// true while a rehash is unfinished or the table is due to shrink
+bool hm_pending_work(HMap *hmap) {
+    return hmap->smaller.slots || hm_underloaded(hmap);
+}
+
+static bool h_replace(HTab *htab, HNode *old, HNode *node) {
+    if (!htab->slots) {
+        return false;
+    }
+    for (HNode **from = &htab->slots[old->hashcode & htab->mask]; *from; from = &(*from)->next) {
+        if (*from == old) {
+            node->next = old->next;
+            __atomic_store_n(from, node, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
+
+// puts `node` in the place of `old`, for moving a node to another address
+bool hm_replace(HMap *hmap, HNode *old, HNode *node) {
+    return h_replace(&hmap->bigger, old, node) || h_replace(&hmap->smaller, old, node);
+}
+
+// Calls `fn` on the nodes of one slot of the newer table, which it may
+// replace, for passes over the keys in small steps. Returns the slot to
+// continue from, 0 once past the end. Resizing in between can make a pass
+// skip or repeat keys.
+size_t hm_scan(HMap *hmap, size_t slot, void (*fn)(HNode *, void *), void *arg) {
+    HTab *htab = &hmap->bigger;
+    if (!htab->slots || slot > htab->mask) {
+        return 0;
     }
-    if (HNode **from = h_lookup(&hmap->smaller, key, eq)) {
-        return h_detach(&hmap->smaller, from);
+    for (HNode *node = htab->slots[slot], *next; node; node = next) {
+        next = node->next;
+        fn(node, arg);
     }
-    return NULL;
+    return slot == htab->mask ? 0 : slot + 1;
 }
 
 void hm_clear(HMap *hmap) {
-    free(hmap->bigger.slots);
-    free(hmap->smaller.slots);
+    if (hmap->bigger.slots) epoch_retire(hmap->bigger.slots, &free);
+    if (hmap->smaller.slots) epoch_retire(hmap->smaller.slots, &free);
+    seq_write_begin();
     *hmap = HMap{};
+    seq_write_end();
 }
 
 size_t hm_size(HMap *hmap) {
@@ -130,5 +171,84 @@ size_t hm_size(HMap *hmap) {
 }
 
 void hm_foreach(HMap *hmap, bool (*fptr)(HNode *, void *), void *arg) {
-    h_foreach(&hmap->bigger, fptr, arg) && h_foreach(&hmap->smaller, fptr, arg);
+    auto visit = [fptr, arg](HNode *node) { return fptr(node, arg); };
+    h_foreach(&hmap->bigger, visit) && h_foreach(&hmap->smaller, visit);
+}
+
+static size_t h_mem_usage(HTab *htab) {
+    return htab->slots ? (htab->mask + 1) * sizeof(HNode *) : 0;
+}
+
+// bytes held by the slot arrays, the nodes are accounted by their owners
+size_t hm_mem_usage(HMap *hmap) {
+    return h_mem_usage(&hmap->bigger) + h_mem_usage(&hmap->smaller);
+}
+
+const size_t k_prefetch_rounds = 32;
+
+// For a batch of lookups: walks the chains of all the keys together, one
+// node per key per round, prefetching the node the next round will read,
+// so that the cache misses of the whole batch overlap. Each walk stops at
+// the first node with a matching hashcode, which the lookup compares anyway.
+void hm_prefetch(HMap *hmap, const uint64_t *hcodes, size_t n) {
+    HTab *tabs[2] = {&hmap->bigger, &hmap->smaller};
+    HNode *cur[2 * k_max_prefetch] = {};
+    assert(n <= k_max_prefetch);
+    for (size_t t = 0; t < 2; t++) {
+        for (size_t i = 0; tabs[t]->slots && i < n; i++) {
+            __builtin_prefetch(&tabs[t]->slots[hcodes[i] & tabs[t]->mask]);
+        }
+    }
+    for (size_t t = 0; t < 2; t++) {
+        for (size_t i = 0; tabs[t]->slots && i < n; i++) {
+            cur[t * n + i] = tabs[t]->slots[hcodes[i] & tabs[t]->mask];
+            __builtin_prefetch(cur[t * n + i]);
+        }
+    }
+    for (size_t round = 0, active = 2 * n; round < k_prefetch_rounds && active; round++) {
+        active = 0;
+        for (size_t j = 0; j < 2 * n; j++) {
+            HNode *node = cur[j];
+            if (!node || node->hashcode == hcodes[j % n]) {
+                continue;
+            }
+            cur[j] = node->next;
+            __builtin_prefetch(node->next);
+            active++;
+        }
+    }
+}
+
+const size_t k_sample_scan = 64;    // slots tried past an empty one
+
+static uint64_t sample_mix(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+// Picks up to `n` nodes at positions derived from `seed`: a random slot,
+// then a random depth into its chain. For approximate eviction, so the picks
+// are neither uniform nor distinct, but each one costs a bounded walk.
+size_t hm_sample(HMap *hmap, uint64_t seed, HNode **out, size_t n) {
+    size_t total = hm_size(hmap), count = 0;
+    for (size_t i = 0; total > 0 && i < n; i++) {
+        uint64_t r = sample_mix(seed);
+        HTab *htab = r % total < hmap->bigger.size ? &hmap->bigger : &hmap->smaller;
+        r = sample_mix(seed);
+        HNode *head = NULL;
+        for (size_t j = 0; !head && j < k_sample_scan; j++) {
+            head = htab->slots[(r + j) & htab->mask];
+        }
+        if (!head) {
+            continue;
+        }
+        HNode *node = head;
+        for (size_t depth = (r >> 32) % k_max_load_factor; depth > 0; depth--) {
+            node = node->next ? node->next : head;
+        }
+        out[count++] = node;
+    }
+    return count;
 }
@@ -1,8 +1,12 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include "epoch.hpp"
 
 
+const size_t k_max_prefetch = 16;    // keys per hm_prefetch() batch
+const size_t k_rehashing_work = 256;    // nodes moved per lookup, insert or delete
+
 struct 
 HNode {
     HNode *next = NULL;
@@ -24,8 +28,173 @@ HMap {
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+HNode *hm_lookup_ro(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *), uint64_t seq);
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
 void hm_clear(HMap *hmap);
 void hm_foreach(HMap *hmap, bool (*fptr)(HNode *, void *), void *arg);
+size_t hm_mem_usage(HMap *hmap);
+void hm_prefetch(HMap *hmap, const uint64_t *hcodes, size_t n);
+size_t hm_sample(HMap *hmap, uint64_t seed, HNode **out, size_t n);
+size_t hm_rehash(HMap *hmap, size_t nwork);
+bool hm_shrink(HMap *hmap);
+bool hm_pending_work(HMap *hmap);
+bool hm_replace(HMap *hmap, HNode *old, HNode *node);
+size_t hm_scan(HMap *hmap, size_t slot, void (*fn)(HNode *, void *), void *arg);
+
+// The walks that compare keys, shared by the hm_* functions above and by
+// HashMap below. `match` is any callable taking an HNode *, so a comparator
+// known at compile time is inlined into the loop.
+
+template <class Match>
+HNode **h_find(HTab *htab, uint64_t hcode, Match &match) {
+    if (!htab->slots) {
+        return NULL;
+    }
+    HNode **from = &htab->slots[hcode & htab->mask];
+    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
+        if (cur->hashcode == hcode && match(cur)) {
+            return from;
+        }
+    }
+    return NULL;
+}
+
+// for reader threads: nothing is modified and every step is validated against
+// the writer, whose activity makes it return NULL for the caller to retry
+template <class Match>
+HNode *h_find_ro(HTab *htab, uint64_t hcode, Match &match, uint64_t seq) {
+    HNode **slots = __atomic_load_n(&htab->slots, __ATOMIC_ACQUIRE);
+    size_t mask = __atomic_load_n(&htab->mask, __ATOMIC_RELAXED);
+    if (!slots || seq_read_retry(seq)) {
+        return NULL;    // `mask` may belong to another table
+    }
+    HNode *cur = __atomic_load_n(&slots[hcode & mask], __ATOMIC_ACQUIRE);
+    for (; cur && !seq_read_retry(seq); cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE)) {
+        if (cur->hashcode == hcode && match(cur)) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+inline HNode *h_detach(HTab *htab, HNode **from) {
+    HNode *node = *from;
+    __atomic_store_n(from, node->next, __ATOMIC_RELEASE);
+    htab->size--;
+    return node;
+}
+
+template <class Fn>
+bool h_foreach(HTab *htab, Fn &fn) {
+    for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {
+        for (HNode *node = htab->slots[i]; node != NULL; node = node->next) {
+            if (!fn(node)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// the call is skipped, not just cheap, when no rehash is in progress
+inline void hm_help_rehashing(HMap *hmap) {
+    if (hmap->smaller.slots) {
+        hm_rehash(hmap, k_rehashing_work);
+    }
+}
+
+template <class Match>
+HNode *hm_find(HMap *hmap, uint64_t hcode, Match &match) {
+    hm_help_rehashing(hmap);
+    HNode **from = h_find(&hmap->bigger, hcode, match);
+    if (!from) {
+        from = h_find(&hmap->smaller, hcode, match);
+    }
+    return from ? *from : NULL;
+}
+
+template <class Match>
+HNode *hm_find_ro(HMap *hmap, uint64_t hcode, Match &match, uint64_t seq) {
+    HNode *node = h_find_ro(&hmap->bigger, hcode, match, seq);
+    return node ? node : h_find_ro(&hmap->smaller, hcode, match, seq);
+}
+
+template <class Match>
+HNode *hm_take(HMap *hmap, uint64_t hcode, Match &match) {
+    hm_help_rehashing(hmap);
+    if (HNode **from = h_find(&hmap->bigger, hcode, match)) {
+        return h_detach(&hmap->bigger, from);
+    }
+    if (HNode **from = h_find(&hmap->smaller, hcode, match)) {
+        return h_detach(&hmap->smaller, from);
+    }
+    return NULL;
+}
+
+// A typed HMap whose items are T, looked up by key rather than by a key
+// node and a comparator. `Traits` gives, as static functions:
+//   Key                        the type of lookup keys
+//   node(T *), owner(HNode *)  the embedded HNode and back
+//   key(const T *)             the key of an item
+//   hash(const Key &)          the hashcode of a key
+//   eq(key(item), const Key &) whether the keys are equal
+// An item's hashcode must be set before insert(). `map` is the same table
+// the hm_* functions work on, e.g. for background rehashing.
+template <class T, class Traits>
+struct 
+HashMap {
+    typedef typename Traits::Key Key;
+    HMap map;
+
+    static bool matches(HNode *node, const Key &key) {
+        return Traits::eq(Traits::key(Traits::owner(node)), key);
+    }
+    T *lookup(const Key &key) {
+        return lookup(key, Traits::hash(key));
+    }
+    T *lookup(const Key &key, uint64_t hcode) {
+        auto match = [&key](HNode *node) { return matches(node, key); };
+        HNode *node = hm_find(&map, hcode, match);
+        return node ? Traits::owner(node) : NULL;
+    }
+    // for reader threads, see h_find_ro()
+    T *lookup_ro(const Key &key, uint64_t hcode, uint64_t seq) {
+        auto match = [&key](HNode *node) { return matches(node, key); };
+        HNode *node = hm_find_ro(&map, hcode, match, seq);
+        return node ? Traits::owner(node) : NULL;
+    }
+    void insert(T *item) {
+        hm_insert(&map, Traits::node(item));
+    }
+    T *remove(const Key &key) {
+        return remove(key, Traits::hash(key));
+    }
+    T *remove(const Key &key, uint64_t hcode) {
+        auto match = [&key](HNode *node) { return matches(node, key); };
+        HNode *node = hm_take(&map, hcode, match);
+        return node ? Traits::owner(node) : NULL;
+    }
+    bool replace(T *old, T *item) {
+        return hm_replace(&map, Traits::node(old), Traits::node(item));
+    }
+    // `fn(T *)` returns false to stop
+    template <class Fn>
+    void foreach(Fn fn) {
+        auto visit = [&fn](HNode *node) { return fn(Traits::owner(node)); };
+        h_foreach(&map.bigger, visit) && h_foreach(&map.smaller, visit);
+    }
+    // see hm_scan()
+    template <class Fn>
+    size_t scan(size_t slot, Fn fn) {
+        return hm_scan(&map, slot, [](HNode *node, void *arg) {
+            (*(Fn *)arg)(Traits::owner(node));
+        }, (void *)&fn);
+    }
+    size_t size() { return hm_size(&map); }
+    size_t mem_usage() { return hm_mem_usage(&map); }
+    bool pending_work() { return hm_pending_work(&map); }
+    void prefetch(const uint64_t *hcodes, size_t n) { hm_prefetch(&map, hcodes, n); }
+    void clear() { hm_clear(&map); }
+};
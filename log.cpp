@@ -0,0 +1,255 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string>
+#include "log.hpp"
+
+
+const size_t k_log_slots = 4096;        // a power of 2
+const size_t k_log_line = 240;          // longer messages are truncated
+const long k_log_interval_ns = 10 * 1000 * 1000;
+const uint64_t k_log_fold_us = 1000 * 1000;     // reports repeats at least this often
+
+// a multi-producer ring slot, `seq` tells whose turn it is (see log_write)
+struct 
+LogSlot {
+    uint64_t seq = 0;
+    uint64_t ts_us = 0;
+    int level = 0;
+    uint32_t len = 0;
+    char text[k_log_line];
+};
+
+static LogSlot g_ring[k_log_slots];
+static uint64_t g_tail = 0;         // next slot to claim, producers
+static uint64_t g_overflow = 0;     // lines lost to a full ring
+static int g_level = LL_INFO;
+static uint32_t g_rate = 0;
+static bool g_started = false;
+
+// the consumer side, the log thread or a caller of log_flush()
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_head = 0;
+static FILE *g_fp = stderr;
+static std::string g_path;
+static uint64_t g_unreported = 0;   // over the rate or the ring, not yet reported
+static uint64_t g_window_sec = 0;
+static uint32_t g_window_lines = 0;
+static std::string g_last;          // the previous message, for folding
+static int g_last_level = 0;
+static uint64_t g_repeats = 0;
+static uint64_t g_repeats_us = 0;
+
+static uint64_t now_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+bool log_open(const char *path) {
+    FILE *fp = fopen(path, "a");
+    if (!fp) {
+        return false;
+    }
+    pthread_mutex_lock(&g_lock);
+    if (g_fp != stderr) {
+        fclose(g_fp);
+    }
+    g_fp = fp;
+    g_path = path;
+    pthread_mutex_unlock(&g_lock);
+    return true;
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&g_level, level, __ATOMIC_RELAXED);
+}
+
+void log_set_rate(uint32_t rate) {
+    __atomic_store_n(&g_rate, rate, __ATOMIC_RELAXED);
+}
+
+static void emit(uint64_t ts_us, int level, const char *text, size_t len) {
+    static const char k_level_chars[] = "DIWE";
+    static uint64_t cached_sec = 0;
+    static char stamp[32];
+    uint64_t sec = ts_us / 1000000;
+    if (sec != cached_sec) {
+        time_t t = (time_t)sec;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = sec;
+    }
+    fprintf(g_fp, "%s.%03u %c %.*s\n", stamp, (unsigned)(ts_us / 1000 % 1000),
+        k_level_chars[level & 3], (int)len, text);
+}
+
+static void emit_repeats(uint64_t now_us) {
+    if (g_repeats == 1) {
+        emit(now_us, g_last_level, g_last.data(), g_last.size());
+    } else if (g_repeats > 1) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "last message repeated %lu times", g_repeats);
+        emit(now_us, g_last_level, line, (size_t)n);
+    }
+    g_repeats = 0;
+    g_repeats_us = now_us;
+}
+
+// folding and rate limiting, called in the order the lines were queued
+static void consume(uint64_t ts_us, int level, const char *text, size_t len) {
+    if (len == g_last.size() && level == g_last_level && !memcmp(text, g_last.data(), len)) {
+        g_repeats++;
+        return;
+    }
+    emit_repeats(ts_us);
+    g_last.assign(text, len);
+    g_last_level = level;
+
+    uint32_t rate = __atomic_load_n(&g_rate, __ATOMIC_RELAXED);
+    if (ts_us / 1000000 != g_window_sec) {
+        g_window_sec = ts_us / 1000000;
+        g_window_lines = 0;
+    }
+    if (rate > 0 && g_window_lines >= rate) {
+        g_unreported++;
+        return;
+    }
+    g_window_lines++;
+    emit(ts_us, level, text, len);
+}
+
+static void drain(bool final) {
+    for (;; g_head++) {
+        LogSlot *slot = &g_ring[g_head & (k_log_slots - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != g_head + 1) {
+            break;
+        }
+        consume(slot->ts_us, slot->level, slot->text, slot->len);
+        __atomic_store_n(&slot->seq, g_head + k_log_slots, __ATOMIC_RELEASE);
+    }
+    uint64_t now_us = now_usec();
+    if (final || now_us - g_repeats_us >= k_log_fold_us) {
+        emit_repeats(now_us);
+    }
+    g_unreported += __atomic_exchange_n(&g_overflow, 0, __ATOMIC_RELAXED);
+    if (g_unreported > 0 && (final || now_us / 1000000 != g_window_sec)) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%lu log lines dropped", g_unreported);
+        emit(now_us, LL_WARN, line, (size_t)n);
+        g_unreported = 0;
+    }
+    fflush(g_fp);
+}
+
+// for rotation: the file is renamed away, then SIGHUP makes a new one
+static void reopen() {
+    if (g_path.empty()) {
+        return;
+    }
+    FILE *fp = fopen(g_path.c_str(), "a");
+    if (!fp) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "[errno:%d] cannot reopen the log file", errno);
+        emit(now_usec(), LL_ERROR, line, (size_t)n);
+        return;
+    }
+    fclose(g_fp);
+    g_fp = fp;
+}
+
+static void *log_main(void *) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    struct timespec interval = {0, k_log_interval_ns};
+    while (true) {
+        // doubles as the sleep between batches
+        int sig = sigtimedwait(&set, NULL, &interval);
+        pthread_mutex_lock(&g_lock);
+        if (sig == SIGHUP) {
+            reopen();
+        }
+        drain(false);
+        pthread_mutex_unlock(&g_lock);
+    }
+    return NULL;
+}
+
+// SIGHUP is blocked in the calling thread and so in the threads it starts
+// later, the log thread takes it with sigtimedwait()
+void log_start() {
+    for (size_t i = 0; i < k_log_slots; i++) {
+        g_ring[i].seq = i;
+    }
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &log_main, NULL) == 0) {
+        pthread_detach(thread);
+        __atomic_store_n(&g_started, true, __ATOMIC_RELEASE);
+    }
+}
+
+void log_write(int level, const char *fmt, ...) {
+    if (level < __atomic_load_n(&g_level, __ATOMIC_RELAXED)) {
+        return;
+    }
+    va_list ap;
+    if (!__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+        char text[k_log_line];
+        va_start(ap, fmt);
+        int n = vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        pthread_mutex_lock(&g_lock);
+        emit(now_usec(), level, text, n < 0 ? 0 : (size_t)n < k_log_line ? n : k_log_line - 1);
+        fflush(g_fp);
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+
+    // a bounded MPMC queue: a slot is free for the producer at `pos` when
+    // its seq is `pos`, and holds a line for the consumer when it is pos + 1
+    uint64_t pos = __atomic_load_n(&g_tail, __ATOMIC_RELAXED);
+    LogSlot *slot = NULL;
+    while (true) {
+        slot = &g_ring[pos & (k_log_slots - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_tail, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&g_overflow, 1, __ATOMIC_RELAXED);     // full
+            return;
+        } else {
+            pos = __atomic_load_n(&g_tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->ts_us = now_usec();   // vDSO, no syscall
+    slot->level = level;
+    va_start(ap, fmt);
+    int n = vsnprintf(slot->text, k_log_line, fmt, ap);
+    va_end(ap);
+    slot->len = n < 0 ? 0 : (size_t)n < k_log_line ? (uint32_t)n : (uint32_t)k_log_line - 1;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// writes out what is queued, e.g. before abort()
+void log_flush() {
+    pthread_mutex_lock(&g_lock);
+    if (__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+        drain(true);
+    } else {
+        fflush(g_fp);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Logging off the hot path. log_write() formats the message into a slot of a
+// lock-free ring and returns, without a syscall; a background thread formats
+// the timestamps and writes the lines out in batches. When the ring is full, or past
+// `rate` lines per second, lines are dropped and counted, and the count goes
+// out as a line of its own. Repeats of the same message are folded.
+// Before log_start() lines are written right away. SIGHUP reopens the file
+// for rotation; log_start() blocks it for the threads started after it.
+
+enum {
+    LL_DEBUG    = 0,
+    LL_INFO     = 1,
+    LL_WARN     = 2,
+    LL_ERROR    = 3,
+};
+
+bool log_open(const char *path);    // stderr until then
+void log_set_level(int level);
+void log_set_rate(uint32_t rate);   // 0 for no limit
+void log_start();
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush();
@@ -0,0 +1,130 @@
+#include <string.h>
+#include "lz.hpp"
+
+// Each sequence is a token byte, the high nibble a literal count and the
+// low nibble a match length minus k_lz_min_match, 15 meaning that more
+// length bytes follow (255 for "keep adding"). Then come the literals and,
+// unless the block ends there, a 2-byte little-endian match offset.
+
+const size_t k_lz_min_match = 4;
+const size_t k_lz_max_offset = 65535;
+const uint32_t k_lz_hash_bits = 13;
+
+static uint32_t lz_load32(const uint8_t *p) {
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - k_lz_hash_bits);
+}
+
+static bool lz_put_len(uint8_t *&op, uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == oend) return false;
+        *op++ = 255;
+    }
+    if (op == oend) return false;
+    *op++ = (uint8_t)len;
+    return true;
+}
+
+// `mlen` 0 for the final, literals-only sequence
+static bool lz_put_seq(uint8_t *&op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                       size_t offset, size_t mlen) {
+    if (op == oend) return false;
+    size_t mcode = mlen ? mlen - k_lz_min_match : 0;
+    *op++ = (uint8_t)((nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15));
+    if (nlit >= 15 && !lz_put_len(op, oend, nlit - 15)) return false;
+    if ((size_t)(oend - op) < nlit) return false;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) return true;
+
+    if (oend - op < 2) return false;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    return mcode < 15 || lz_put_len(op, oend, mcode - 15);
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << k_lz_hash_bits] = {};  // last position of each hash
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;    // start of the pending literals
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+
+    while (len >= k_lz_min_match && ip <= end - k_lz_min_match) {
+        uint32_t seq = lz_load32(ip);
+        uint32_t h = lz_hash(seq);
+        const uint8_t *cand = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+        if (cand >= ip || (size_t)(ip - cand) > k_lz_max_offset || lz_load32(cand) != seq) {
+            ip++;
+            continue;
+        }
+        size_t mlen = k_lz_min_match;
+        while (ip + mlen < end && cand[mlen] == ip[mlen]) {
+            mlen++;
+        }
+        if (!lz_put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - cand), mlen)) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!lz_put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0)) {
+        return 0;
+    }
+    return (size_t)(op - dst);
+}
+
+static bool lz_get_len(const uint8_t *&ip, const uint8_t *iend, size_t &len) {
+    while (true) {
+        if (ip == iend) return false;
+        uint8_t b = *ip++;
+        len += b;
+        if (b != 255) return true;
+    }
+}
+
+// every read and write is bounds-checked, as the input may be garbage
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + raw_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !lz_get_len(ip, iend, nlit)) return false;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return false;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) {
+            break;      // the final sequence has no match
+        }
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !lz_get_len(ip, iend, mlen)) return false;
+        mlen += k_lz_min_match;
+        if (offset == 0 || offset > (size_t)(op - dst) || mlen > (size_t)(oend - op)) return false;
+        const uint8_t *match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            for (size_t i = 0; i < mlen; i++) {
+                *op++ = match[i];   // overlapping copy, repeats the last `offset` bytes
+            }
+        }
+    }
+    return op == oend;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A small LZ77 block codec in the spirit of LZ4: greedy matching through a
+// hash table of 4-byte sequences, byte-aligned literal/match sequences.
+// The raw length is not stored in the block, the caller keeps it.
+
+// returns the compressed size, or 0 if it does not fit in `cap` bytes
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+// fails on malformed input or if the output is not exactly `raw_len` bytes
+bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len);
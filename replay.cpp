@@ -0,0 +1,330 @@
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "client_lib.hpp"
+#include "capture.hpp"
+#include "usual.hpp"
+
+// Replays a capture file against a server and reports throughput, latency
+// and the replies that differ from the recorded ones. Replies only match if
+// the server starts from the state the captured one had, e.g. both empty,
+// and if requests on different connections do not race on the same keys.
+// Connections that carried v2 requests are switched to v2 up front and the
+// captured `hello` requests are skipped. With -C each replay connection is
+// a ClusterConn, and requests go straight to the node serving their key.
+
+const size_t k_max_inflight = 64;       // per connection, when not paced
+const size_t k_max_mismatches_shown = 10;
+
+static uint64_t now_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static bool read_u32(const std::string &s, size_t &pos, uint32_t &out) {
+    if (s.size() - pos < 4) {
+        return false;
+    }
+    memcpy(&out, &s[pos], 4);
+    pos += 4;
+    return true;
+}
+
+static bool parse_request(const std::string &s, std::vector<std::string> &args) {
+    size_t pos = 0;
+    uint32_t n = 0;
+    if (!read_u32(s, pos, n) || n > s.size()) {
+        return false;
+    }
+    args.resize(n);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t len = 0;
+        if (!read_u32(s, pos, len) || s.size() - pos < len) {
+            return false;
+        }
+        args[i].assign(&s[pos], len);
+        pos += len;
+    }
+    return pos == s.size();
+}
+
+static struct {
+    std::vector<uint64_t> latencies_us;
+    size_t mismatches = 0;
+    size_t unchecked = 0;   // streamed replies have no recorded hash
+    size_t skipped = 0;
+    size_t errors = 0;
+} g_result;
+
+static void on_reply(const CaptureRecord &rec, const std::string &name,
+    uint64_t sent_us, size_t index, Response &resp)
+{
+    g_result.latencies_us.push_back(now_usec() - sent_us);
+    if (resp.status != k_client_ok) {
+        g_result.errors++;
+        return;
+    }
+    if (!rec.has_hash) {
+        g_result.unchecked++;
+        return;
+    }
+    if (str_hash(resp.frame, resp.frame_len) != rec.reply_hash) {
+        if (g_result.mismatches++ < k_max_mismatches_shown) {
+            fprintf(stderr, "mismatch: request #%zu (%s) on conn %u\n",
+                index, name.c_str(), rec.conn_id);
+        }
+    }
+}
+
+// a replay connection: to the server, or to every node of a cluster
+struct 
+ReplayConn {
+    ClientConn *conn = NULL;
+    ClusterConn *cluster = NULL;
+};
+
+static size_t replay_pending(ReplayConn &rc) {
+    return rc.cluster ? cluster_pending(rc.cluster) : rc.conn->pending.size();
+}
+
+static void replay_send(ReplayConn &rc, const std::vector<std::string> &args, ReplyFn fn) {
+    if (rc.cluster) {
+        cluster_send(rc.cluster, args, std::move(fn));
+    } else {
+        client_send(rc.conn, args, std::move(fn));
+    }
+}
+
+static void replay_send_frame(ReplayConn &rc, const std::string &request, ReplyFn fn) {
+    if (rc.cluster) {
+        cluster_send_frame(rc.cluster, request, std::move(fn));
+    } else {
+        client_send_frame(rc.conn, request, std::move(fn));
+    }
+}
+
+static int replay_poll(std::vector<ReplayConn> &rcs, int timeout_ms) {
+    std::vector<ClientConn *> conns;
+    std::vector<ClusterConn *> clusters;
+    for (ReplayConn &rc : rcs) {
+        if (rc.cluster) {
+            clusters.push_back(rc.cluster);
+        } else {
+            conns.push_back(rc.conn);
+        }
+    }
+    if (!clusters.empty()) {
+        return cluster_poll(clusters.data(), clusters.size(), timeout_ms);
+    }
+    return client_poll(conns.data(), conns.size(), timeout_ms);
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p / 100 * (double)(sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+// the whole of `s` as a number in [lo, hi]
+static bool parse_int(const char *s, long lo, long hi, long &out) {
+    char *end = NULL;
+    errno = 0;
+    long val = strtol(s, &end, 10);
+    if (errno || end == s || *end || val < lo || val > hi) {
+        return false;
+    }
+    out = val;
+    return true;
+}
+
+// the whole of `s` as a finite number, at least `lo`
+static bool parse_dbl(const char *s, double lo, double &out) {
+    char *end = NULL;
+    errno = 0;
+    double val = strtod(s, &end);
+    if (errno || end == s || *end || !isfinite(val) || val < lo) {
+        return false;
+    }
+    out = val;
+    return true;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-h host] [-p port] [-s unix socket path] [-c conns]\n"
+        "    [-r speed] [-C] FILE\n"
+        "  -c  replay connections, captured ones are spread over them\n"
+        "      (default: one per captured connection)\n"
+        "  -r  1 replays at the captured pace, N at N times it, 0 (default)\n"
+        "      as fast as possible with up to %zu requests in flight per connection\n"
+        "  -C  cluster mode, -h and -p name any node\n",
+        prog, k_max_inflight);
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    const char *path = NULL;
+    long port = 1234;
+    long nconns = 0;
+    double speed = 0;
+    bool cluster = false;
+    bool ok = true;
+    int i = 1;
+    for (; ok && i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-C")) {
+            cluster = true;
+            i--;    // takes no value
+        }
+        else if (!strcmp(argv[i], "-h")) host = argv[i + 1];
+        else if (!strcmp(argv[i], "-p")) ok = parse_int(argv[i + 1], 1, 65535, port);
+        else if (!strcmp(argv[i], "-s")) path = argv[i + 1];
+        else if (!strcmp(argv[i], "-c")) ok = parse_int(argv[i + 1], 1, 100000, nconns);
+        else if (!strcmp(argv[i], "-r")) ok = parse_dbl(argv[i + 1], 0, speed);
+        else break;
+    }
+    if (!ok || i + 1 != argc || (cluster && path)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *fp = capture_open_read(argv[i]);
+    if (!fp) {
+        fprintf(stderr, "cannot open %s as a capture file\n", argv[i]);
+        return 1;
+    }
+    std::vector<CaptureRecord> records;
+    std::vector<uint32_t> conn_of;      // replay connection by record
+    std::unordered_map<uint32_t, uint32_t> slots;  // by captured connection ID
+    CaptureRecord rec;
+    int rv = 0;
+    while ((rv = capture_read(fp, rec)) > 0) {
+        uint32_t slot = slots.emplace(rec.conn_id, (uint32_t)slots.size()).first->second;
+        conn_of.push_back(nconns ? slot % (uint32_t)nconns : slot);
+        records.push_back(rec);
+    }
+    fclose(fp);
+    if (rv < 0) {
+        fprintf(stderr, "truncated or malformed capture, replaying the first %zu requests\n",
+            records.size());
+    }
+    if (!nconns) {
+        nconns = slots.size();
+    }
+
+    std::vector<bool> v2(nconns);
+    for (size_t r = 0; r < records.size(); r++) {
+        v2[conn_of[r]] = v2[conn_of[r]] || records[r].proto == 2;
+    }
+    std::vector<ReplayConn> conns(nconns);
+    for (size_t c = 0; c < (size_t)nconns; c++) {
+        bool ok = false;
+        if (cluster) {
+            conns[c].cluster = cluster_connect(host, port);
+            ok = conns[c].cluster && (!v2[c] || cluster_hello(conns[c].cluster, 2));
+        } else {
+            conns[c].conn = path ? client_connect_unix(path) : client_connect_tcp(host, port);
+            ok = conns[c].conn && (!v2[c] || client_hello(conns[c].conn, 2));
+        }
+        if (!ok) {
+            fprintf(stderr, "cannot connect\n");
+            return 1;
+        }
+    }
+
+    uint64_t start_us = now_usec();
+    size_t next = 0;
+    std::vector<std::string> args;
+    while (true) {
+        uint64_t now_us = now_usec();
+        for (; next < records.size(); next++) {
+            const CaptureRecord &r = records[next];
+            ReplayConn &conn = conns[conn_of[next]];
+            if (speed > 0 && (double)r.ts_us / speed > (double)(now_us - start_us)) {
+                break;  // not due yet
+            }
+            if (speed == 0 && replay_pending(conn) >= k_max_inflight) {
+                break;  // keeps the captured order across connections
+            }
+            size_t index = next;
+            if (r.proto == 2) {
+                // u32 request ID, u8 opcode, ...
+                uint8_t op = r.request.size() > 4 ? (uint8_t)r.request[4] : 0;
+                if (op == OP_HELLO) {
+                    g_result.skipped++;
+                    continue;
+                }
+                std::string name = "opcode " + std::to_string(op);
+                replay_send_frame(conn, r.request, [&r, name, now_us, index](Response &resp) {
+                    on_reply(r, name, now_us, index, resp);
+                });
+                continue;
+            }
+            if (!parse_request(r.request, args)) {
+                g_result.errors++;
+                continue;
+            }
+            std::string name = args.empty() ? "" : args[0];
+            if (name == "hello") {
+                g_result.skipped++;
+                continue;
+            }
+            replay_send(conn, args, [&r, name, now_us, index](Response &resp) {
+                on_reply(r, name, now_us, index, resp);
+            });
+        }
+        int timeout_ms = -1;
+        if (next < records.size() && speed > 0) {
+            uint64_t due_us = start_us + (uint64_t)((double)records[next].ts_us / speed);
+            timeout_ms = due_us > now_us ? (int)((due_us - now_us) / 1000) : 0;
+        }
+        if (replay_poll(conns, timeout_ms) < 0) {
+            if (next == records.size()) {
+                break;  // all replies in
+            }
+            if (timeout_ms > 0) {
+                // nothing in flight to wait on
+                struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    uint64_t elapsed_us = now_usec() - start_us;
+
+    std::vector<uint64_t> &lat = g_result.latencies_us;
+    std::sort(lat.begin(), lat.end());
+    printf("requests     %zu over %zu connections\n", records.size(), conns.size());
+    printf("elapsed      %.3f s\n", (double)elapsed_us / 1e6);
+    printf("throughput   %.0f req/s\n", (double)lat.size() * 1e6 / (double)(elapsed_us ? elapsed_us : 1));
+    printf("latency us   p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+        percentile(lat, 50), percentile(lat, 90), percentile(lat, 99),
+        percentile(lat, 99.9), lat.empty() ? 0 : lat.back());
+    printf("mismatches   %zu (%zu streamed replies unchecked)\n",
+        g_result.mismatches, g_result.unchecked);
+    printf("errors       %zu\n", g_result.errors);
+    printf("skipped      %zu hello requests\n", g_result.skipped);
+    uint64_t redirects = 0;
+    for (ReplayConn &rc : conns) {
+        if (rc.cluster) {
+            redirects += rc.cluster->redirects;
+            cluster_close(rc.cluster);
+        } else {
+            client_close(rc.conn);
+        }
+    }
+    if (cluster) {
+        printf("redirects    %lu\n", redirects);
+    }
+    return g_result.mismatches || g_result.errors ? 2 : 0;
+}
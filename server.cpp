@@ -9,28 +9,95 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <new>
+#include <algorithm>
+#include <deque>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "usual.hpp"
 #include "hashtable.hpp"
 #include "Sorted_Set.hpp"
+#include "uring.hpp"
+#include "epoch.hpp"
+#include "lz.hpp"
+#include "defrag.hpp"
+#include "capture.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "cluster.hpp"
+
+static thread_local int t_reader = -1;     // reader thread index, -1 on the writer
+static thread_local uint64_t t_now_ms = 0;  // start of the request being executed
 
 static void message(const char *message) {
-    fprintf(stderr, "%s\n", message);
+    log_write(LL_INFO, "%s", message);
 }
 
 static void message_errno(const char *message) {
-    fprintf(stderr, "[errno:%d] %s\n", errno, message);
+    log_write(LL_WARN, "[errno:%d] %s", errno, message);
 }
 
 static void die(const char *message) {
-    fprintf(stderr, "[%d] %s\n", errno, message);
+    log_write(LL_ERROR, "[%d] %s", errno, message);
+    log_flush();
     abort();
 }
 
+// what to do when a write finds memory over `maxmemory`
+enum {
+    EVICT_NONE      = 0,    // noeviction: reject the write
+    EVICT_LRU       = 1,    // allkeys-lru
+    EVICT_LFU       = 2,    // allkeys-lfu
+    EVICT_RANDOM    = 3,    // allkeys-random
+};
+
+// runtime configuration, from command-line flags and config files
+static struct {
+    std::vector<std::string> binds;     // IPv4 "addr" or "addr:port"
+    int64_t port = 1234;                // 0 disables TCP
+    std::string unixsocket;             // empty disables the Unix socket
+    int64_t unixsocketperm = 0700;
+    int64_t backlog = SOMAXCONN;
+    bool tcp_nodelay = true;
+    int64_t tcp_keepalive = 0;          // idle seconds before probing, 0 is off
+    std::string io = "poll";
+    int64_t readers = 0;
+    int64_t read_port = 1235;
+    int64_t compress_threshold = 0;     // smallest string value to compress, 0 is off
+    int64_t maxmemory = 0;              // bytes, 0 is unlimited
+    uint32_t maxmemory_policy = EVICT_NONE;
+    int64_t maxmemory_samples = 5;      // keys sampled per eviction
+    int64_t maint_hz = 10;              // maintenance rounds per second under load
+    int64_t maint_budget_us = 1000;     // per round, 0 disables maintenance
+    bool activedefrag = false;          // only at startup, it needs tracking from the start
+    int64_t defrag_threshold = 10;      // percent of wasted page bytes over live ones
+    int64_t defrag_ignore_bytes = 100 << 20;
+    std::string capture_file;           // empty disables traffic capture
+    int64_t capture_sample = 1;         // capture 1 in N connections
+    std::string logfile;                // empty logs to stderr
+    int loglevel = LL_INFO;
+    int64_t log_rate = 1000;            // lines per second, 0 is unlimited
+    int64_t pubsub_output_limit = 32 << 20;     // bytes queued per subscriber, 0 is unlimited
+    int64_t trace_sample = 0;           // time 1 in N requests by phase, 0 is off
+    bool cluster = false;               // serve only the hash slots this node owns
+    std::string cluster_announce;       // this node's "addr:port", default 127.0.0.1 and `port`
+    std::vector<std::string> cluster_map;   // "lo-hi=addr:port", all slots here if empty
+    int64_t cluster_migrate_batch = 100;    // keys per migration batch
+} g_config;
+
 static void listen_set_nb(int fd) {
     errno = 0;
     int mark = fcntl(fd, F_GETFL, 0);
@@ -46,6 +113,18 @@ static void listen_set_nb(int fd) {
     }
 }
 
+static uint64_t clock_usec(clockid_t clk) {
+    struct timespec tv = {0, 0};
+    clock_gettime(clk, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t clock_nsec(clockid_t clk) {
+    struct timespec tv = {0, 0};
+    clock_gettime(clk, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
 const size_t k_max_message = 32 << 20;
 
 typedef std::vector<uint8_t> Buffer;
@@ -58,37 +137,111 @@ static void buf_pop_front(Buffer &buf, size_t n) {
     buf.erase(buf.begin(), buf.begin() + n);
 }
 
+const size_t k_peer_len = 64;
+
+struct Stream;
+struct SetOpJob;
+struct PubMsg;
+struct Channel;
+
+// a published message waiting in a subscriber's output, it goes out right
+// after the first `mark` bytes ever queued in Conn::outgoing
+struct PushRef {
+    PubMsg *msg = NULL;
+    uint64_t mark = 0;
+};
+
+struct Subscription {
+    Channel *chan = NULL;
+    size_t pos = 0;     // of the conn in chan->subs
+};
+
 struct Conn {
     int fd = -1;
     bool want_read = false;
     bool want_write = false;
     bool want_close = false;
+    bool read_eof = false;      // closes once the pending replies are out
     Buffer incoming;
     Buffer outgoing;
+    char peer[k_peer_len] = {};
+    Stream *stream = NULL;      // a large reply still being generated
+    SetOpJob *job = NULL;       // a large zunionstore/zinterstore in progress
+    uint32_t id = 0;
+    bool captured = false;      // its requests go to the capture file
+    uint32_t proto = 1;         // request and reply framing, see `hello`
+    // pub/sub, see pubsub_push()
+    std::vector<Subscription> subs;
+    std::deque<PushRef> pushq;  // shared messages, interleaved with `outgoing`
+    size_t push_off = 0;        // bytes of pushq.front() already written
+    size_t push_bytes = 0;      // queued in `pushq`
+    uint64_t out_popped = 0;    // bytes of `outgoing` written so far
+    bool push_listed = false;   // in g_pubsub.pushed
+    bool asking = false;        // cluster mode, the next request may use an importing slot
+    // io_uring backend: requests in flight that still reference the conn
+    bool recv_armed = false;
+    bool recv_cancel = false;
+    bool send_inflight = false;
+    struct msghdr send_msg = {};    // a send with pushes in it, see uring_arm_send()
+    std::vector<struct iovec> send_iov;
 };
 
-static Conn *handle_new_conn(int fd) {
-    struct sockaddr_in client_addr = {};
-    socklen_t addrlen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
-    if (connfd < 0) {
-        message_errno("accept() error");
-        return NULL;
+static void tcp_set_options(int fd) {
+    int val = g_config.tcp_nodelay ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    if (g_config.tcp_keepalive > 0) {
+        val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+        val = (int)g_config.tcp_keepalive;
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
+        val = val / 3 > 0 ? val / 3 : 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+        val = 3;
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
     }
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-        ntohs(client_addr.sin_port)
-    );
+}
 
+static Conn *conn_new(int connfd, const struct sockaddr *client_addr) {
     listen_set_nb(connfd);
 
     Conn *conn = new Conn();
     conn->fd = connfd;
     conn->want_read = true;
+    // whole connections are sampled, keeping their pipelines intact
+    static uint32_t next_id = 0;
+    conn->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    conn->captured = !g_config.capture_file.empty()
+        && conn->id % (uint32_t)g_config.capture_sample == 0;
+    if (client_addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)client_addr;
+        uint32_t ip = in->sin_addr.s_addr;
+        snprintf(conn->peer, sizeof(conn->peer), "%u.%u.%u.%u:%u",
+            ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+            ntohs(in->sin_port)
+        );
+        tcp_set_options(connfd);
+    } else {
+        // Unix clients are unnamed, show the socket they came in on
+        struct sockaddr_un local = {};
+        socklen_t addrlen = sizeof(local);
+        getsockname(connfd, (struct sockaddr *)&local, &addrlen);
+        snprintf(conn->peer, sizeof(conn->peer), "unix:%.58s", local.sun_path);
+    }
+    log_write(LL_INFO, "new client from %s", conn->peer);
     return conn;
 }
 
+static Conn *handle_new_conn(int fd) {
+    struct sockaddr_storage client_addr = {};
+    socklen_t addrlen = sizeof(client_addr);
+    int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
+    if (connfd < 0) {
+        message_errno("accept() error");
+        return NULL;
+    }
+    return conn_new(connfd, (struct sockaddr *)&client_addr);
+}
+
 const size_t k_max_args = 200 * 1000;
 
 static bool read_int(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
@@ -122,10 +275,17 @@ static int32_t deserialize(const uint8_t *data, size_t size, std::vector<std::st
 }
 
 enum {
-    ERR_UNKNOWN = 1,
-    ERR_TOO_BIG = 2,
-    ERR_BAD_TYP = 3,
-    ERR_BAD_ARG = 4,
+    ERR_UNKNOWN     = 1,
+    ERR_TOO_BIG     = 2,
+    ERR_BAD_TYP     = 3,
+    ERR_BAD_ARG     = 4,
+    ERR_OOM         = 5,
+    // cluster mode, see cluster_redirect()
+    ERR_MOVED       = 6,
+    ERR_ASK         = 7,
+    ERR_CROSSSLOT   = 8,
+    ERR_TRYAGAIN    = 9,
+    ERR_CLUSTERDOWN = 10,
 };
 
 enum {
@@ -185,263 +345,3453 @@ static void out_arr(Buffer &out, uint32_t n) {
     buf_push_back_u32(out, n);
 }
 
-static size_t out_begin_arr(Buffer &out) {
-    out.push_back(TAG_ARR);
-    buf_push_back_u32(out, 0);
-    return out.size() - 4;
+// Protocol v2, switched to with `hello 2`. A request is
+//   u32 request ID, u8 opcode, u32 nargs, then per argument a tag and
+//   TAG_STR: u32 len + bytes, TAG_INT: i64, TAG_DBL: f64
+// and the reply frame starts with the request ID. OP_NAMED takes the
+// command name as the first argument.
+enum {
+    OP_NAMED        = 0,
+    OP_GET          = 1,
+    OP_SET          = 2,
+    OP_DEL          = 3,
+    OP_KEYS         = 4,
+    OP_INCR         = 5,
+    OP_DECR         = 6,
+    OP_INCRBY       = 7,
+    OP_DECRBY       = 8,
+    OP_INCRBYFLOAT  = 9,
+    OP_SADD         = 10,
+    OP_SREM         = 11,
+    OP_SSCORE       = 12,
+    OP_SQUERY       = 13,
+    OP_SREVQUERY    = 14,
+    OP_ZRANK        = 15,
+    OP_ZREVRANK     = 16,
+    OP_ZCOUNT       = 17,
+    OP_MEMORY       = 18,
+    OP_MAINT        = 19,
+    OP_SLOWLOG      = 20,
+    OP_HELLO        = 21,
+    OP_ZUNIONSTORE  = 22,
+    OP_ZINTERSTORE  = 23,
+    OP_ZPOPMIN      = 24,
+    OP_ZPOPMAX      = 25,
+    OP_SUBSCRIBE    = 26,
+    OP_UNSUBSCRIBE  = 27,
+    OP_PUBLISH      = 28,
+    OP_MAX          = 29,
+};
+
+struct OpInfo {
+    const char *name;
+    uint32_t num_args;  // bit i: argument i is a number
+};
+
+static const OpInfo k_ops[OP_MAX] = {
+    {"", 0},
+    {"get", 0},
+    {"set", 0},
+    {"del", 0},
+    {"keys", 0},
+    {"incr", 0},
+    {"decr", 0},
+    {"incrby", 1 << 2},
+    {"decrby", 1 << 2},
+    {"incrbyfloat", 1 << 2},
+    {"sadd", 1 << 2},
+    {"srem", 0},
+    {"sscore", 0},
+    {"squery", 1 << 2 | 1 << 4 | 1 << 5},
+    {"srevquery", 1 << 2 | 1 << 4 | 1 << 5},
+    {"zrank", 0},
+    {"zrevrank", 0},
+    {"zcount", 1 << 2 | 1 << 3},
+    {"memory", 0},
+    {"maint", 0},
+    {"slowlog", 1 << 2},
+    {"hello", 1 << 1},
+    {"zunionstore", 1 << 2},
+    {"zinterstore", 1 << 2},
+    {"zpopmin", 1 << 2},
+    {"zpopmax", 1 << 2},
+    {"subscribe", 0},
+    {"unsubscribe", 0},
+    {"publish", 0},
+};
+
+const size_t k_max_typed_args = 8;
+
+// the numbers of the request being executed, read with arg_int() and
+// arg_dbl() instead of parsing the argument text
+static thread_local struct {
+    uint32_t typed = 0;     // bit i: argument i is here, its string is empty
+    uint8_t tag[k_max_typed_args];
+    int64_t ival[k_max_typed_args];
+    double dval[k_max_typed_args];
+} t_args;
+
+struct ArgV2 {
+    uint8_t tag = TAG_STR;
+    const uint8_t *str = NULL;
+    uint32_t len = 0;
+    int64_t ival = 0;
+    double dval = 0;
+};
+
+static bool read_arg_v2(const uint8_t *&cur, const uint8_t *end, ArgV2 &arg) {
+    if (cur == end) return false;
+    arg.tag = *cur++;
+    switch (arg.tag) {
+    case TAG_STR:
+        if (!read_int(cur, end, arg.len) || arg.len > (size_t)(end - cur)) return false;
+        arg.str = cur;
+        cur += arg.len;
+        return true;
+    case TAG_INT:
+        if (end - cur < 8) return false;
+        memcpy(&arg.ival, cur, 8);
+        cur += 8;
+        return true;
+    case TAG_DBL:
+        if (end - cur < 8) return false;
+        memcpy(&arg.dval, cur, 8);
+        cur += 8;
+        return true;
+    default:
+        return false;
+    }
 }
 
-static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
-    assert(out[ctx - 1] == TAG_ARR);
-    memcpy(&out[ctx], &n, 4);
+// a number as text, for arguments that commands take as strings
+static std::string num2str(uint8_t tag, int64_t ival, double dval) {
+    char buf[32];
+    int n = tag == TAG_INT
+        ? snprintf(buf, sizeof(buf), "%lld", (long long)ival)
+        : snprintf(buf, sizeof(buf), "%.17g", dval);
+    return std::string(buf, (size_t)n);
 }
 
-static struct {
-    HMap db;
-} data_store;
+static uint32_t op_num_args(uint8_t op, const std::vector<std::string> &args) {
+    if (op == OP_NAMED) {
+        for (op = 1; op < OP_MAX && (args.empty() || args[0] != k_ops[op].name); op++) {}
+    }
+    return op < OP_MAX ? k_ops[op].num_args : 0;
+}
+
+static int32_t deserialize_v2(const uint8_t *data, size_t size,
+                              std::vector<std::string> &out, uint32_t &id) {
+    const uint8_t *end = data + size;
+    if (!read_int(data, end, id) || data == end) return -1;
+    uint8_t op = *data++;
+    uint32_t nargs = 0;
+    if (!read_int(data, end, nargs) || nargs > k_max_args) return -1;
+    if (op != OP_NAMED) {
+        out.push_back(op < OP_MAX ? k_ops[op].name : "");  // unknown command
+    }
+
+    t_args.typed = 0;
+    ArgV2 arg;
+    for (uint32_t i = 0; i < nargs; i++) {
+        if (!read_arg_v2(data, end, arg)) return -1;
+        size_t pos = out.size();
+        out.push_back(std::string());
+        if (arg.tag == TAG_STR) {
+            out.back().assign((const char *)arg.str, arg.len);
+        } else if (pos < k_max_typed_args) {
+            t_args.typed |= 1u << pos;
+            t_args.tag[pos] = arg.tag;
+            t_args.ival[pos] = arg.ival;
+            t_args.dval[pos] = arg.dval;
+        } else {
+            out.back() = num2str(arg.tag, arg.ival, arg.dval);
+        }
+    }
+    if (data != end) return -1;
+
+    uint32_t as_text = t_args.typed ? t_args.typed & ~op_num_args(op, out) : 0;
+    for (size_t pos = 0; as_text; pos++, as_text >>= 1) {
+        if (as_text & 1) {
+            out[pos] = num2str(t_args.tag[pos], t_args.ival[pos], t_args.dval[pos]);
+            t_args.typed &= ~(1u << pos);
+        }
+    }
+    return 0;
+}
 
 enum {
     T_INIT  = 0,
     T_STR   = 1,
     T_SSET  = 2,
+    T_MAX   = 3,
+};
+
+// value encodings of T_STR
+enum {
+    ENC_RAW = 0,
+    ENC_INT = 1,    // held in `ival`, no heap string
+    ENC_LZ  = 2,    // `str` holds lz_compress() output, `ival` the raw length
 };
 
+// compression counters, the decompression ones are also bumped by readers
+static struct {
+    uint64_t values = 0;        // values stored compressed
+    uint64_t skipped = 0;       // not compressed for a poor ratio
+    uint64_t raw_bytes = 0;     // sizes before and after, of the stored ones
+    uint64_t packed_bytes = 0;
+    uint64_t compress_ns = 0;   // thread CPU time, including skipped attempts
+    uint64_t decompress_count = 0;
+    uint64_t decompress_ns = 0;
+} g_lzstats;
+
+const size_t k_lz_min_saving = 8;   // store compressed only if it saves 1/8
+
 struct Entry {
     struct HNode node;
     std::string key;
     uint32_t type = 0;
+    uint32_t enc = ENC_RAW;
     std::string str;
+    int64_t ival = 0;
     Sorted_Set sset;
+    size_t mem = 0;     // bytes currently charged to data_store
+    uint32_t pins = 0;  // streams and jobs reading this entry
+    uint32_t access = 0;    // LRU clock or LFU counter, see entry_touch()
 };
 
+struct 
+EntryTraits {
+    typedef std::string Key;
+    static HNode *node(Entry *ent) { return &ent->node; }
+    static Entry *owner(HNode *node) { return container_of(node, Entry, node); }
+    static const std::string &key(const Entry *ent) { return ent->key; }
+    static uint64_t hash(const std::string &key) {
+        return str_hash((uint8_t *)key.data(), key.size());
+    }
+    static bool eq(const std::string &lhs, const std::string &rhs) { return lhs == rhs; }
+};
+
+static struct {
+    HashMap<Entry, EntryTraits> db;
+    // running byte counts of all entries, in total and by type
+    size_t mem_total = 0;
+    size_t mem_by_type[T_MAX] = {};
+} data_store;
+
+// Access metadata for eviction, kept only under `maxmemory`. With LRU it is
+// the millisecond clock of the last access. With LFU the low 8 bits are a
+// logarithmic access counter and the upper 16 the minute it was last decayed.
+// Reader threads update it too, racing benignly with relaxed atomics.
+const uint32_t k_lfu_init = 5;          // new keys start above the least used
+const uint32_t k_lfu_log_factor = 10;
+const uint32_t k_lfu_decay_min = 1;     // minutes per counter decrement
+
+static thread_local uint64_t t_rand = 0x2545f4914f6cdd1d;
+
+static uint64_t rand_next() {
+    t_rand ^= t_rand << 13;
+    t_rand ^= t_rand >> 7;
+    t_rand ^= t_rand << 17;
+    return t_rand;
+}
+
+static uint32_t lfu_minutes() {
+    return (uint32_t)(t_now_ms / 60000) & 0xffff;
+}
+
+static uint32_t lfu_decayed(uint32_t access) {
+    uint32_t elapsed = (lfu_minutes() - (access >> 8)) & 0xffff;
+    uint32_t periods = elapsed / k_lfu_decay_min;
+    uint32_t counter = access & 0xff;
+    return periods > counter ? 0 : counter - periods;
+}
+
+static void entry_touch(Entry *ent) {
+    if (g_config.maxmemory == 0) {
+        return;
+    }
+    uint32_t access = (uint32_t)t_now_ms;
+    if (g_config.maxmemory_policy == EVICT_LFU) {
+        uint32_t counter = lfu_decayed(__atomic_load_n(&ent->access, __ATOMIC_RELAXED));
+        // the more hits, the less likely each one counts
+        uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+        if (counter < 255 && rand_next() % (base * k_lfu_log_factor + 1) == 0) {
+            counter++;
+        }
+        access = lfu_minutes() << 8 | counter;
+    }
+    __atomic_store_n(&ent->access, access, __ATOMIC_RELAXED);
+}
+
+static const size_t k_sso_capacity = std::string().capacity();
+
+static size_t str_mem_usage(const std::string &s) {
+    return s.capacity() > k_sso_capacity ? s.capacity() + 1 : 0;
+}
+
+static size_t entry_mem_usage(Entry *ent) {
+    size_t mem = sizeof(Entry) + str_mem_usage(ent->key) + str_mem_usage(ent->str);
+    if (ent->type == T_SSET) {
+        mem += sset_mem_usage(&ent->sset);
+    }
+    return mem;
+}
+
+// recompute the entry size in O(1) and apply the difference to the totals
+static void entry_mem_sync(Entry *ent) {
+    size_t mem = entry_mem_usage(ent);
+    data_store.mem_total += mem - ent->mem;
+    data_store.mem_by_type[ent->type] += mem - ent->mem;
+    ent->mem = mem;
+}
+
 static Entry *entry_new(uint32_t type) {
     Entry *ent = new Entry();
     ent->type = type;
+    ent->access = g_config.maxmemory_policy == EVICT_LFU
+        ? lfu_minutes() << 8 | k_lfu_init : (uint32_t)t_now_ms;
+    entry_mem_sync(ent);
+    defrag_note_alloc(ent, sizeof(Entry));
     return ent;
 }
 
+static void entry_free(void *ptr) {
+    delete (Entry *)ptr;
+}
+
+static void streams_adopt(Entry *ent);
+
 static void entry_del(Entry *ent) {
+    if (ent->pins > 0) {
+        return streams_adopt(ent);  // out of the keyspace, freed by stream_unpin()
+    }
+    data_store.mem_total -= ent->mem;
+    data_store.mem_by_type[ent->type] -= ent->mem;
     if (ent->type == T_SSET) {
         sset_clear(&ent->sset);
     }
-    delete ent;
+    defrag_note_free(ent, sizeof(Entry));
+    epoch_retire(ent, &entry_free);
 }
 
-struct LookupKey {
-    struct HNode node;
-    std::string key;
-};
-
-static bool entry_eq(HNode *node, HNode *key) {
-    struct Entry *ent = container_of(node, struct Entry, node);
-    struct LookupKey *keydata = container_of(key, struct LookupKey, node);
-    return ent->key == keydata->key;
+static void str_free(void *ptr) {
+    delete (std::string *)ptr;
 }
-static void do_get(std::vector<std::string> &commands, Buffer &out) {
-    LookupKey key;
-    key.key.swap(commands[1]);
-    key.node.hashcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&data_store.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_nil(out);
-    }
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR) {
-        return out_err(out, ERR_BAD_TYP, "not a string value");
+
+// a reader may be copying the old value, so its heap buffer is retired
+static void entry_retire_str(Entry *ent) {
+    if (str_mem_usage(ent->str) == 0) {
+        return;
     }
-    return out_str(out, ent->str.data(), ent->str.size());
+    std::string *old = new std::string();
+    old->swap(ent->str);
+    epoch_retire(old, &str_free);
 }
 
-static void do_set(std::vector<std::string> &commands, Buffer &out) {
-    LookupKey key;
-    key.key.swap(commands[1]);
-    key.node.hashcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&data_store.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
-        if (ent->type != T_STR) {
-            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
-        }
-        ent->str.swap(commands[2]);
-    } else {
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hashcode = key.node.hashcode;
-        ent->str.swap(commands[2]);
-        hm_insert(&data_store.db, &ent->node);
+const size_t k_max_outgoing = 1 << 20;
+const size_t k_stream_chunk = 64 * 1024;
+
+// (score, name), the order of a sorted set
+struct StreamKey {
+    double score = 0;
+    std::string name;
+};
+
+static int key_cmp(double lscore, const char *lname, size_t llen,
+                   double rscore, const char *rname, size_t rlen) {
+    if (lscore != rscore) {
+        return lscore < rscore ? -1 : +1;
     }
-    return out_nil(out);
+    int rv = memcmp(lname, rname, std::min(llen, rlen));
+    if (rv != 0) {
+        return rv < 0 ? -1 : +1;
+    }
+    return llen == rlen ? 0 : (llen < rlen ? -1 : +1);
 }
 
-static void do_del(std::vector<std::string> &commands, Buffer &out) {
-    LookupKey key;
-    key.key.swap(commands[1]);
-    key.node.hashcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_delete(&data_store.db, &key.node, &entry_eq);
-    if (node) {
-        entry_del(container_of(node, Entry, node));
+struct StreamKeyLess {
+    bool operator()(const StreamKey &lhs, const StreamKey &rhs) const {
+        return key_cmp(lhs.score, lhs.name.data(), lhs.name.size(),
+            rhs.score, rhs.name.data(), rhs.name.size()) < 0;
     }
-    return out_int(out, node ? 1 : 0);
+};
+
+typedef std::set<StreamKey, StreamKeyLess> StreamKeys;
+
+// A large squery reply, generated a chunk at a time as the socket drains.
+// Its length went out first, so it sends the members as of the query: a
+// write to the part not sent yet is noted rather than seen, an added member
+// to be skipped and a removed one to be sent from the note, and each chunk
+// carries on after the last member sent. If the notes would take more than
+// the rest of the reply, the rest is generated into `rest` instead.
+struct Stream {
+    Entry *ent = NULL;      // pinned, and kept if deleted meanwhile
+    SSNode *node = NULL;    // the first member, then found again after `last`
+    int64_t dir = +1;       // -1 for reverse order
+    uint32_t npairs = 0;    // (name, score) pairs not generated yet
+    size_t size = 0;        // bytes not yet moved into Conn::outgoing
+    bool started = false;   // `last` is set
+    bool owner = false;     // `ent` left the keyspace, see entry_del()
+    StreamKey last;         // the last member generated
+    StreamKey end;          // the last member to generate
+    StreamKeys added;       // noted writes after `last`, up to `end`
+    StreamKeys removed;
+    size_t noted_bytes = 0;
+    Buffer rest;            // generated early, see above
+    size_t rest_pos = 0;
+};
+
+const size_t k_stream_note_size = 64;   // a StreamKeys node, without the name
+
+static std::vector<Conn *> g_streams;   // conns whose Stream pins an entry
+
+static size_t squery_pair_size(SSNode *node) {
+    return 5 + node->len + 9;
 }
 
-static bool cb_keys(HNode *node, void *arg) {
-    Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
-    return true;
+static SSNode *ssnode_step(SSNode *node, int64_t dir) {
+    return dir > 0 ? ssnode_next(node) : ssnode_prev(node);
 }
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
-    out_arr(out, (uint32_t)hm_size(&data_store.db));
-    hm_foreach(&data_store.db, &cb_keys, (void *)&out);
+// < 0, 0 or > 0 as the member comes before, is or comes after `key` in the
+// stream's order
+static int stream_cmp(Stream *st, double score, const char *name, size_t len,
+                      const StreamKey &key) {
+    return (int)st->dir * key_cmp(score, name, len, key.score, key.name.data(), key.name.size());
 }
 
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+static const StreamKey *stream_front(Stream *st, StreamKeys &keys) {
+    if (keys.empty()) {
+        return NULL;
+    }
+    return st->dir > 0 ? &*keys.begin() : &*keys.rbegin();
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+static void stream_pop_front(Stream *st, StreamKeys &keys) {
+    keys.erase(st->dir > 0 ? keys.begin() : std::prev(keys.end()));
 }
 
-static void do_sadd(std::vector<std::string> &commands, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(commands[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect float");
+// the first member in the set now that comes after `last`
+static SSNode *stream_seek(Stream *st) {
+    const StreamKey &key = st->last;
+    Sorted_Set *sset = &st->ent->sset;
+    SSNode *node = st->dir > 0
+        ? sset_seekge(sset, key.score, key.name.data(), key.name.size())
+        : sset_seekle(sset, key.score, key.name.data(), key.name.size());
+    if (node && stream_cmp(st, node->score, node->name, node->len, key) == 0) {
+        node = ssnode_step(node, st->dir);
     }
+    return node;
+}
 
-    LookupKey key;
-    key.key.swap(commands[1]);
-    key.node.hashcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&data_store.db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {
-        ent = entry_new(T_SSET);
-        ent->key.swap(key.key);
-        ent->node.hashcode = key.node.hashcode;
-        hm_insert(&data_store.db, &ent->node);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_SSET) {
-            return out_err(out, ERR_BAD_TYP, "expect sset");
+static void stream_gen(Stream *st, Buffer &out, size_t budget) {
+    size_t start = out.size();
+    SSNode *node = st->started ? stream_seek(st) : st->node;
+    SSNode *last = NULL;
+    while (st->npairs > 0 && out.size() - start < budget) {
+        const StreamKey *skip = stream_front(st, st->added);
+        if (skip && node && stream_cmp(st, node->score, node->name, node->len, *skip) == 0) {
+            stream_pop_front(st, st->added);
+            node = ssnode_step(node, st->dir);
+            continue;
         }
+        const StreamKey *gone = stream_front(st, st->removed);
+        if (gone && (!node || stream_cmp(st, node->score, node->name, node->len, *gone) > 0)) {
+            out_str(out, gone->name.data(), gone->name.size());
+            out_dbl(out, gone->score);
+            st->last = *gone;
+            last = NULL;
+            stream_pop_front(st, st->removed);
+        } else {
+            assert(node);
+            out_str(out, node->name, node->len);
+            out_dbl(out, node->score);
+            last = node;
+            node = ssnode_step(node, st->dir);
+        }
+        st->npairs--;
     }
-
-    const std::string &name = commands[3];
-    bool added = sset_insert(&ent->sset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+    if (last) {
+        st->last.score = last->score;
+        st->last.name.assign(last->name, last->len);
+    }
+    st->started = true;
 }
 
-static const Sorted_Set k_empty_sset;
-
-static Sorted_Set *expect_sset(std::string &s) {
-    LookupKey key;
-    key.key.swap(s);
-    key.node.hashcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&data_store.db, &key.node, &entry_eq);
-    if (!hnode) {
-        return (Sorted_Set *)&k_empty_sset;
+static void stream_unpin(Conn *conn) {
+    Stream *st = conn->stream;
+    Entry *ent = st->ent;
+    if (!ent) {
+        return;
+    }
+    st->ent = NULL;
+    for (Conn *&other : g_streams) {
+        if (other == conn) {
+            other = g_streams.back();
+            g_streams.pop_back();
+            break;
+        }
+    }
+    if (--ent->pins == 0 && st->owner) {
+        entry_del(ent);
     }
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_SSET ? &ent->sset : NULL;
 }
 
-static void do_srem(std::vector<std::string> &commands, Buffer &out) {
-    Sorted_Set *sset = expect_sset(commands[1]);
-    if (!sset) {
-        return out_err(out, ERR_BAD_TYP, "expect sset");
+static void streams_adopt(Entry *ent) {
+    for (Conn *conn : g_streams) {
+        if (conn->stream->ent == ent) {
+            conn->stream->owner = true;
+        }
     }
+}
 
-    const std::string &name = commands[2];
-    SSNode *ssnode = sset_lookup(sset, name.data(), name.size());
-    if (ssnode) {
-        sset_delete(sset, ssnode);
-    }
-    return out_int(out, ssnode ? 1 : 0);
+// whether the member is in the part of the reply not generated yet
+static bool stream_ahead(Stream *st, double score, const char *name, size_t len) {
+    return stream_cmp(st, score, name, len, st->last) > 0
+        && stream_cmp(st, score, name, len, st->end) <= 0;
 }
 
-static void do_sscore(std::vector<std::string> &commands, Buffer &out) {
-    Sorted_Set *sset = expect_sset(commands[1]);
-    if (!sset) {
-        return out_err(out, ERR_BAD_TYP, "expect sset");
+// a note cancels the opposite one, e.g. a member removed and added back
+static void stream_note(StreamKeys &undo, StreamKeys &note, double score,
+                        const char *name, size_t len) {
+    StreamKey key;
+    key.score = score;
+    key.name.assign(name, len);
+    if (undo.erase(key) == 0) {
+        note.insert(std::move(key));
     }
-
-    const std::string &name = commands[2];
-    SSNode *ssnode = sset_lookup(sset, name.data(), name.size());
-    return ssnode ? out_dbl(out, ssnode->score) : out_nil(out);
 }
 
-static void do_squery(std::vector<std::string> &commands, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(commands[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect fp number");
+// Before a member of `ent` changes: it had `old_score` if `had`, and has
+// `new_score` after if `has`. See Stream.
+static void streams_before_member_write(Entry *ent, const char *name, size_t len,
+        bool had, double old_score, bool has, double new_score) {
+    if (had && has && old_score == new_score) {
+        return;
     }
-    const std::string &name = commands[3];
-    int64_t offset = 0, limit = 0;
-    if (!str2int(commands[4], offset) || !str2int(commands[5], limit)) {
-        return out_err(out, ERR_BAD_ARG, "expect int");
+    for (size_t i = 0; ent->pins > 0 && i < g_streams.size(); ) {
+        Conn *conn = g_streams[i];
+        Stream *st = conn->stream;
+        bool gone = st->ent == ent && had && stream_ahead(st, old_score, name, len);
+        bool comes = st->ent == ent && has && stream_ahead(st, new_score, name, len);
+        if (!gone && !comes) {
+            i++;
+            continue;
+        }
+        st->noted_bytes += ((size_t)gone + (size_t)comes) * (k_stream_note_size + len);
+        if (st->noted_bytes > st->size) {
+            stream_gen(st, st->rest, SIZE_MAX);
+            stream_unpin(conn);     // removes g_streams[i]
+            continue;
+        }
+        if (gone) {
+            stream_note(st->added, st->removed, old_score, name, len);
+        }
+        if (comes) {
+            stream_note(st->removed, st->added, new_score, name, len);
+        }
+        i++;
     }
+}
 
-    Sorted_Set *sset = expect_sset(commands[1]);
-    if (!sset) {
-        return out_err(out, ERR_BAD_TYP, "expect sset");
-    }
+static void stream_free(Conn *conn) {
+    stream_unpin(conn);
+    delete conn->stream;
+    conn->stream = NULL;
+}
 
-    if (limit <= 0) {
-        return out_arr(out, 0);
+static void stream_step(Conn *conn) {
+    Stream *st = conn->stream;
+    size_t before = conn->outgoing.size();
+    if (st->rest_pos < st->rest.size()) {
+        size_t n = st->rest.size() - st->rest_pos;
+        n = n < k_stream_chunk ? n : k_stream_chunk;
+        buf_push_back(conn->outgoing, &st->rest[st->rest_pos], n);
+        st->rest_pos += n;
+    } else {
+        stream_gen(st, conn->outgoing, k_stream_chunk);
     }
-    SSNode *ssnode = sset_seekge(sset, score, name.data(), name.size());
-    ssnode = ssnode_offset(ssnode, offset);
-
-    size_t ctx = out_begin_arr(out);
-    int64_t n = 0;
-    while (ssnode && n < limit) {
-        out_str(out, ssnode->name, ssnode->len);
-        out_dbl(out, ssnode->score);
-        ssnode = ssnode_offset(ssnode, +1);
-        n += 2;
+    st->size -= conn->outgoing.size() - before;
+    if (st->size == 0) {
+        assert(st->npairs == 0);
+        stream_free(conn);
     }
-    out_end_arr(out, ctx, (uint32_t)n);
 }
 
-static void cmd_execute(std::vector<std::string> &commands, Buffer &out) {
-    if (commands.size() == 2 && commands[0] == "get") return do_get(commands, out);
-    else if (commands.size() == 3 && commands[0] == "set") return do_set(commands, out);
-    else if (commands.size() == 2 && commands[0] == "del") return do_del(commands, out);
-    else if (commands.size() == 1 && commands[0] == "keys") return do_keys(commands, out);
-    else if (commands.size() == 4 && commands[0] == "sadd") return do_sadd(commands, out);
-    else if (commands.size() == 3 && commands[0] == "srem") return do_srem(commands, out);
-    else if (commands.size() == 3 && commands[0] == "sscore") return do_sscore(commands, out);
-    else if (commands.size() == 6 && commands[0] == "squery") return do_squery(commands, out);
-    else return out_err(out, ERR_UNKNOWN, "unknown command.");
+static void stream_start(Conn *conn, Entry *ent, SSNode *node, SSNode *end, int64_t dir,
+                         uint32_t npairs, size_t size) {
+    Stream *st = new Stream();
+    st->ent = ent;
+    st->node = node;
+    st->end.score = end->score;
+    st->end.name.assign(end->name, end->len);
+    st->dir = dir;
+    st->npairs = npairs;
+    st->size = size;
+    ent->pins++;
+    g_streams.push_back(conn);
+    conn->stream = st;
+    stream_step(conn);
 }
 
-static void response_begin(Buffer &out, size_t *header) {
-    *header = out.size();
-    buf_push_back_u32(out, 0);
-}
+enum {
+    AGG_SUM = 0,
+    AGG_MIN = 1,
+    AGG_MAX = 2,
+};
 
-static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
+// A zunionstore/zinterstore over large inputs, done a chunk at a time
+// between other requests: the inputs are scanned into a new set that is
+// only hashed, its members are sorted in runs that are then merged, and
+// the tree is linked in one go. The inputs are pinned like a Stream's, and
+// a write to one of them finishes the job first, so the result is the same
+// as if the command had run at once. The reply waits in `reply` until the
+// connection can take it.
+struct SetOpJob {
+    bool inter = false;
+    uint32_t aggregate = AGG_SUM;
+    std::string dest;
+    std::vector<Entry *> srcs;      // pinned, NULL if missing; the smallest first for inter
+    std::vector<double> weights;
+    size_t src = 0;                 // the input being scanned
+    SSNode *node = NULL;            // its next member, NULL once all are scanned
+    Entry *ent = NULL;              // the result, not in the keyspace yet
+    std::vector<SSNode *> nodes;    // its members, sorted a run at a time
+    size_t nsorted = 0;
+    std::vector<std::pair<size_t, size_t>> runs;   // a heap of the sorted runs left
+    std::vector<SSNode *> merged;
+    bool done = false;
+    Buffer reply;
+    uint32_t proto = 1;
+    uint32_t id = 0;
+};
+
+static std::vector<Conn *> g_jobs;      // conns with a SetOpJob
+
+// jobs to step, or finished ones that can be delivered
+static bool jobs_pending() {
+    for (Conn *conn : g_jobs) {
+        if (!conn->job->done || !conn->send_inflight) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static void response_end(Buffer &out, size_t header) {
-    size_t message_size = response_size(out, header);
-    if (message_size > k_max_message) {
-        out.resize(header + 4);
-        out_err(out, ERR_TOO_BIG, "response is too big.");
-        message_size = response_size(out, header);
+static void setop_complete(SetOpJob *job);
+
+// the jobs reading `ent` finish their work before it is modified; the
+// streams note what changes instead, see streams_before_member_write()
+static void entry_before_write(Entry *ent) {
+    for (size_t i = 0; ent->pins > 0 && i < g_jobs.size(); i++) {
+        SetOpJob *job = g_jobs[i]->job;
+        if (std::find(job->srcs.begin(), job->srcs.end(), ent) != job->srcs.end()) {
+            setop_complete(job);    // unpins, stays in g_jobs until delivered
+        }
     }
-    uint32_t len = (uint32_t)message_size;
-    memcpy(&out[header], &len, 4);
 }
 
-static bool handle_single_request(Conn *conn) {
+struct LookupKey {
+    struct HNode node;
+    std::string key;
+};
+
+const size_t k_evict_pool_size = 16;
+const size_t k_evict_max_samples = 64;
+const size_t k_evict_max_keys = 16;     // per write, the next writes do the rest
+
+// an eviction candidate, by name since it may be gone by the time it is picked
+struct EvictCandidate {
+    uint64_t score = 0;     // higher is evicted first
+    LookupKey key;
+};
+
+static struct {
+    std::vector<EvictCandidate> pool;   // by ascending score, kept across writes
+    uint64_t evicted = 0;
+    uint64_t rejected = 0;  // writes refused for lack of anything to evict
+} g_evict;
+
+static size_t mem_used() {
+    return data_store.mem_total + data_store.db.mem_usage();
+}
+
+static uint64_t evict_score(Entry *ent) {
+    uint32_t access = __atomic_load_n(&ent->access, __ATOMIC_RELAXED);
+    switch (g_config.maxmemory_policy) {
+    case EVICT_LRU:
+        return (uint32_t)t_now_ms - access;    // idle milliseconds
+    case EVICT_LFU:
+        return 255 - lfu_decayed(access);
+    default:
+        return rand_next();
+    }
+}
+
+// merges a few sampled keys into the pool, which keeps the best candidates
+// seen across samples, like Redis's eviction pool
+static void evict_pool_populate() {
+    HNode *nodes[k_evict_max_samples];
+    size_t n = hm_sample(&data_store.db.map, rand_next(), nodes,
+        (size_t)g_config.maxmemory_samples);
+    std::vector<EvictCandidate> &pool = g_evict.pool;
+    for (size_t i = 0; i < n; i++) {
+        Entry *ent = EntryTraits::owner(nodes[i]);
+        uint64_t score = evict_score(ent);
+        if (pool.size() == k_evict_pool_size && score <= pool[0].score) {
+            continue;
+        }
+        bool dup = false;
+        for (EvictCandidate &cand : pool) {
+            dup = dup || (cand.key.node.hashcode == ent->node.hashcode && cand.key.key == ent->key);
+        }
+        if (dup) {
+            continue;
+        }
+        if (pool.size() == k_evict_pool_size) {
+            pool.erase(pool.begin());
+        }
+        size_t pos = 0;
+        while (pos < pool.size() && pool[pos].score < score) {
+            pos++;
+        }
+        EvictCandidate &cand = *pool.emplace(pool.begin() + pos);
+        cand.score = score;
+        cand.key.key = ent->key;
+        cand.key.node.hashcode = ent->node.hashcode;
+    }
+}
+
+// deletes the best candidate still in the keyspace
+static bool evict_one() {
+    evict_pool_populate();
+    std::vector<EvictCandidate> &pool = g_evict.pool;
+    while (!pool.empty()) {
+        LookupKey key;
+        key.key.swap(pool.back().key.key);
+        key.node.hashcode = pool.back().key.node.hashcode;
+        pool.pop_back();
+        Entry *ent = data_store.db.remove(key.key, key.node.hashcode);
+        if (ent) {
+            entry_before_write(ent);
+            entry_del(ent);
+            g_evict.evicted++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Evicts keys until memory is under `maxmemory`, but at most a few per
+// write so that no single write stalls on it. Returns false only if memory
+// is over and there is nothing to evict.
+static bool evict_before_write() {
+    if (g_config.maxmemory == 0 || mem_used() <= (size_t)g_config.maxmemory) {
+        return true;
+    }
+    if (g_config.maxmemory_policy != EVICT_NONE) {
+        for (size_t i = 0; i < k_evict_max_keys && mem_used() > (size_t)g_config.maxmemory; i++) {
+            if (!evict_one()) {
+                break;
+            }
+        }
+    }
+    if (mem_used() <= (size_t)g_config.maxmemory) {
+        return true;
+    }
+    if (g_config.maxmemory_policy == EVICT_NONE || data_store.db.size() == 0) {
+        g_evict.rejected++;
+        return false;
+    }
+    return true;
+}
+
+// commands that may allocate, the others run regardless of `maxmemory`
+static bool cmd_is_write(const std::string &name) {
+    return name == "set" || name == "incr" || name == "decr" || name == "incrby"
+        || name == "decrby" || name == "incrbyfloat" || name == "sadd"
+        || name == "zunionstore" || name == "zinterstore";
+}
+
+const size_t k_maint_work = 1024;   // nodes moved per step, between clock checks
+
+// Background maintenance, run by the writer in time-budgeted rounds when the
+// event loop is idle, and every 1/maint_hz seconds otherwise: finishes
+// rehashes, shrinks tables emptied by deletes and evicts down to maxmemory,
+// so that less of it is left to requests.
+static struct {
+    std::vector<LookupKey> ssets;   // sorted sets whose hashtable has work
+    uint64_t next_round_us = 0;
+    uint64_t rounds = 0;
+    uint64_t busy_us = 0;
+    uint64_t rehashed = 0;  // nodes moved
+    uint64_t shrinks = 0;
+    uint64_t evicted = 0;
+} g_maint;
+
+// queues a sorted set whose hashtable just started to need work; it stays
+// queued until done, so this only runs on the transition
+static void maint_watch_sset(Entry *ent, bool had_work) {
+    if (!had_work && ent->sset.hmap.pending_work()) {
+        LookupKey key;
+        key.key = ent->key;
+        key.node.hashcode = ent->node.hashcode;
+        g_maint.ssets.push_back(key);
+    }
+}
+
+static bool maint_hmap(HMap *hmap) {
+    if (!hm_pending_work(hmap)) {
+        return false;
+    }
+    if (hm_shrink(hmap)) {
+        g_maint.shrinks++;
+    }
+    g_maint.rehashed += hm_rehash(hmap, k_maint_work);
+    return true;
+}
+
+const size_t k_defrag_nodes = 256;  // sorted-set members looked at per step
+const uint64_t k_defrag_backoff_us = 10 * 1000 * 1000;
+
+// An active defragmentation pass visits the keyspace one slot per step, and
+// the members of the sorted sets found there a chunk per step, moving what
+// sits on sparse pages. Entries pinned by a stream are left alone.
+static struct {
+    bool active = false;
+    bool scanned = false;           // all slots visited, only `ssets` left
+    size_t slot = 0;
+    std::vector<LookupKey> ssets;   // the last one is in progress
+    int64_t rank = 0;               // members done in it
+    size_t frag_at_start = 0;
+    size_t frag_at_end = 0;
+    uint64_t not_before_us = 0;     // after a pass that did not help much
+    uint64_t passes = 0;
+} g_defrag;
+
+static void *entry_block_new(size_t size) {
+    return ::operator new(size);
+}
+
+static void entry_block_free(void *ptr) {
+    ::operator delete(ptr);
+}
+
+// the value string is handed over, the key copied to a fresh block as well
+static Entry *entry_defrag(Entry *ent) {
+    if (ent->pins > 0 || !defrag_sparse(ent)) {
+        return ent;
+    }
+    void *mem = defrag_alloc(ent, sizeof(Entry), &entry_block_new, &entry_block_free);
+    if (!mem) {
+        return ent;
+    }
+    Entry *fresh = new (mem) Entry();
+    fresh->node.hashcode = ent->node.hashcode;
+    fresh->key = ent->key;
+    fresh->type = ent->type;
+    fresh->enc = ent->enc;
+    fresh->str.swap(ent->str);  // readers still on `ent` retry
+    fresh->ival = ent->ival;
+    fresh->sset = ent->sset;    // the members do not point back to it
+    fresh->mem = ent->mem;
+    fresh->access = ent->access;
+    bool found = data_store.db.replace(ent, fresh);
+    assert(found);
+    entry_mem_sync(fresh);
+    defrag_note_move(ent, fresh, sizeof(Entry));
+    epoch_retire(ent, &entry_free);
+    return fresh;
+}
+
+static void cb_defrag(Entry *ent) {
+    ent = entry_defrag(ent);
+    if (ent->type == T_SSET && ent->pins == 0 && sset_size(&ent->sset) > 0) {
+        LookupKey key;
+        key.key = ent->key;
+        key.node.hashcode = ent->node.hashcode;
+        g_defrag.ssets.push_back(key);
+    }
+}
+
+static void defrag_sset_step() {
+    LookupKey &key = g_defrag.ssets.back();
+    Entry *ent = data_store.db.lookup(key.key, key.node.hashcode);
+    SSNode *ssnode = NULL;
+    if (ent && ent->type == T_SSET && ent->pins == 0) {
+        ssnode = ssnode_offset(sset_first(&ent->sset), g_defrag.rank);
+    }
+    for (size_t i = 0; ssnode && i < k_defrag_nodes; i++) {
+        ssnode = ssnode_next(ssnode_defrag(&ent->sset, ssnode));
+        g_defrag.rank++;
+    }
+    if (!ssnode) {
+        g_defrag.ssets.pop_back();
+        g_defrag.rank = 0;
+    }
+}
+
+static bool defrag_over(size_t frag, size_t live) {
+    return frag > (size_t)g_config.defrag_ignore_bytes
+        && frag * 100 > live * (size_t)g_config.defrag_threshold;
+}
+
+static bool defrag_wanted(uint64_t now_us) {
+    if (!defrag_enabled() || g_defrag.active) {
+        return false;
+    }
+    size_t live = defrag_live_bytes(), frag = defrag_page_bytes() - live;
+    // a backoff ends early once there is that much more waste again
+    size_t growth = frag > g_defrag.frag_at_end ? frag - g_defrag.frag_at_end : 0;
+    bool backoff = now_us < g_defrag.not_before_us && !defrag_over(growth, live);
+    return !backoff && defrag_over(frag, live);
+}
+
+static void defrag_start() {
+    g_defrag.active = true;
+    g_defrag.scanned = false;
+    g_defrag.slot = 0;
+    g_defrag.frag_at_start = defrag_page_bytes() - defrag_live_bytes();
+}
+
+static void defrag_step(uint64_t now_us) {
+    if (!g_defrag.ssets.empty()) {
+        defrag_sset_step();
+    } else if (!g_defrag.scanned) {
+        g_defrag.slot = data_store.db.scan(g_defrag.slot, &cb_defrag);
+        g_defrag.scanned = g_defrag.slot == 0;
+    }
+    defrag_alloc_done();
+    if (g_defrag.scanned && g_defrag.ssets.empty()) {
+        g_defrag.active = false;
+        g_defrag.passes++;
+        // untracked allocations share the pages, so the threshold may
+        // never be met; passes that gain little are spaced out
+        size_t frag = defrag_page_bytes() - defrag_live_bytes();
+        g_defrag.frag_at_end = frag;
+        if (frag * 32 > g_defrag.frag_at_start * 31) {
+            g_defrag.not_before_us = now_us + k_defrag_backoff_us;
+        }
+        malloc_trim(0);     // glibc keeps emptied pages mapped otherwise
+    }
+}
+
+static bool migrate_step(uint64_t now_us);
+static bool migrate_pending();
+static void migrate_send();
+
+// a bounded piece of work, false when there is nothing left
+static bool maint_step(uint64_t now_us) {
+    if (maint_hmap(&data_store.db.map)) {
+        return true;
+    }
+    while (!g_maint.ssets.empty()) {
+        LookupKey key;
+        key.key.swap(g_maint.ssets.back().key);
+        key.node.hashcode = g_maint.ssets.back().node.hashcode;
+        g_maint.ssets.pop_back();
+        Entry *ent = data_store.db.lookup(key.key, key.node.hashcode);
+        if (!ent || ent->type != T_SSET || !maint_hmap(&ent->sset.hmap.map)) {
+            continue;   // deleted or done by requests meanwhile
+        }
+        entry_mem_sync(ent);
+        if (ent->sset.hmap.pending_work()) {
+            g_maint.ssets.push_back(key);
+        }
+        return true;
+    }
+    if (g_config.maxmemory > 0 && mem_used() > (size_t)g_config.maxmemory
+        && g_config.maxmemory_policy != EVICT_NONE && evict_one()) {
+        g_maint.evicted++;
+        return true;
+    }
+    if (migrate_step(now_us)) {
+        return true;
+    }
+    if (g_defrag.active) {
+        defrag_step(now_us);
+        return true;
+    }
+    return false;
+}
+
+static bool maint_pending() {
+    return data_store.db.pending_work() || !g_maint.ssets.empty() || g_defrag.active
+        || migrate_pending()
+        || (g_config.maxmemory > 0 && g_config.maxmemory_policy != EVICT_NONE
+            && mem_used() > (size_t)g_config.maxmemory && data_store.db.size() > 0);
+}
+
+// the event loop timeout: none while there is work, else the next round
+static int maint_timeout_ms() {
+    if (t_reader < 0 && jobs_pending()) {
+        return 0;
+    }
+    if (t_reader >= 0 || g_config.maint_budget_us == 0) {
+        return -1;
+    }
+    if (maint_pending()) {
+        return 0;
+    }
+    uint64_t now_us = clock_usec(CLOCK_MONOTONIC);
+    if (now_us >= g_maint.next_round_us) {
+        return 0;
+    }
+    return (int)((g_maint.next_round_us - now_us + 999) / 1000);
+}
+
+// called after each batch of events, `idle` if there was none
+static void maint_run(bool idle) {
+    if (t_reader >= 0 || g_config.maint_budget_us == 0) {
+        return;
+    }
+    uint64_t start_us = clock_usec(CLOCK_MONOTONIC);
+    if (!idle && start_us < g_maint.next_round_us) {
+        return;
+    }
+    g_maint.next_round_us = start_us + 1000000 / (uint64_t)g_config.maint_hz;
+    uint64_t now_us = start_us;
+    t_now_ms = start_us / 1000;
+    if (defrag_wanted(now_us)) {
+        defrag_start();
+    }
+    bool more = true;
+    while (more && now_us - start_us < (uint64_t)g_config.maint_budget_us) {
+        // one step at a time, so that the readers are not held off for long
+        seq_write_begin();
+        more = maint_step(now_us);
+        seq_write_end();
+        migrate_send();
+        now_us = clock_usec(CLOCK_MONOTONIC);
+    }
+    epoch_reclaim();    // also what the readers retired while no write came
+    capture_flush();
+    g_maint.rounds++;
+    g_maint.busy_us += now_us - start_us;
+}
+
+// only canonical forms, so that formatting `out` gives back the same bytes
+static bool str2int_exact(const char *s, size_t len, int64_t &out) {
+    if (len == 0 || len > 20) {
+        return false;
+    }
+    size_t i = s[0] == '-' ? 1 : 0;
+    if (i == len || (s[i] == '0' && (i + 1 < len || i == 1))) {
+        return false;   // no digits, leading zeros or -0
+    }
+    for (size_t j = i; j < len; j++) {
+        if (s[j] < '0' || s[j] > '9') {
+            return false;
+        }
+    }
+    char buf[24];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    errno = 0;
+    out = strtoll(buf, NULL, 10);
+    return errno != ERANGE;
+}
+
+// Values change in place under the readers, so the setters are write
+// sections; a reader that saw a half-set value retries.
+static void entry_set_int(Entry *ent, int64_t val) {
+    seq_write_begin();
+    entry_retire_str(ent);
+    ent->enc = ENC_INT;
+    ent->ival = val;
+    seq_write_end();
+}
+
+static bool entry_set_lz(Entry *ent, const std::string &val) {
+    uint64_t start_ns = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+    std::string packed(val.size() - val.size() / k_lz_min_saving, '\0');
+    size_t n = lz_compress((const uint8_t *)val.data(), val.size(),
+        (uint8_t *)&packed[0], packed.size());
+    g_lzstats.compress_ns += clock_nsec(CLOCK_THREAD_CPUTIME_ID) - start_ns;
+    if (n == 0) {
+        g_lzstats.skipped++;
+        return false;
+    }
+    packed.resize(n);
+    packed.shrink_to_fit();
+    g_lzstats.values++;
+    g_lzstats.raw_bytes += val.size();
+    g_lzstats.packed_bytes += n;
+    ent->enc = ENC_LZ;
+    ent->ival = (int64_t)val.size();
+    ent->str.swap(packed);
+    return true;
+}
+
+static void entry_set_str(Entry *ent, std::string &val) {
+    int64_t ival = 0;
+    if (str2int_exact(val.data(), val.size(), ival)) {
+        return entry_set_int(ent, ival);
+    }
+    seq_write_begin();
+    entry_retire_str(ent);
+    if (g_config.compress_threshold == 0 || val.size() < (size_t)g_config.compress_threshold
+        || !entry_set_lz(ent, val)) {
+        ent->enc = ENC_RAW;
+        ent->str.swap(val);
+    }
+    seq_write_end();
+}
+
+// decompresses straight into the reply, fails on a corrupt value
+static bool out_lz(Buffer &out, const char *data, size_t size, size_t raw_len) {
+    uint64_t start_ns = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+    buf_push_back_u8(out, TAG_STR);
+    buf_push_back_u32(out, (uint32_t)raw_len);
+    size_t pos = out.size();
+    out.resize(pos + raw_len);
+    bool ok = lz_decompress((const uint8_t *)data, size, &out[pos], raw_len);
+    if (!ok) {
+        out.resize(pos - 5);
+    }
+    __atomic_fetch_add(&g_lzstats.decompress_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_lzstats.decompress_ns,
+        clock_nsec(CLOCK_THREAD_CPUTIME_ID) - start_ns, __ATOMIC_RELAXED);
+    return ok;
+}
+
+// the value as text, decompressed into `buf` if need be
+static const std::string &entry_raw_str(Entry *ent, std::string &buf) {
+    if (ent->enc != ENC_LZ) {
+        return ent->str;
+    }
+    buf.resize((size_t)ent->ival);
+    if (!lz_decompress((const uint8_t *)ent->str.data(), ent->str.size(),
+            (uint8_t *)&buf[0], buf.size())) {
+        buf.clear();
+    }
+    return buf;
+}
+
+static void do_get(std::vector<std::string> &commands, Buffer &out) {
+    Entry *ent = data_store.db.lookup(commands[1]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    entry_touch(ent);
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    }
+    if (ent->enc == ENC_INT) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%lld", (long long)ent->ival);
+        return out_str(out, buf, (size_t)n);
+    }
+    if (ent->enc == ENC_LZ) {
+        if (!out_lz(out, ent->str.data(), ent->str.size(), (size_t)ent->ival)) {
+            return out_err(out, ERR_UNKNOWN, "corrupt compressed value");
+        }
+        return;
+    }
+    return out_str(out, ent->str.data(), ent->str.size());
+}
+
+static void do_set(std::vector<std::string> &commands, Buffer &out) {
+    std::string &key = commands[1];
+    uint64_t hcode = EntryTraits::hash(key);
+    Entry *ent = data_store.db.lookup(key, hcode);
+    if (ent) {
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+        }
+        entry_touch(ent);
+        entry_set_str(ent, commands[2]);
+        entry_mem_sync(ent);
+    } else {
+        ent = entry_new(T_STR);
+        ent->key.swap(key);
+        ent->node.hashcode = hcode;
+        entry_set_str(ent, commands[2]);
+        entry_mem_sync(ent);
+        data_store.db.insert(ent);
+    }
+    return out_nil(out);
+}
+
+static void do_del(std::vector<std::string> &commands, Buffer &out) {
+    Entry *ent = data_store.db.remove(commands[1]);
+    if (ent) {
+        entry_before_write(ent);
+        entry_del(ent);
+    }
+    return out_int(out, ent ? 1 : 0);
+}
+
+static void do_keys(std::vector<std::string> &, Buffer &out) {
+    // size the reply first rather than building it only to discard it
+    size_t size = 5;
+    data_store.db.foreach([&size](Entry *ent) {
+        size += 5 + ent->key.size();
+        return true;
+    });
+    if (size > k_max_message) {
+        return out_err(out, ERR_TOO_BIG, "response is too big.");
+    }
+    out_arr(out, (uint32_t)data_store.db.size());
+    data_store.db.foreach([&out](Entry *ent) {
+        out_str(out, ent->key.data(), ent->key.size());
+        return true;
+    });
+}
+
+static bool str2dbl(const std::string &s, double &out) {
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return endp == s.c_str() + s.size() && !isnan(out);
+}
+
+static bool str2int(const std::string &s, int64_t &out) {
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return endp == s.c_str() + s.size();
+}
+
+// numeric arguments, typed v2 ones are taken as is
+static bool arg_int(const std::vector<std::string> &commands, size_t i, int64_t &out) {
+    if (i < k_max_typed_args && (t_args.typed >> i & 1)) {
+        out = t_args.ival[i];
+        return t_args.tag[i] == TAG_INT;
+    }
+    return str2int(commands[i], out);
+}
+
+static bool arg_dbl(const std::vector<std::string> &commands, size_t i, double &out) {
+    if (i < k_max_typed_args && (t_args.typed >> i & 1)) {
+        out = t_args.tag[i] == TAG_INT ? (double)t_args.ival[i] : t_args.dval[i];
+        return !isnan(out);
+    }
+    return str2dbl(commands[i], out);
+}
+
+// the string entry for an arithmetic command, created if missing
+// the string entry of the key, NULL if there is none; false if another
+// type is there
+static bool expect_str_entry(const std::string &key, uint64_t hcode, Entry *&ent, Buffer &out) {
+    ent = data_store.db.lookup(key, hcode);
+    if (ent && ent->type != T_STR) {
+        out_err(out, ERR_BAD_TYP, "a non-string value exists");
+        return false;
+    }
+    if (ent) {
+        entry_touch(ent);
+    }
+    return true;
+}
+
+// a string entry for a key that had none, for the caller to set and insert
+// once the update has succeeded
+static Entry *str_entry_new(std::string &key, uint64_t hcode) {
+    Entry *ent = entry_new(T_STR);
+    ent->key.swap(key);
+    ent->node.hashcode = hcode;
+    return ent;
+}
+
+static void incr_by(std::string &key, int64_t delta, Buffer &out) {
+    uint64_t hcode = EntryTraits::hash(key);
+    Entry *ent = NULL;
+    if (!expect_str_entry(key, hcode, ent, out)) {
+        return;
+    }
+    int64_t val = ent ? ent->ival : 0;
+    std::string buf;
+    if (ent && ent->enc != ENC_INT) {
+        const std::string &str = entry_raw_str(ent, buf);
+        if (!str2int_exact(str.data(), str.size(), val)) {
+            return out_err(out, ERR_BAD_TYP, "value is not an integer");
+        }
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would overflow");
+    }
+    bool created = !ent;
+    if (created) {
+        ent = str_entry_new(key, hcode);
+    }
+    entry_set_int(ent, val);
+    entry_mem_sync(ent);
+    if (created) {
+        data_store.db.insert(ent);
+    }
+    return out_int(out, val);
+}
+
+static void do_incr(std::vector<std::string> &commands, Buffer &out) {
+    return incr_by(commands[1], +1, out);
+}
+
+static void do_decr(std::vector<std::string> &commands, Buffer &out) {
+    return incr_by(commands[1], -1, out);
+}
+
+static void do_incrby(std::vector<std::string> &commands, Buffer &out) {
+    int64_t delta = 0;
+    if (!arg_int(commands, 2, delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    return incr_by(commands[1], delta, out);
+}
+
+static void do_decrby(std::vector<std::string> &commands, Buffer &out) {
+    int64_t delta = 0;
+    if (!arg_int(commands, 2, delta) || delta == INT64_MIN) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    return incr_by(commands[1], -delta, out);
+}
+
+static void do_incrbyfloat(std::vector<std::string> &commands, Buffer &out) {
+    double delta = 0;
+    if (!arg_dbl(commands, 2, delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    std::string &key = commands[1];
+    uint64_t hcode = EntryTraits::hash(key);
+    Entry *ent = NULL;
+    if (!expect_str_entry(key, hcode, ent, out)) {
+        return;
+    }
+    double val = ent ? (double)ent->ival : 0;
+    std::string raw;
+    if (ent && ent->enc != ENC_INT && !str2dbl(entry_raw_str(ent, raw), val)) {
+        return out_err(out, ERR_BAD_TYP, "value is not a float");
+    }
+    val += delta;
+    if (isinf(val) || isnan(val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+    }
+    // stored as text like any other value, integral results get re-encoded
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.17g", val);
+    std::string str(buf, (size_t)n);
+    bool created = !ent;
+    if (created) {
+        ent = str_entry_new(key, hcode);
+    }
+    entry_set_str(ent, str);
+    entry_mem_sync(ent);
+    if (created) {
+        data_store.db.insert(ent);
+    }
+    return out_dbl(out, val);
+}
+
+static void do_sadd(std::vector<std::string> &commands, Buffer &out) {
+    double score = 0;
+    if (!arg_dbl(commands, 2, score)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+
+    std::string &key = commands[1];
+    uint64_t hcode = EntryTraits::hash(key);
+    Entry *ent = data_store.db.lookup(key, hcode);
+    if (!ent) {
+        ent = entry_new(T_SSET);
+        ent->key.swap(key);
+        ent->node.hashcode = hcode;
+        data_store.db.insert(ent);
+    } else {
+        if (ent->type != T_SSET) {
+            return out_err(out, ERR_BAD_TYP, "expect sset");
+        }
+        entry_touch(ent);
+        entry_before_write(ent);
+    }
+
+    const std::string &name = commands[3];
+    if (ent->pins > 0) {
+        SSNode *old = sset_lookup(&ent->sset, name.data(), name.size());
+        streams_before_member_write(ent, name.data(), name.size(),
+            old != NULL, old ? old->score : 0, true, score);
+    }
+    bool had_work = ent->sset.hmap.pending_work();
+    bool added = sset_insert(&ent->sset, name.data(), name.size(), score);
+    maint_watch_sset(ent, had_work);
+    entry_mem_sync(ent);
+    return out_int(out, (int64_t)added);
+}
+
+static const Sorted_Set k_empty_sset;
+
+static Sorted_Set *expect_sset(std::string &s) {
+    Entry *ent = data_store.db.lookup(s);
+    if (!ent) {
+        return (Sorted_Set *)&k_empty_sset;
+    }
+    entry_touch(ent);
+    return ent->type == T_SSET ? &ent->sset : NULL;
+}
+
+// hashtable lookups may finish a rehash and free slots, so resync afterwards
+static void sset_mem_sync(Sorted_Set *sset) {
+    if (sset != &k_empty_sset) {
+        entry_mem_sync(container_of(sset, Entry, sset));
+    }
+}
+
+// a sorted set without members is not kept, as if it never existed
+static bool entry_del_if_empty(Entry *ent) {
+    if (sset_size(&ent->sset) > 0) {
+        return false;
+    }
+    data_store.db.remove(ent->key, ent->node.hashcode);
+    entry_del(ent);
+    return true;
+}
+
+static void do_srem(std::vector<std::string> &commands, Buffer &out) {
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+
+    const std::string &name = commands[2];
+    SSNode *ssnode = sset_lookup(sset, name.data(), name.size());
+    if (ssnode) {
+        Entry *ent = container_of(sset, Entry, sset);
+        entry_before_write(ent);
+        if (ent->pins > 0) {
+            streams_before_member_write(ent, ssnode->name, ssnode->len, true, ssnode->score, false, 0);
+        }
+        bool had_work = sset->hmap.pending_work();
+        sset_delete(sset, ssnode);
+        maint_watch_sset(ent, had_work);
+        if (entry_del_if_empty(ent)) {
+            return out_int(out, 1);
+        }
+    }
+    sset_mem_sync(sset);
+    return out_int(out, ssnode ? 1 : 0);
+}
+
+static void do_sscore(std::vector<std::string> &commands, Buffer &out) {
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+
+    const std::string &name = commands[2];
+    SSNode *ssnode = sset_lookup(sset, name.data(), name.size());
+    sset_mem_sync(sset);
+    return ssnode ? out_dbl(out, ssnode->score) : out_nil(out);
+}
+
+// up to `limit` elements from `ssnode` on, walking in the direction `dir`
+static void out_range(Conn *conn, Sorted_Set *sset, SSNode *ssnode, int64_t dir,
+                      int64_t limit, Buffer &out) {
+    // the length prefix goes out first, so size the reply before generating it
+    uint32_t npairs = 0;
+    size_t size = 0;
+    SSNode *end = NULL;
+    for (SSNode *it = ssnode; it && 2 * (int64_t)npairs < limit; it = ssnode_step(it, dir)) {
+        npairs++;
+        size += squery_pair_size(it);
+        if (size > k_max_message) {
+            return out_err(out, ERR_TOO_BIG, "response is too big.");
+        }
+        end = it;
+    }
+
+    out_arr(out, 2 * npairs);
+    if (size <= k_stream_chunk) {
+        Stream st;
+        st.node = ssnode;
+        st.dir = dir;
+        st.npairs = npairs;
+        return stream_gen(&st, out, SIZE_MAX);
+    }
+    stream_start(conn, container_of(sset, Entry, sset), ssnode, end, dir, npairs, size);
+}
+
+static void do_squery(Conn *conn, std::vector<std::string> &commands, Buffer &out) {
+    double score = 0;
+    if (!arg_dbl(commands, 2, score)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    const std::string &name = commands[3];
+    int64_t offset = 0, limit = 0;
+    if (!arg_int(commands, 4, offset) || !arg_int(commands, 5, limit)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+
+    if (limit <= 0) {
+        return out_arr(out, 0);
+    }
+    SSNode *ssnode = sset_seekge(sset, score, name.data(), name.size());
+    ssnode = ssnode_offset(ssnode, offset);
+    return out_range(conn, sset, ssnode, +1, limit, out);
+}
+
+// squery in descending order, starting from the last member <= (score, name)
+static void do_srevquery(Conn *conn, std::vector<std::string> &commands, Buffer &out) {
+    double score = 0;
+    if (!arg_dbl(commands, 2, score)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    const std::string &name = commands[3];
+    int64_t offset = 0, limit = 0;
+    if (!arg_int(commands, 4, offset) || !arg_int(commands, 5, limit)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+
+    if (limit <= 0) {
+        return out_arr(out, 0);
+    }
+    SSNode *ssnode = sset_seekle(sset, score, name.data(), name.size());
+    ssnode = ssnode_offset(ssnode, -offset);
+    return out_range(conn, sset, ssnode, -1, limit, out);
+}
+
+static void do_zrank(std::vector<std::string> &commands, Buffer &out) {
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+    const std::string &name = commands[2];
+    SSNode *ssnode = sset_lookup(sset, name.data(), name.size());
+    sset_mem_sync(sset);
+    if (!ssnode) {
+        return out_nil(out);
+    }
+    int64_t rank = ssnode_rank(ssnode);
+    if (commands[0] == "zrevrank") {
+        rank = (int64_t)sset_size(sset) - 1 - rank;
+    }
+    return out_int(out, rank);
+}
+
+// the number of members with min <= score <= max, as a difference of ranks
+static void do_zcount(std::vector<std::string> &commands, Buffer &out) {
+    double min = 0, max = 0;
+    if (!arg_dbl(commands, 2, min) || !arg_dbl(commands, 3, max)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+    int64_t size = (int64_t)sset_size(sset);
+    SSNode *lo = sset_seekge(sset, min, "", 0);
+    SSNode *hi = sset_seekgt(sset, max);
+    int64_t count = (hi ? ssnode_rank(hi) : size) - (lo ? ssnode_rank(lo) : size);
+    return out_int(out, count > 0 ? count : 0);
+}
+
+// `zpopmin|zpopmax key [count]` removes and returns up to `count` (default 1)
+// members from the low or high end, as name and score pairs
+static void do_zpop(std::vector<std::string> &commands, Buffer &out) {
+    int64_t count = 1;
+    if (commands.size() == 3 && !arg_int(commands, 2, count)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    Sorted_Set *sset = expect_sset(commands[1]);
+    if (!sset) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+
+    bool max = commands[0] == "zpopmax";
+    uint32_t npairs = 0;
+    size_t size = 0;
+    SSNode *ssnode = max ? sset_last(sset) : sset_first(sset);
+    for (SSNode *it = ssnode; it && (int64_t)npairs < count; it = ssnode_step(it, max ? -1 : +1)) {
+        npairs++;
+        size += squery_pair_size(it);
+        if (size > k_max_message) {
+            return out_err(out, ERR_TOO_BIG, "response is too big.");
+        }
+    }
+
+    out_arr(out, 2 * npairs);
+    if (npairs == 0) {
+        return;
+    }
+    Entry *ent = container_of(sset, Entry, sset);
+    entry_before_write(ent);
+    bool had_work = sset->hmap.pending_work();
+    for (uint32_t i = 0; i < npairs; i++) {
+        ssnode = max ? sset_last(sset) : sset_first(sset);
+        out_str(out, ssnode->name, ssnode->len);
+        out_dbl(out, ssnode->score);
+        if (ent->pins > 0) {
+            streams_before_member_write(ent, ssnode->name, ssnode->len, true, ssnode->score, false, 0);
+        }
+        sset_delete(sset, ssnode);
+    }
+    maint_watch_sset(ent, had_work);
+    if (!entry_del_if_empty(ent)) {
+        entry_mem_sync(ent);
+    }
+}
+
+const size_t k_setop_chunk = 16 * 1024;   // members scanned, sorted or merged per step
+
+static double setop_aggregate(uint32_t aggregate, double acc, double score) {
+    if (aggregate == AGG_MIN) return score < acc ? score : acc;
+    if (aggregate == AGG_MAX) return score > acc ? score : acc;
+    double sum = acc + score;
+    return isnan(sum) ? 0 : sum;    // inf + -inf
+}
+
+static double setop_weigh(double weight, double score) {
+    double val = weight * score;
+    return isnan(val) ? 0 : val;    // 0 * inf
+}
+
+// moves on to the first member of the next non-empty input to scan
+static void setop_next_input(SetOpJob *job) {
+    size_t nscan = job->inter ? 1 : job->srcs.size();   // inter probes the others
+    for (job->node = NULL; !job->node && job->src < nscan; ) {
+        Entry *src = job->srcs[job->src];
+        job->node = src ? sset_first(&src->sset) : NULL;
+        if (!job->node) {
+            job->src++;
+        }
+    }
+}
+
+// the union accumulates into the hashed result, which is not ordered yet
+static void setop_scan(SetOpJob *job, size_t budget) {
+    Sorted_Set *result = &job->ent->sset;
+    for (; job->node && budget > 0; budget--) {
+        SSNode *node = job->node;
+        double score = setop_weigh(job->weights[job->src], node->score);
+        bool add = true;
+        if (job->inter) {
+            for (size_t i = 1; add && i < job->srcs.size(); i++) {
+                SSNode *other = sset_lookup(&job->srcs[i]->sset, node->name, node->len);
+                add = other != NULL;
+                if (other) {
+                    score = setop_aggregate(job->aggregate, score,
+                        setop_weigh(job->weights[i], other->score));
+                }
+            }
+        } else if (SSNode *acc = sset_lookup(result, node->name, node->len)) {
+            acc->score = setop_aggregate(job->aggregate, acc->score, score);
+            add = false;
+        }
+        if (add) {
+            job->nodes.push_back(sset_build_add(result, node->name, node->len, score));
+        }
+        job->node = ssnode_next(node);
+        if (!job->node) {
+            job->src++;
+            setop_next_input(job);
+        }
+    }
+    for (Entry *src : job->srcs) {
+        if (src) {
+            entry_mem_sync(src);    // lookups may have moved rehashing along
+        }
+    }
+}
+
+// a bounded piece of the work, true once `merged` holds the sorted result
+static bool setop_step(SetOpJob *job, size_t budget) {
+    if (job->node) {
+        setop_scan(job, budget);
+        return false;
+    }
+    std::vector<SSNode *> &nodes = job->nodes;
+    std::vector<std::pair<size_t, size_t>> &runs = job->runs;
+    auto run_greater = [&nodes](const std::pair<size_t, size_t> &a,
+                                const std::pair<size_t, size_t> &b) {
+        return ssnode_less(nodes[b.first], nodes[a.first]);
+    };
+    if (job->nsorted < nodes.size()) {
+        size_t end = std::min(job->nsorted + k_setop_chunk, nodes.size());
+        std::sort(nodes.begin() + job->nsorted, nodes.begin() + end, &ssnode_less);
+        runs.push_back(std::make_pair(job->nsorted, end));
+        job->nsorted = end;
+        if (end == nodes.size() && runs.size() == 1) {
+            runs.clear();
+            job->merged.swap(nodes);
+        } else if (end == nodes.size()) {
+            std::make_heap(runs.begin(), runs.end(), run_greater);
+        }
+        return false;
+    }
+    for (; budget > 0 && !runs.empty(); budget--) {
+        std::pop_heap(runs.begin(), runs.end(), run_greater);
+        std::pair<size_t, size_t> &run = runs.back();
+        job->merged.push_back(nodes[run.first++]);
+        if (run.first == run.second) {
+            runs.pop_back();
+        } else {
+            std::push_heap(runs.begin(), runs.end(), run_greater);
+        }
+    }
+    if (!runs.empty()) {
+        return false;
+    }
+    nodes.clear();
+    nodes.shrink_to_fit();
+    return true;
+}
+
+static void setop_unpin(SetOpJob *job) {
+    for (Entry *src : job->srcs) {
+        if (src) {
+            src->pins--;
+        }
+    }
+    job->srcs.clear();
+}
+
+static void setop_free(SetOpJob *job) {
+    setop_unpin(job);
+    if (Entry *ent = job->ent) {
+        // every member is in one of the two while merging
+        size_t n = ent->sset.hmap.size();
+        std::vector<SSNode *> &all = job->nodes.size() == n ? job->nodes : job->merged;
+        sset_build_abort(&ent->sset, all.data(), n);
+        entry_del(ent);
+    }
+    delete job;
+}
+
+// Finishes the work, then replaces the destination with the result.
+// Returns the number of members.
+static size_t setop_finish(SetOpJob *job) {
+    while (!setop_step(job, SIZE_MAX)) {}
+    Entry *ent = job->ent;
+    job->ent = NULL;
+    size_t n = job->merged.size();
+    if (n > 0) {
+        sset_build_link(&ent->sset, job->merged.data(), n);
+        entry_mem_sync(ent);
+    } else {
+        entry_del(ent);
+        ent = NULL;
+    }
+    job->merged.clear();
+    setop_unpin(job);
+
+    uint64_t hcode = EntryTraits::hash(job->dest);
+    if (Entry *old = data_store.db.lookup(job->dest, hcode)) {
+        entry_before_write(old);
+    }
+    // may have changed meanwhile
+    if (Entry *old = data_store.db.remove(job->dest, hcode)) {
+        entry_del(old);
+    }
+    if (ent) {
+        data_store.db.insert(ent);
+        maint_watch_sset(ent, false);
+    }
+    return n;
+}
+
+// a deferred job finished early, its reply goes out with the next delivery
+static void setop_complete(SetOpJob *job) {
+    if (!job->done) {
+        out_int(job->reply, (int64_t)setop_finish(job));
+        job->done = true;
+    }
+}
+
+// zunionstore|zinterstore dest numkeys key... [weights w...] [aggregate sum|min|max]
+static void do_zsetop(Conn *conn, std::vector<std::string> &commands, Buffer &out) {
+    int64_t numkeys = 0;
+    if (!arg_int(commands, 2, numkeys)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    if (numkeys < 1 || numkeys > (int64_t)commands.size() - 3) {
+        return out_err(out, ERR_BAD_ARG, "numkeys does not match the keys");
+    }
+    size_t nkeys = (size_t)numkeys;
+    std::vector<double> weights(nkeys, 1.0);
+    uint32_t aggregate = AGG_SUM;
+    for (size_t i = 3 + nkeys; i < commands.size(); ) {
+        if (commands[i] == "weights" && i + nkeys < commands.size()) {
+            for (size_t k = 0; k < nkeys; k++) {
+                if (!arg_dbl(commands, i + 1 + k, weights[k])) {
+                    return out_err(out, ERR_BAD_ARG, "expect fp number");
+                }
+            }
+            i += 1 + nkeys;
+        } else if (commands[i] == "aggregate" && i + 1 < commands.size()
+                   && (commands[i + 1] == "sum" || commands[i + 1] == "min"
+                       || commands[i + 1] == "max")) {
+            aggregate = commands[i + 1] == "sum" ? AGG_SUM
+                : commands[i + 1] == "min" ? AGG_MIN : AGG_MAX;
+            i += 2;
+        } else {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+
+    std::vector<Entry *> srcs(nkeys);
+    for (size_t k = 0; k < nkeys; k++) {
+        srcs[k] = data_store.db.lookup(commands[3 + k]);
+        if (srcs[k] && srcs[k]->type != T_SSET) {
+            return out_err(out, ERR_BAD_TYP, "expect sset");
+        }
+        if (srcs[k]) {
+            entry_touch(srcs[k]);
+        }
+    }
+
+    SetOpJob *job = new SetOpJob();
+    job->inter = commands[0] == "zinterstore";
+    job->aggregate = aggregate;
+    job->dest.swap(commands[1]);
+    job->ent = entry_new(T_SSET);
+    job->ent->key = job->dest;
+    job->ent->node.hashcode = EntryTraits::hash(job->dest);
+    std::vector<size_t> order(nkeys);
+    for (size_t k = 0; k < nkeys; k++) {
+        order[k] = k;
+    }
+    if (job->inter) {
+        // the members of the smallest input are probed in the others
+        std::stable_sort(order.begin(), order.end(), [&srcs](size_t a, size_t b) {
+            return (srcs[a] ? sset_size(&srcs[a]->sset) : 0)
+                < (srcs[b] ? sset_size(&srcs[b]->sset) : 0);
+        });
+    }
+    size_t nscan = 0;   // members to go through, small jobs are done at once
+    for (size_t k : order) {
+        job->srcs.push_back(srcs[k]);
+        job->weights.push_back(weights[k]);
+        if (srcs[k]) {
+            srcs[k]->pins++;
+        }
+        if (srcs[k] && (!job->inter || job->srcs.size() == 1)) {
+            nscan += sset_size(&srcs[k]->sset);
+        }
+    }
+    setop_next_input(job);
+    if (nscan <= k_setop_chunk) {
+        out_int(out, (int64_t)setop_finish(job));
+        return setop_free(job);
+    }
+    setop_step(job, k_setop_chunk);
+    conn->job = job;    // handle_single_request() defers the reply
+    g_jobs.push_back(conn);
+}
+
+static void do_memory_usage(std::vector<std::string> &commands, Buffer &out) {
+    Entry *ent = data_store.db.lookup(commands[2]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    entry_mem_sync(ent);
+    return out_int(out, (int64_t)ent->mem);
+}
+
+static void out_stat(Buffer &out, const char *name, size_t val) {
+    out_str(out, name, strlen(name));
+    out_int(out, (int64_t)val);
+}
+
+static void do_maint_stats(std::vector<std::string> &, Buffer &out) {
+    out_arr(out, 22);
+    out_stat(out, "rounds", g_maint.rounds);
+    out_stat(out, "busy_us", g_maint.busy_us);
+    out_stat(out, "rehashed", g_maint.rehashed);
+    out_stat(out, "shrinks", g_maint.shrinks);
+    out_stat(out, "evicted", g_maint.evicted);
+    out_stat(out, "queued.ssets", g_maint.ssets.size());
+    out_stat(out, "pending", maint_pending());
+    out_stat(out, "defrag.passes", g_defrag.passes);
+    out_stat(out, "defrag.moved", defrag_moved());
+    out_stat(out, "defrag.reclaimed_bytes", defrag_reclaimed());
+    out_stat(out, "defrag.frag_bytes", defrag_page_bytes() - defrag_live_bytes());
+}
+
+static void do_memory_stats(std::vector<std::string> &, Buffer &out) {
+    size_t overhead = data_store.db.mem_usage();
+    out_arr(out, 30);
+    out_stat(out, "total", data_store.mem_total + overhead);
+    out_stat(out, "keyspace.overhead", overhead);
+    out_stat(out, "keys.count", data_store.db.size());
+    out_stat(out, "type.str", data_store.mem_by_type[T_STR]);
+    out_stat(out, "type.sset", data_store.mem_by_type[T_SSET]);
+    out_stat(out, "maxmemory", (size_t)g_config.maxmemory);
+    out_stat(out, "evicted.keys", g_evict.evicted);
+    out_stat(out, "evicted.rejected", g_evict.rejected);
+    out_stat(out, "compress.values", g_lzstats.values);
+    out_stat(out, "compress.skipped", g_lzstats.skipped);
+    out_stat(out, "compress.raw_bytes", g_lzstats.raw_bytes);
+    out_stat(out, "compress.packed_bytes", g_lzstats.packed_bytes);
+    out_stat(out, "compress.cpu_ns", g_lzstats.compress_ns);
+    out_stat(out, "decompress.count", __atomic_load_n(&g_lzstats.decompress_count, __ATOMIC_RELAXED));
+    out_stat(out, "decompress.cpu_ns", __atomic_load_n(&g_lzstats.decompress_ns, __ATOMIC_RELAXED));
+}
+
+const size_t k_slowlog_size = 128;
+const size_t k_slowlog_max_args = 8;
+const size_t k_slowlog_arg_len = 64;
+
+// fixed-size record, so logging a slow command never allocates
+struct SlowlogEntry {
+    uint64_t id = 0;
+    uint64_t timestamp_us = 0;
+    uint64_t duration_us = 0;
+    uint64_t resp_size = 0;
+    uint32_t nargs = 0;
+    uint32_t arg_len[k_slowlog_max_args] = {};
+    char args[k_slowlog_max_args][k_slowlog_arg_len] = {};
+    char peer[k_peer_len] = {};
+};
+
+static struct {
+    SlowlogEntry ring[k_slowlog_size];
+    uint64_t next_id = 0;
+    size_t len = 0;
+    int64_t threshold_us = 10 * 1000;   // negative disables the slowlog
+} g_slowlog;
+
+static void slowlog_arg(SlowlogEntry &ent, uint32_t i, const void *data, uint32_t len) {
+    if (i < k_slowlog_max_args) {
+        ent.arg_len[i] = len;
+        memcpy(ent.args[i], data, len < k_slowlog_arg_len ? len : k_slowlog_arg_len);
+    }
+}
+
+// the parsed arguments are consumed by the commands, so copy from the raw request
+static void slowlog_push(Conn *conn, uint32_t proto, const uint8_t *request, size_t size,
+                         uint64_t duration_us, size_t resp_size) {
+    SlowlogEntry &ent = g_slowlog.ring[g_slowlog.next_id % k_slowlog_size];
+    ent.id = g_slowlog.next_id++;
+    ent.timestamp_us = clock_usec(CLOCK_REALTIME);
+    ent.duration_us = duration_us;
+    ent.resp_size = resp_size;
+    memcpy(ent.peer, conn->peer, sizeof(ent.peer));
+
+    const uint8_t *end = request + size;
+    ent.nargs = 0;
+    if (proto == 1) {
+        read_int(request, end, ent.nargs);
+        for (uint32_t i = 0; i < ent.nargs && i < k_slowlog_max_args; i++) {
+            uint32_t len = 0;
+            read_int(request, end, len);
+            slowlog_arg(ent, i, request, len);
+            request += len;
+        }
+    } else {
+        // the request has been validated by deserialize_v2()
+        uint32_t id = 0, nargs = 0;
+        read_int(request, end, id);
+        uint8_t op = *request++;
+        read_int(request, end, nargs);
+        if (op != OP_NAMED) {
+            const char *name = op < OP_MAX ? k_ops[op].name : "";
+            slowlog_arg(ent, ent.nargs++, name, (uint32_t)strlen(name));
+        }
+        ArgV2 arg;
+        for (uint32_t i = 0; i < nargs && read_arg_v2(request, end, arg); i++) {
+            if (arg.tag == TAG_STR) {
+                slowlog_arg(ent, ent.nargs++, arg.str, arg.len);
+            } else {
+                std::string num = num2str(arg.tag, arg.ival, arg.dval);
+                slowlog_arg(ent, ent.nargs++, num.data(), (uint32_t)num.size());
+            }
+        }
+    }
+    if (g_slowlog.len < k_slowlog_size) {
+        g_slowlog.len++;
+    }
+}
+
+static void out_slowlog_entry(Buffer &out, const SlowlogEntry &ent) {
+    out_arr(out, 6);
+    out_int(out, (int64_t)ent.id);
+    out_int(out, (int64_t)ent.timestamp_us);
+    out_int(out, (int64_t)ent.duration_us);
+
+    uint32_t nshow = ent.nargs;
+    if (nshow > k_slowlog_max_args) {
+        nshow = k_slowlog_max_args - 1;
+    }
+    out_arr(out, nshow + (nshow < ent.nargs ? 1 : 0));
+    for (uint32_t i = 0; i < nshow; i++) {
+        if (ent.arg_len[i] <= k_slowlog_arg_len) {
+            out_str(out, ent.args[i], ent.arg_len[i]);
+            continue;
+        }
+        std::string arg(ent.args[i], k_slowlog_arg_len);
+        arg += "... (" + std::to_string(ent.arg_len[i] - k_slowlog_arg_len) + " more bytes)";
+        out_str(out, arg.data(), arg.size());
+    }
+    if (nshow < ent.nargs) {
+        std::string more = "... (" + std::to_string(ent.nargs - nshow) + " more arguments)";
+        out_str(out, more.data(), more.size());
+    }
+    out_str(out, ent.peer, strlen(ent.peer));
+    out_int(out, (int64_t)ent.resp_size);
+}
+
+static void do_slowlog_get(std::vector<std::string> &commands, Buffer &out) {
+    int64_t n = 10;
+    if (commands.size() == 3 && !arg_int(commands, 2, n)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    if (n < 0 || (size_t)n > g_slowlog.len) {
+        n = (int64_t)g_slowlog.len;
+    }
+    out_arr(out, (uint32_t)n);
+    for (int64_t i = 1; i <= n; i++) {     // newest first
+        out_slowlog_entry(out, g_slowlog.ring[(g_slowlog.next_id - i) % k_slowlog_size]);
+    }
+}
+
+static void do_slowlog_len(std::vector<std::string> &, Buffer &out) {
+    return out_int(out, (int64_t)g_slowlog.len);
+}
+
+static void do_slowlog_reset(std::vector<std::string> &, Buffer &out) {
+    g_slowlog.len = 0;
+    return out_nil(out);
+}
+
+static void do_slowlog_threshold(std::vector<std::string> &commands, Buffer &out) {
+    if (commands.size() == 3) {
+        int64_t threshold_us = 0;
+        if (!arg_int(commands, 2, threshold_us)) {
+            return out_err(out, ERR_BAD_ARG, "expect int");
+        }
+        g_slowlog.threshold_us = threshold_us;
+    }
+    return out_int(out, g_slowlog.threshold_us);
+}
+
+// Pub/sub. Only v2 conns subscribe, as a pushed message is only told apart
+// from a reply by its request ID. A published message is framed once into a
+// refcounted PubMsg, and the output queue of every subscriber points to it
+// instead of holding a copy; writes gather the messages and the conn's own
+// replies in the order they were queued. A subscriber whose queued output
+// would go over `pubsub-output-limit` is disconnected.
+
+const uint32_t k_push_id = UINT32_MAX;  // the v2 request ID of pushed messages
+
+struct PubMsg {
+    uint32_t refs = 0;
+    Buffer data;
+};
+
+struct Channel {
+    HNode node;
+    std::string name;
+    std::vector<Conn *> subs;
+};
+
+static struct {
+    HMap channels;
+    std::vector<Conn *> pushed;     // given output outside of their own events
+    Conn *executing = NULL;         // the conn whose request is running
+    size_t reply_pos = 0;           // where its reply starts in `outgoing`
+    uint64_t messages = 0;
+    uint64_t deliveries = 0;
+    uint64_t disconnects = 0;
+    uint64_t fanout_ns = 0;         // spent queueing the deliveries
+} g_pubsub;
+
+static void response_begin(Buffer &out, size_t *header, uint32_t proto, uint32_t id);
+static void response_end(Buffer &out, size_t header, size_t value, size_t pending);
+
+static bool channel_eq(HNode *node, HNode *key) {
+    Channel *chan = container_of(node, Channel, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return chan->name == keydata->key;
+}
+
+static Channel *channel_lookup(const std::string &name, bool create) {
+    LookupKey key;
+    key.key = name;
+    key.node.hashcode = str_hash((uint8_t *)name.data(), name.size());
+    HNode *node = hm_lookup(&g_pubsub.channels, &key.node, &channel_eq);
+    if (node) {
+        return container_of(node, Channel, node);
+    }
+    if (!create) {
+        return NULL;
+    }
+    Channel *chan = new Channel();
+    chan->name = name;
+    chan->node.hashcode = key.node.hashcode;
+    hm_insert(&g_pubsub.channels, &chan->node);
+    return chan;
+}
+
+// drops conn->subs[i], both sides are swapped with their last element
+static void pubsub_remove(Conn *conn, size_t i) {
+    Subscription sub = conn->subs[i];
+    conn->subs[i] = conn->subs.back();
+    conn->subs.pop_back();
+    Channel *chan = sub.chan;
+    Conn *moved = chan->subs.back();
+    chan->subs[sub.pos] = moved;
+    chan->subs.pop_back();
+    for (size_t j = 0; moved != conn && j < moved->subs.size(); j++) {
+        if (moved->subs[j].chan == chan) {
+            moved->subs[j].pos = sub.pos;
+            break;
+        }
+    }
+    if (chan->subs.empty()) {
+        LookupKey key;
+        key.key = chan->name;
+        key.node.hashcode = chan->node.hashcode;
+        hm_delete(&g_pubsub.channels, &key.node, &channel_eq);
+        delete chan;
+    }
+}
+
+static void pubmsg_unref(PubMsg *msg) {
+    if (--msg->refs == 0) {
+        delete msg;
+    }
+}
+
+static PubMsg *pubmsg_new(const std::string &chan, const std::string &payload) {
+    PubMsg *msg = new PubMsg();
+    size_t header_pos = 0;
+    response_begin(msg->data, &header_pos, 2, k_push_id);
+    size_t value_pos = msg->data.size();
+    out_arr(msg->data, 3);
+    out_str(msg->data, "message", 7);
+    out_str(msg->data, chan.data(), chan.size());
+    out_str(msg->data, payload.data(), payload.size());
+    response_end(msg->data, header_pos, value_pos, 0);
+    return msg;
+}
+
+// the event loop writes to these conns, the running one is its own
+static void pubsub_list(Conn *conn) {
+    if (!conn->push_listed && conn != g_pubsub.executing) {
+        conn->push_listed = true;
+        g_pubsub.pushed.push_back(conn);
+    }
+}
+
+static bool pubsub_push(Conn *conn, PubMsg *msg) {
+    size_t queued = conn->outgoing.size() + conn->push_bytes + msg->data.size();
+    if (g_config.pubsub_output_limit > 0 && queued > (size_t)g_config.pubsub_output_limit) {
+        if (!conn->want_close) {
+            log_write(LL_WARN, "closing %s, its pub/sub output is over the limit", conn->peer);
+            g_pubsub.disconnects++;
+        }
+        conn->want_close = true;
+        pubsub_list(conn);
+        return false;
+    }
+    // after the replies queued so far: all of a streamed one, which is
+    // framed already, and not the one being generated
+    size_t before = conn == g_pubsub.executing ? g_pubsub.reply_pos
+        : conn->outgoing.size() + (conn->stream ? conn->stream->size : 0);
+    PushRef ref;
+    ref.msg = msg;
+    ref.mark = conn->out_popped + before;
+    conn->pushq.push_back(ref);
+    conn->push_bytes += msg->data.size();
+    msg->refs++;
+    if (!conn->want_write) {
+        pubsub_list(conn);  // otherwise it is waiting to be writable already
+    }
+    conn->want_write = true;
+    return true;
+}
+
+// removes the subscriptions and the queued messages of a closing conn
+static void pubsub_drop(Conn *conn) {
+    while (!conn->subs.empty()) {
+        pubsub_remove(conn, conn->subs.size() - 1);
+    }
+    for (PushRef &ref : conn->pushq) {
+        pubmsg_unref(ref.msg);
+    }
+    conn->pushq.clear();
+    if (conn->push_listed) {
+        std::vector<Conn *> &pushed = g_pubsub.pushed;
+        pushed.erase(std::find(pushed.begin(), pushed.end(), conn));
+    }
+}
+
+// hands the listed conns to the event loop, the writer's only
+static bool pubsub_take_pushed(std::vector<Conn *> &out) {
+    out.clear();
+    if (t_reader >= 0 || g_pubsub.pushed.empty()) {
+        return false;
+    }
+    out.swap(g_pubsub.pushed);
+    for (Conn *conn : out) {
+        conn->push_listed = false;
+    }
+    return true;
+}
+
+static void do_subscribe(Conn *conn, std::vector<std::string> &commands, Buffer &out) {
+    if (conn->proto != 2) {
+        return out_err(out, ERR_BAD_ARG, "subscribe needs `hello 2` first.");
+    }
+    for (size_t i = 1; i < commands.size(); i++) {
+        Channel *chan = channel_lookup(commands[i], true);
+        bool dup = false;
+        for (size_t j = 0; !dup && j < conn->subs.size(); j++) {
+            dup = conn->subs[j].chan == chan;
+        }
+        if (!dup) {
+            Subscription sub;
+            sub.chan = chan;
+            sub.pos = chan->subs.size();
+            chan->subs.push_back(conn);
+            conn->subs.push_back(sub);
+        }
+    }
+    return out_int(out, (int64_t)conn->subs.size());
+}
+
+// without channels from all of them
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &commands, Buffer &out) {
+    if (commands.size() == 1) {
+        while (!conn->subs.empty()) {
+            pubsub_remove(conn, conn->subs.size() - 1);
+        }
+    }
+    for (size_t i = 1; i < commands.size(); i++) {
+        for (size_t j = 0; j < conn->subs.size(); j++) {
+            if (conn->subs[j].chan->name == commands[i]) {
+                pubsub_remove(conn, j);
+                break;
+            }
+        }
+    }
+    return out_int(out, (int64_t)conn->subs.size());
+}
+
+// replies with the number of subscribers that got the message
+static void do_publish(std::vector<std::string> &commands, Buffer &out) {
+    Channel *chan = channel_lookup(commands[1], false);
+    if (!chan) {
+        return out_int(out, 0);
+    }
+    uint64_t start_ns = clock_nsec(CLOCK_MONOTONIC);
+    PubMsg *msg = pubmsg_new(commands[1], commands[2]);
+    size_t receivers = 0;
+    for (Conn *conn : chan->subs) {
+        receivers += pubsub_push(conn, msg) ? 1 : 0;
+    }
+    if (msg->refs == 0) {
+        delete msg;
+    }
+    g_pubsub.messages++;
+    g_pubsub.deliveries += receivers;
+    g_pubsub.fanout_ns += clock_nsec(CLOCK_MONOTONIC) - start_ns;
+    return out_int(out, (int64_t)receivers);
+}
+
+static void do_pubsub_stats(std::vector<std::string> &, Buffer &out) {
+    out_arr(out, 12);
+    out_stat(out, "channels", hm_size(&g_pubsub.channels));
+    out_stat(out, "messages", g_pubsub.messages);
+    out_stat(out, "deliveries", g_pubsub.deliveries);
+    out_stat(out, "disconnects", g_pubsub.disconnects);
+    out_stat(out, "fanout_ns", g_pubsub.fanout_ns);
+    out_stat(out, "fanout_ns_per_delivery",
+        g_pubsub.deliveries ? g_pubsub.fanout_ns / g_pubsub.deliveries : 0);
+}
+
+static void do_trace_stats(std::vector<std::string> &, Buffer &out) {
+    out_arr(out, PH_MAX * 10);
+    for (int phase = 0; phase < PH_MAX; phase++) {
+        TracePhaseStats st;
+        trace_phase_stats(phase, st);
+        std::string prefix = std::string(st.name) + ".";
+        out_stat(out, (prefix + "count").c_str(), st.count);
+        out_stat(out, (prefix + "total_ns").c_str(), st.total_ns);
+        out_stat(out, (prefix + "p50_ns").c_str(), st.p50_ns);
+        out_stat(out, (prefix + "p99_ns").c_str(), st.p99_ns);
+        out_stat(out, (prefix + "max_ns").c_str(), st.max_ns);
+    }
+}
+
+static void do_trace_reset(std::vector<std::string> &, Buffer &out) {
+    trace_reset();
+    return out_nil(out);
+}
+
+static void do_trace_sample(std::vector<std::string> &commands, Buffer &out) {
+    if (commands.size() == 3) {
+        int64_t sample = 0;
+        if (!arg_int(commands, 2, sample) || sample < 0 || sample > UINT32_MAX) {
+            return out_err(out, ERR_BAD_ARG, "expect int");
+        }
+        trace_set_sample((uint32_t)sample);
+    }
+    return out_int(out, trace_sample());
+}
+
+// `trace dump [ms]`, the Chrome trace JSON of the last `ms` milliseconds
+static void do_trace_dump(std::vector<std::string> &commands, Buffer &out) {
+    int64_t window_ms = 0;
+    if (commands.size() == 3 && (!arg_int(commands, 2, window_ms) || window_ms < 0)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    std::string json = trace_dump((uint64_t)window_ms);
+    return out_str(out, json.data(), json.size());
+}
+
+// Cluster mode, see cluster.hpp. Every node keeps the owner of every slot,
+// as an index into `nodes`, and turns away requests on keys that it does
+// not serve with an error naming the node to ask instead:
+//   MOVED <slot> <addr>    the slot belongs to `addr`
+//   ASK <slot> <addr>      the slot is migrating to `addr` and the key is
+//                          gone from here; only the next request sent
+//                          there after `asking` is served
+// Commands on keys in different slots fail with CROSSSLOT, and with
+// TRYAGAIN while only some of their keys have migrated, or while theirs are
+// on the way, see g_migrate. The map comes from
+// `cluster-map` and changes with `cluster setslot` and migrations. There is
+// no gossip: the nodes not taking part in a migration keep sending clients
+// to the old owner, which sends them on, until they are told. Readers look
+// at the map with atomics; an address never changes once in `nodes`.
+const uint16_t k_no_node = UINT16_MAX;
+const size_t k_cluster_max_nodes = 1024;
+
+static struct {
+    std::vector<std::string> nodes;         // "addr:port", [0] is this node
+    uint16_t owner[k_cluster_slots];        // node by slot, k_no_node if unassigned
+    uint16_t migrating[k_cluster_slots];    // the target of a slot moving away
+    uint16_t importing[k_cluster_slots];    // the source of a slot moving here
+    uint64_t moved = 0;     // redirects, also counted by readers
+    uint64_t asked = 0;
+    uint64_t crossslot = 0;
+} g_cluster;
+
+static bool parse_bind(const std::string &spec, int64_t port, struct sockaddr_in &addr);
+
+// "addr:port", IPv4 only
+static bool parse_node_addr(const std::string &spec, struct sockaddr_in &addr) {
+    return spec.find(':') != std::string::npos && parse_bind(spec, 0, addr);
+}
+
+// "slot" or "lo-hi"
+static bool parse_slots(const std::string &spec, uint32_t &lo, uint32_t &hi) {
+    size_t dash = spec.find('-');
+    std::string first = spec.substr(0, dash);
+    std::string last = dash == std::string::npos ? first : spec.substr(dash + 1);
+    int64_t a = 0, b = 0;
+    if (first.empty() || last.empty() || !str2int(first, a) || !str2int(last, b)
+        || a < 0 || a > b || b >= k_cluster_slots) {
+        return false;
+    }
+    lo = (uint32_t)a;
+    hi = (uint32_t)b;
+    return true;
+}
+
+// a `cluster-map` range, "lo-hi=addr:port"
+static bool parse_map_range(const std::string &spec, uint32_t &lo, uint32_t &hi, std::string &addr) {
+    size_t eq = spec.find('=');
+    if (eq == std::string::npos || !parse_slots(spec.substr(0, eq), lo, hi)) {
+        return false;
+    }
+    addr = spec.substr(eq + 1);
+    struct sockaddr_in sin;
+    return parse_node_addr(addr, sin);
+}
+
+static std::string slots_str(uint32_t lo, uint32_t hi) {
+    return std::to_string(lo) + "-" + std::to_string(hi);
+}
+
+// the index of a node, added if new; k_no_node once there are too many
+static uint16_t cluster_node(const std::string &addr) {
+    std::vector<std::string> &nodes = g_cluster.nodes;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i] == addr) {
+            return (uint16_t)i;
+        }
+    }
+    if (nodes.size() == k_cluster_max_nodes) {
+        return k_no_node;
+    }
+    nodes.push_back(addr);  // reserved, so the ones readers use stay put
+    return (uint16_t)(nodes.size() - 1);
+}
+
+static uint16_t slot_get(const uint16_t *map, uint32_t slot) {
+    return __atomic_load_n(&map[slot], __ATOMIC_ACQUIRE);
+}
+
+static void slot_set(uint16_t *map, uint32_t slot, uint16_t node) {
+    __atomic_store_n(&map[slot], node, __ATOMIC_RELEASE);
+}
+
+// from the config, before the listeners
+static bool cluster_init() {
+    if (g_config.cluster_announce.empty()) {
+        if (g_config.port == 0) {
+            return false;
+        }
+        g_config.cluster_announce = "127.0.0.1:" + std::to_string(g_config.port);
+    }
+    g_cluster.nodes.reserve(k_cluster_max_nodes);
+    cluster_node(g_config.cluster_announce);
+    for (uint32_t slot = 0; slot < k_cluster_slots; slot++) {
+        g_cluster.owner[slot] = g_config.cluster_map.empty() ? 0 : k_no_node;
+        g_cluster.migrating[slot] = k_no_node;
+        g_cluster.importing[slot] = k_no_node;
+    }
+    for (const std::string &spec : g_config.cluster_map) {
+        uint32_t lo = 0, hi = 0;
+        std::string addr;
+        parse_map_range(spec, lo, hi, addr);    // checked by config_set()
+        uint16_t node = cluster_node(addr);
+        if (node == k_no_node) {
+            return false;
+        }
+        for (uint32_t slot = lo; slot <= hi; slot++) {
+            g_cluster.owner[slot] = node;
+        }
+    }
+    return true;
+}
+
+// commands whose key is the 2nd argument
+static bool cmd_has_key(const std::string &name) {
+    return name == "get" || name == "set" || name == "del" || name == "incr"
+        || name == "decr" || name == "incrby" || name == "decrby" || name == "incrbyfloat"
+        || name == "sadd" || name == "srem" || name == "sscore" || name == "squery"
+        || name == "srevquery" || name == "zrank" || name == "zrevrank" || name == "zcount"
+        || name == "zpopmin" || name == "zpopmax" || name == "zunionstore" || name == "zinterstore";
+}
+
+// the keys of a command are its arguments [first, end) except `skip`
+struct CmdKeys {
+    size_t first = 0;
+    size_t end = 0;
+    size_t skip = 0;
+};
+
+static bool cmd_keys(const std::vector<std::string> &commands, CmdKeys &keys) {
+    if (commands.size() < 2) {
+        return false;
+    }
+    const std::string &name = commands[0];
+    if (name == "memory") {
+        keys.first = 2;
+        keys.end = commands.size() == 3 && commands[1] == "usage" ? 3 : 0;
+        return keys.end > 0;
+    }
+    if (!cmd_has_key(name)) {
+        return false;
+    }
+    keys.first = 1;
+    keys.end = 2;
+    int64_t n = 0;
+    // the destination, numkeys, then the sources
+    if ((name == "zunionstore" || name == "zinterstore") && commands.size() >= 3
+        && arg_int(commands, 2, n) && n > 0 && (uint64_t)n <= commands.size() - 3) {
+        keys.end = 3 + (size_t)n;
+        keys.skip = 2;
+    }
+    return true;
+}
+
+static void out_redirect(Buffer &out, uint32_t code, const char *kind, uint32_t slot, uint16_t node) {
+    std::string msg = kind;
+    msg += " " + std::to_string(slot) + " " + g_cluster.nodes[node];
+    out_err(out, code, msg);
+}
+
+// Replies with a redirect or an error, and returns true, for a command on
+// keys that this node does not serve. `exists(key)` tells whether a key is
+// here, for slots migrating away; `asking` lets one into an importing slot.
+template <class Exists>
+static bool cluster_redirect(std::vector<std::string> &commands, bool asking, Buffer &out,
+                             Exists exists) {
+    CmdKeys keys;
+    if (!cmd_keys(commands, keys)) {
+        return false;
+    }
+    const std::string &first = commands[keys.first];
+    uint32_t slot = key_slot(first.data(), first.size());
+    for (size_t i = keys.first + 1; i < keys.end; i++) {
+        if (i != keys.skip && key_slot(commands[i].data(), commands[i].size()) != slot) {
+            __atomic_fetch_add(&g_cluster.crossslot, 1, __ATOMIC_RELAXED);
+            out_err(out, ERR_CROSSSLOT, "keys in different slots");
+            return true;
+        }
+    }
+    uint16_t owner = slot_get(g_cluster.owner, slot);
+    if (owner == k_no_node) {
+        out_err(out, ERR_CLUSTERDOWN, "slot " + std::to_string(slot) + " is not served");
+        return true;
+    }
+    if (owner != 0) {
+        if (asking && slot_get(g_cluster.importing, slot) != k_no_node) {
+            return false;
+        }
+        __atomic_fetch_add(&g_cluster.moved, 1, __ATOMIC_RELAXED);
+        out_redirect(out, ERR_MOVED, "MOVED", slot, owner);
+        return true;
+    }
+    uint16_t target = slot_get(g_cluster.migrating, slot);
+    if (target == k_no_node) {
+        return false;
+    }
+    size_t n = 0, found = 0;
+    for (size_t i = keys.first; i < keys.end; i++) {
+        if (i != keys.skip) {
+            n++;
+            found += exists(commands[i]) ? 1 : 0;
+        }
+    }
+    if (found == n) {
+        return false;
+    }
+    if (found > 0) {
+        out_err(out, ERR_TRYAGAIN, "some keys are being migrated, try again");
+        return true;
+    }
+    __atomic_fetch_add(&g_cluster.asked, 1, __ATOMIC_RELAXED);
+    out_redirect(out, ERR_ASK, "ASK", slot, target);
+    return true;
+}
+
+// an entry as a `cluster restore` payload: the type, then the string, or
+// for a sorted set (f64 score, u32 length, name) per member in order
+static void entry_dump(Entry *ent, std::string &out) {
+    out.push_back((char)ent->type);
+    if (ent->type == T_STR) {
+        std::string buf;
+        out += ent->enc == ENC_INT ? std::to_string(ent->ival) : entry_raw_str(ent, buf);
+        return;
+    }
+    for (SSNode *node = sset_first(&ent->sset); node; node = ssnode_next(node)) {
+        uint32_t len = (uint32_t)node->len;
+        out.append((const char *)&node->score, 8);
+        out.append((const char *)&len, 4);
+        out.append(node->name, node->len);
+    }
+}
+
+// the entry of an entry_dump() payload, without its key; NULL if malformed.
+// An empty sorted set, which older nodes kept, is taken as no key by restore.
+static Entry *entry_load(std::string &payload) {
+    uint32_t type = payload.empty() ? 0 : (uint8_t)payload[0];
+    if (type == T_STR) {
+        Entry *ent = entry_new(T_STR);
+        std::string val = payload.substr(1);
+        entry_set_str(ent, val);
+        return ent;
+    }
+    if (type != T_SSET) {
+        return NULL;
+    }
+    Entry *ent = entry_new(T_SSET);
+    std::vector<SSNode *> nodes;
+    bool ok = true;
+    for (size_t pos = 1; ok && pos < payload.size(); ) {
+        double score = 0;
+        uint32_t len = 0;
+        ok = payload.size() - pos >= 12;
+        if (ok) {
+            memcpy(&score, &payload[pos], 8);
+            memcpy(&len, &payload[pos + 8], 4);
+            pos += 12;
+            ok = payload.size() - pos >= len && !isnan(score)
+                && !sset_lookup(&ent->sset, &payload[pos], len);
+        }
+        if (ok) {
+            nodes.push_back(sset_build_add(&ent->sset, &payload[pos], len, score));
+            pos += len;
+        }
+    }
+    if (!ok) {
+        sset_build_abort(&ent->sset, nodes.data(), nodes.size());
+        entry_del(ent);
+        return NULL;
+    }
+    if (!std::is_sorted(nodes.begin(), nodes.end(), &ssnode_less)) {
+        std::sort(nodes.begin(), nodes.end(), &ssnode_less);
+    }
+    sset_build_link(&ent->sset, nodes.data(), nodes.size());
+    return ent;
+}
+
+const uint64_t k_migrate_timeout_us = 1000 * 1000;  // for the target to make progress
+const size_t k_migrate_batch_bytes = 1 << 20;
+const uint64_t k_migrate_retry_us = 1000 * 1000;
+
+// A slot migration. Maintenance passes over the keyspace a few hashtable
+// slots per step, collecting the keys of the migrating slots into batches.
+// A batch goes to the target as pipelined `cluster restore` requests on a
+// non-blocking connection that the event loop drives like a client's, and
+// its keys are deleted here once all of them are acknowledged; then the
+// next batch follows. Until then, commands on those keys get TRYAGAIN, so
+// that what was sent stays what is here. The first pass that finds no key,
+// with the table unchanged under it, hands the slots over: the target is
+// told, then the map here changes. Meanwhile the keys still here are served
+// here and the others redirected with ASK, so that no key is ever served by
+// both nodes. The slots only start migrating once the target has taken
+// `cluster importing`, and the migration is dropped if that first attempt
+// fails. Later failures are retried after a pause; keys sent twice replace
+// themselves.
+static struct {
+    bool active = false;
+    bool started = false;       // the target took the slots once
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    uint16_t target = k_no_node;
+    int fd = -1;                // to the target
+    uint32_t conn_id = 0;       // tells the event loops a new `fd`
+    bool connecting = false;    // connect() in progress
+    bool ready = false;         // the target took `cluster importing` on `fd`
+    Buffer outgoing;
+    Buffer incoming;
+    uint32_t awaiting = 0;      // replies to the requests sent, see migrate_acked()
+    uint64_t deadline_us = 0;   // for the next of them
+    size_t scan = 0;            // the next hashtable slot of the pass
+    HNode **pass_slots = NULL;  // the table the pass started on
+    bool pass_clean = true;     // nothing found, skipped or resized so far
+    std::set<std::string> sending;  // the keys of the batch being acknowledged
+    bool finishing = false;     // the batch ends with handing over the slots
+    uint64_t not_before_us = 0;
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t batches = 0;
+    uint64_t passes = 0;
+    uint64_t errors = 0;
+    uint64_t done = 0;
+} g_migrate;
+
+// a v1 request, for the ones this node sends to others
+static void request_append(Buffer &buf, const std::vector<std::string> &args) {
+    size_t len = 4;
+    for (const std::string &s : args) {
+        len += 4 + s.size();
+    }
+    buf_push_back_u32(buf, (uint32_t)len);
+    buf_push_back_u32(buf, (uint32_t)args.size());
+    for (const std::string &s : args) {
+        buf_push_back_u32(buf, (uint32_t)s.size());
+        buf_push_back(buf, (const uint8_t *)s.data(), s.size());
+    }
+}
+
+// queues requests that end with `n` replies
+static void migrate_queue(const Buffer &requests, uint32_t n) {
+    buf_push_back(g_migrate.outgoing, requests.data(), requests.size());
+    if (g_migrate.awaiting == 0) {
+        g_migrate.deadline_us = clock_usec(CLOCK_MONOTONIC) + k_migrate_timeout_us;
+    }
+    g_migrate.awaiting += n;
+}
+
+static void migrate_close() {
+    if (g_migrate.fd >= 0) {
+        shutdown(g_migrate.fd, SHUT_RDWR);  // also ends an io_uring poll on it
+        close(g_migrate.fd);
+        g_migrate.fd = -1;
+    }
+    g_migrate.connecting = false;
+    g_migrate.ready = false;
+    g_migrate.outgoing.clear();
+    g_migrate.incoming.clear();
+    g_migrate.awaiting = 0;
+    g_migrate.sending.clear();
+    g_migrate.finishing = false;
+}
+
+// the pause starts after the timeouts, not when the step started
+static void migrate_fail() {
+    migrate_close();
+    g_migrate.errors++;
+    g_migrate.not_before_us = clock_usec(CLOCK_MONOTONIC) + k_migrate_retry_us;
+    if (!g_migrate.started) {
+        log_write(LL_WARN, "dropped the migration of slots %u-%u to %s", g_migrate.lo,
+            g_migrate.hi, g_cluster.nodes[g_migrate.target].c_str());
+        g_migrate.active = false;
+    }
+}
+
+// starts connecting, with `cluster importing` queued for the target
+static void migrate_open() {
+    const char *target = g_cluster.nodes[g_migrate.target].c_str();
+    struct sockaddr_in addr;
+    parse_node_addr(g_cluster.nodes[g_migrate.target], addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_write(LL_WARN, "[errno:%d] migration: socket()", errno);
+        return migrate_fail();
+    }
+    listen_set_nb(fd);
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    if (rv < 0 && errno != EINPROGRESS) {
+        log_write(LL_WARN, "[errno:%d] migration: cannot connect to %s", errno, target);
+        close(fd);
+        return migrate_fail();
+    }
+    g_migrate.fd = fd;
+    g_migrate.conn_id++;
+    g_migrate.connecting = rv < 0;
+    Buffer req;
+    request_append(req, {"cluster", "importing", slots_str(g_migrate.lo, g_migrate.hi),
+        g_cluster.nodes[0]});
+    migrate_queue(req, 1);
+}
+
+// while waiting for the target it is woken by its replies instead
+static bool migrate_pending() {
+    return g_migrate.active && g_migrate.ready && g_migrate.awaiting == 0;
+}
+
+// a pending job may still replace its destination, which is not sent meanwhile
+static bool migrate_job_dest(const std::string &key) {
+    for (Conn *conn : g_jobs) {
+        if (!conn->job->done && conn->job->dest == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// collects the next batch, or finds the pass done; false if there is no
+// migration to work on now
+static bool migrate_step(uint64_t now_us) {
+    if (!migrate_pending() || now_us < g_migrate.not_before_us) {
+        return false;
+    }
+    HMap *map = &data_store.db.map;
+    if (g_migrate.scan == 0) {
+        g_migrate.pass_slots = map->bigger.slots;
+        g_migrate.pass_clean = true;
+    }
+    std::vector<Entry *> batch;
+    size_t bytes = 0;
+    auto collect = [&batch, &bytes](Entry *ent) {
+        uint32_t slot = key_slot(ent->key.data(), ent->key.size());
+        if (slot < g_migrate.lo || slot > g_migrate.hi) {
+            return;
+        }
+        if (ent->pins > 0 || migrate_job_dest(ent->key)) {
+            g_migrate.pass_clean = false;   // a stream or a job uses it, next pass
+            return;
+        }
+        batch.push_back(ent);
+        bytes += ent->mem;
+    };
+    for (size_t i = 0; i < k_maint_work; i++) {
+        g_migrate.scan = data_store.db.scan(g_migrate.scan, collect);
+        if (g_migrate.scan == 0 || batch.size() >= (size_t)g_config.cluster_migrate_batch
+            || bytes >= k_migrate_batch_bytes) {
+            break;
+        }
+    }
+    // a resize can make the pass miss keys
+    if (map->bigger.slots != g_migrate.pass_slots || map->smaller.slots) {
+        g_migrate.pass_clean = false;
+    }
+    Buffer requests;
+    for (Entry *ent : batch) {
+        std::vector<std::string> args = {"cluster", "restore", ent->key, ""};
+        entry_dump(ent, args[3]);
+        g_migrate.bytes += args[3].size();
+        request_append(requests, args);
+        g_migrate.sending.insert(ent->key);
+        g_migrate.pass_clean = false;
+    }
+    if (g_migrate.scan == 0) {
+        g_migrate.passes++;
+        for (Conn *conn : g_jobs) {
+            // a job may still create its destination here
+            const std::string &dest = conn->job->dest;
+            uint32_t slot = key_slot(dest.data(), dest.size());
+            if (!conn->job->done && slot >= g_migrate.lo && slot <= g_migrate.hi) {
+                g_migrate.pass_clean = false;
+            }
+        }
+        if (g_migrate.pass_clean) {
+            g_migrate.finishing = true;
+            request_append(requests, {"cluster", "setslot",
+                slots_str(g_migrate.lo, g_migrate.hi), g_cluster.nodes[g_migrate.target]});
+        }
+    }
+    if (!requests.empty()) {
+        migrate_queue(requests, (uint32_t)(batch.size() + g_migrate.finishing));
+    }
+    return true;
+}
+
+// a command on a key of the batch in flight, see g_migrate
+static bool migrate_holds(const std::vector<std::string> &commands) {
+    CmdKeys keys;
+    if (g_migrate.sending.empty() || !cmd_keys(commands, keys)) {
+        return false;
+    }
+    for (size_t i = keys.first; i < keys.end; i++) {
+        if (i != keys.skip && g_migrate.sending.count(commands[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// writes what the socket takes
+static void migrate_flush() {
+    while (!g_migrate.outgoing.empty()) {
+        ssize_t rv = send(g_migrate.fd, g_migrate.outgoing.data(), g_migrate.outgoing.size(),
+            MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv < 0) {
+            log_write(LL_WARN, "[errno:%d] migration: cannot send to %s", errno,
+                g_cluster.nodes[g_migrate.target].c_str());
+            return migrate_fail();
+        }
+        buf_pop_front(g_migrate.outgoing, (size_t)rv);
+    }
+}
+
+// all the requests sent so far are acknowledged
+static void migrate_acked() {
+    if (!g_migrate.ready) {
+        g_migrate.ready = true;
+        if (!g_migrate.started) {
+            g_migrate.started = true;
+            for (uint32_t slot = g_migrate.lo; slot <= g_migrate.hi; slot++) {
+                slot_set(g_cluster.migrating, slot, g_migrate.target);
+            }
+        }
+        return;
+    }
+    seq_write_begin();
+    for (const std::string &key : g_migrate.sending) {
+        // unless evicted meanwhile; commands on it were held off
+        if (Entry *ent = data_store.db.remove(key)) {
+            entry_del(ent);
+        }
+    }
+    for (uint32_t slot = g_migrate.lo; g_migrate.finishing && slot <= g_migrate.hi; slot++) {
+        slot_set(g_cluster.owner, slot, g_migrate.target);
+        slot_set(g_cluster.migrating, slot, k_no_node);
+    }
+    seq_write_end();
+    g_migrate.keys += g_migrate.sending.size();
+    g_migrate.batches += g_migrate.sending.empty() ? 0 : 1;
+    g_migrate.sending.clear();
+    if (g_migrate.finishing) {
+        log_write(LL_INFO, "migrated slots %u-%u to %s", g_migrate.lo, g_migrate.hi,
+            g_cluster.nodes[g_migrate.target].c_str());
+        migrate_close();
+        g_migrate.active = false;
+        g_migrate.done++;
+    }
+}
+
+// takes the replies in, false if the connection failed
+static bool migrate_recv() {
+    const char *target = g_cluster.nodes[g_migrate.target].c_str();
+    uint8_t buf[64 * 1024];
+    while (true) {
+        ssize_t rv = read(g_migrate.fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            log_write(LL_WARN, "[errno:%d] migration: %s closed the connection",
+                rv < 0 ? errno : 0, target);
+            return false;
+        }
+        buf_push_back(g_migrate.incoming, buf, (size_t)rv);
+        g_migrate.deadline_us = clock_usec(CLOCK_MONOTONIC) + k_migrate_timeout_us;
+    }
+    Buffer &in = g_migrate.incoming;
+    size_t pos = 0;
+    while (in.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &in[pos], 4);
+        if (len == 0 || len > k_max_message || g_migrate.awaiting == 0) {
+            log_write(LL_WARN, "migration: bad reply from %s", target);
+            return false;
+        }
+        if (in.size() - pos - 4 < len) {
+            break;
+        }
+        const uint8_t *reply = &in[pos + 4];
+        if (reply[0] != TAG_NIL) {
+            size_t skip = reply[0] == TAG_ERR && len >= 9 ? 9 : len;
+            log_write(LL_WARN, "migration: refused by %s: %.*s", target,
+                (int)(len - skip), (const char *)&reply[skip]);
+            return false;
+        }
+        pos += 4 + len;
+        if (--g_migrate.awaiting == 0) {
+            migrate_acked();
+            if (g_migrate.fd < 0) {
+                return true;    // done
+            }
+        }
+    }
+    buf_pop_front(in, pos);
+    return true;
+}
+
+// the next batch right away rather than at the next maintenance round
+static void migrate_continue() {
+    uint64_t start_us = clock_usec(CLOCK_MONOTONIC);
+    uint64_t now_us = start_us;
+    bool more = true;
+    while (more && now_us - start_us < (uint64_t)g_config.maint_budget_us) {
+        seq_write_begin();
+        more = migrate_step(now_us);
+        seq_write_end();
+        now_us = clock_usec(CLOCK_MONOTONIC);
+    }
+}
+
+// For the event loops: the migration socket, if any, with the poll events
+// it waits for. `id` changes with the connection.
+static int migrate_poll_fd(uint32_t &events, uint32_t &id) {
+    if (t_reader >= 0 || g_migrate.fd < 0) {
+        return -1;
+    }
+    events = POLLIN;
+    if (g_migrate.connecting || !g_migrate.outgoing.empty()) {
+        events |= POLLOUT;
+    }
+    id = g_migrate.conn_id;
+    return g_migrate.fd;
+}
+
+// the event loops report the poll events of the connection `id`
+static void migrate_io(uint32_t id, uint32_t revents) {
+    if (g_migrate.fd < 0 || id != g_migrate.conn_id) {
+        return;     // closed meanwhile
+    }
+    if (g_migrate.connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(g_migrate.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            log_write(LL_WARN, "[errno:%d] migration: cannot connect to %s", err,
+                g_cluster.nodes[g_migrate.target].c_str());
+            return migrate_fail();
+        }
+        if (!(revents & POLLOUT)) {
+            return;
+        }
+        g_migrate.connecting = false;
+    }
+    if ((revents & (POLLIN | POLLERR | POLLHUP)) && !migrate_recv()) {
+        return migrate_fail();
+    }
+    if (migrate_pending()) {
+        migrate_continue();
+    }
+    migrate_send();
+}
+
+// the I/O that needs no event: connecting, the first write of what was
+// queued and timeouts; outside of the write section
+static void migrate_send() {
+    if (!g_migrate.active) {
+        return;
+    }
+    uint64_t now_us = clock_usec(CLOCK_MONOTONIC);
+    if (g_migrate.fd < 0) {
+        if (now_us >= g_migrate.not_before_us) {
+            migrate_open();
+        }
+        return;
+    }
+    if (g_migrate.awaiting > 0 && now_us >= g_migrate.deadline_us) {
+        log_write(LL_WARN, "migration: no reply from %s",
+            g_cluster.nodes[g_migrate.target].c_str());
+        return migrate_fail();
+    }
+    if (!g_migrate.connecting) {
+        migrate_flush();
+    }
+}
+
+static bool cluster_disabled(Buffer &out) {
+    if (!g_config.cluster) {
+        out_err(out, ERR_UNKNOWN, "cluster mode is off.");
+        return true;
+    }
+    return false;
+}
+
+// `asking`, the next request may use a slot that is importing here
+static void do_asking(Conn *conn, std::vector<std::string> &, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    conn->asking = true;
+    return out_nil(out);
+}
+
+static void do_cluster_keyslot(std::vector<std::string> &commands, Buffer &out) {
+    return out_int(out, key_slot(commands[2].data(), commands[2].size()));
+}
+
+// [lo, hi, addr] for each run of slots with the same owner
+static void do_cluster_slots(std::vector<std::string> &, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    const uint16_t *owner = g_cluster.owner;
+    uint32_t nranges = 0;
+    for (uint32_t slot = 0; slot < k_cluster_slots; slot++) {
+        nranges += owner[slot] != k_no_node && (slot == 0 || owner[slot - 1] != owner[slot]);
+    }
+    out_arr(out, nranges);
+    for (uint32_t lo = 0; lo < k_cluster_slots; ) {
+        uint32_t hi = lo;
+        while (hi + 1 < k_cluster_slots && owner[hi + 1] == owner[lo]) {
+            hi++;
+        }
+        if (owner[lo] != k_no_node) {
+            const std::string &addr = g_cluster.nodes[owner[lo]];
+            out_arr(out, 3);
+            out_int(out, lo);
+            out_int(out, hi);
+            out_str(out, addr.data(), addr.size());
+        }
+        lo = hi + 1;
+    }
+}
+
+static void do_cluster_info(std::vector<std::string> &, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    size_t owned = 0, migrating = 0, importing = 0;
+    for (uint32_t slot = 0; slot < k_cluster_slots; slot++) {
+        owned += g_cluster.owner[slot] == 0;
+        migrating += g_cluster.migrating[slot] != k_no_node;
+        importing += g_cluster.importing[slot] != k_no_node;
+    }
+    out_arr(out, 28);
+    out_stat(out, "slots.owned", owned);
+    out_stat(out, "slots.migrating", migrating);
+    out_stat(out, "slots.importing", importing);
+    out_stat(out, "nodes", g_cluster.nodes.size());
+    out_stat(out, "redirects.moved", __atomic_load_n(&g_cluster.moved, __ATOMIC_RELAXED));
+    out_stat(out, "redirects.ask", __atomic_load_n(&g_cluster.asked, __ATOMIC_RELAXED));
+    out_stat(out, "redirects.crossslot", __atomic_load_n(&g_cluster.crossslot, __ATOMIC_RELAXED));
+    out_stat(out, "migrate.keys", g_migrate.keys);
+    out_stat(out, "migrate.bytes", g_migrate.bytes);
+    out_stat(out, "migrate.batches", g_migrate.batches);
+    out_stat(out, "migrate.passes", g_migrate.passes);
+    out_stat(out, "migrate.errors", g_migrate.errors);
+    out_stat(out, "migrate.done", g_migrate.done);
+    out_stat(out, "migrate.connected", g_migrate.ready);
+}
+
+// `cluster setslot lo-hi addr`, e.g. to tell the other nodes of a migration;
+// setting this node ends an import
+static void do_cluster_setslot(std::vector<std::string> &commands, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    uint32_t lo = 0, hi = 0;
+    struct sockaddr_in addr;
+    if (!parse_slots(commands[2], lo, hi)) {
+        return out_err(out, ERR_BAD_ARG, "expect slot or lo-hi");
+    }
+    if (!parse_node_addr(commands[3], addr)) {
+        return out_err(out, ERR_BAD_ARG, "expect addr:port");
+    }
+    for (uint32_t slot = lo; slot <= hi; slot++) {
+        if (g_cluster.migrating[slot] != k_no_node) {
+            return out_err(out, ERR_BAD_ARG, "slot " + std::to_string(slot) + " is migrating");
+        }
+    }
+    uint16_t node = cluster_node(commands[3]);
+    if (node == k_no_node) {
+        return out_err(out, ERR_BAD_ARG, "too many nodes");
+    }
+    seq_write_begin();     // readers see both maps change at once
+    for (uint32_t slot = lo; slot <= hi; slot++) {
+        slot_set(g_cluster.owner, slot, node);
+        slot_set(g_cluster.importing, slot, k_no_node);
+    }
+    seq_write_end();
+    return out_nil(out);
+}
+
+// `cluster importing lo-hi addr`, from the source of a migration: the slots
+// take `cluster restore` and requests after `asking`. The ones already
+// owned are left alone, for a migration resuming after a failure.
+static void do_cluster_importing(std::vector<std::string> &commands, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    uint32_t lo = 0, hi = 0;
+    struct sockaddr_in addr;
+    if (!parse_slots(commands[2], lo, hi)) {
+        return out_err(out, ERR_BAD_ARG, "expect slot or lo-hi");
+    }
+    if (!parse_node_addr(commands[3], addr)) {
+        return out_err(out, ERR_BAD_ARG, "expect addr:port");
+    }
+    uint16_t node = cluster_node(commands[3]);
+    if (node == k_no_node || node == 0) {
+        return out_err(out, ERR_BAD_ARG, "bad source node");
+    }
+    for (uint32_t slot = lo; slot <= hi; slot++) {
+        if (g_cluster.owner[slot] != 0) {
+            slot_set(g_cluster.importing, slot, node);
+        }
+    }
+    return out_nil(out);
+}
+
+// `cluster migrate lo-hi addr`, starts moving slots to another node, see
+// g_migrate; `cluster info` tells when it is done
+static void do_cluster_migrate(std::vector<std::string> &commands, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    uint32_t lo = 0, hi = 0;
+    struct sockaddr_in addr;
+    if (!parse_slots(commands[2], lo, hi)) {
+        return out_err(out, ERR_BAD_ARG, "expect slot or lo-hi");
+    }
+    if (!parse_node_addr(commands[3], addr)) {
+        return out_err(out, ERR_BAD_ARG, "expect addr:port");
+    }
+    if (g_migrate.active) {
+        return out_err(out, ERR_BAD_ARG, "a migration is in progress");
+    }
+    if (g_config.maint_budget_us == 0) {
+        return out_err(out, ERR_BAD_ARG, "migrations run as maintenance, see maint-budget-us");
+    }
+    for (uint32_t slot = lo; slot <= hi; slot++) {
+        if (g_cluster.owner[slot] != 0) {
+            return out_err(out, ERR_BAD_ARG, "slot " + std::to_string(slot) + " is not served here");
+        }
+    }
+    uint16_t node = cluster_node(commands[3]);
+    if (node == k_no_node || node == 0) {
+        return out_err(out, ERR_BAD_ARG, "bad target node");
+    }
+    g_migrate.lo = lo;
+    g_migrate.hi = hi;
+    g_migrate.target = node;
+    g_migrate.active = true;
+    g_migrate.started = false;
+    g_migrate.scan = 0;
+    g_migrate.not_before_us = 0;
+    log_write(LL_INFO, "migrating slots %u-%u to %s", lo, hi, commands[3].c_str());
+    return out_nil(out);
+}
+
+static void jobs_before_command(const std::string &key);
+
+// `cluster restore key payload`, a key sent by a migration, see entry_dump()
+static void do_cluster_restore(std::vector<std::string> &commands, Buffer &out) {
+    if (cluster_disabled(out)) {
+        return;
+    }
+    std::string &key = commands[2];
+    uint32_t slot = key_slot(key.data(), key.size());
+    if (g_cluster.owner[slot] != 0 && g_cluster.importing[slot] == k_no_node) {
+        return out_err(out, ERR_BAD_ARG, "slot " + std::to_string(slot) + " is not importing");
+    }
+    if (!evict_before_write()) {
+        return out_err(out, ERR_OOM, "memory is over maxmemory.");
+    }
+    Entry *ent = entry_load(commands[3]);
+    if (!ent) {
+        return out_err(out, ERR_BAD_ARG, "bad payload");
+    }
+    if (!g_jobs.empty()) {
+        jobs_before_command(key);
+    }
+    uint64_t hcode = EntryTraits::hash(key);
+    if (Entry *old = data_store.db.lookup(key, hcode)) {
+        entry_before_write(old);
+    }
+    if (Entry *old = data_store.db.remove(key, hcode)) {
+        entry_del(old);
+    }
+    if (ent->type == T_SSET && sset_size(&ent->sset) == 0) {
+        entry_del(ent);
+        return out_nil(out);
+    }
+    ent->key.swap(key);
+    ent->node.hashcode = hcode;
+    entry_mem_sync(ent);
+    data_store.db.insert(ent);
+    if (ent->type == T_SSET) {
+        maint_watch_sset(ent, false);
+    }
+    return out_nil(out);
+}
+
+// Reader threads: the ro_* commands never modify the keyspace and may see
+// it mid-write, so they check `seq` before following what they read and
+// cmd_execute_ro() throws away the reply and retries if the writer moved.
+
+static Entry *entry_lookup_ro(const std::string &s, uint64_t seq) {
+    Entry *ent = data_store.db.lookup_ro(s, EntryTraits::hash(s), seq);
+    if (!ent) {
+        return NULL;
+    }
+    entry_touch(ent);   // still allocated within the epoch, even if deleted
+    return ent;
+}
+
+static void ro_get(std::vector<std::string> &commands, Buffer &out, uint64_t seq) {
+    Entry *ent = entry_lookup_ro(commands[1], seq);
+    if (!ent) {
+        return out_nil(out);
+    }
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    }
+    if (ent->enc == ENC_INT) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%lld", (long long)ent->ival);
+        return out_str(out, buf, (size_t)n);
+    }
+    uint32_t enc = ent->enc;
+    const char *data = ent->str.data();
+    size_t size = ent->str.size();
+    size_t raw_len = (size_t)ent->ival;
+    if (seq_read_retry(seq)) {
+        return;     // `data` and `size` may not match
+    }
+    if (enc == ENC_LZ) {
+        if (!out_lz(out, data, size, raw_len)) {
+            return out_err(out, ERR_UNKNOWN, "corrupt compressed value");
+        }
+        return;
+    }
+    return out_str(out, data, size);
+}
+
+static void ro_sscore(std::vector<std::string> &commands, Buffer &out, uint64_t seq) {
+    Entry *ent = entry_lookup_ro(commands[1], seq);
+    if (ent && ent->type != T_SSET) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+    const std::string &name = commands[2];
+    SSNode *ssnode = ent ? sset_lookup_ro(&ent->sset, name.data(), name.size(), seq) : NULL;
+    return ssnode ? out_dbl(out, ssnode->score) : out_nil(out);
+}
+
+// no streaming, replies are generated in one go up to k_max_message
+static void ro_squery(std::vector<std::string> &commands, Buffer &out, uint64_t seq) {
+    double score = 0;
+    if (!arg_dbl(commands, 2, score)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    const std::string &name = commands[3];
+    int64_t offset = 0, limit = 0;
+    if (!arg_int(commands, 4, offset) || !arg_int(commands, 5, limit)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    Entry *ent = entry_lookup_ro(commands[1], seq);
+    if (ent && ent->type != T_SSET) {
+        return out_err(out, ERR_BAD_TYP, "expect sset");
+    }
+    if (!ent || limit <= 0) {
+        return out_arr(out, 0);
+    }
+
+    SSNode *ssnode = sset_seekge_ro(&ent->sset, score, name.data(), name.size(), seq);
+    ssnode = ssnode_offset_ro(ssnode, offset, seq);
+    size_t header = out.size();
+    out_arr(out, 0);
+    uint32_t n = 0;
+    for (; ssnode && (int64_t)n < limit; ssnode = ssnode_next_ro(ssnode, seq)) {
+        if (seq_read_retry(seq)) {
+            return;
+        }
+        if (out.size() - header > k_max_message) {
+            out.resize(header);
+            return out_err(out, ERR_TOO_BIG, "response is too big.");
+        }
+        out_str(out, ssnode->name, ssnode->len);
+        out_dbl(out, ssnode->score);
+        n += 2;
+    }
+    memcpy(&out[header + 1], &n, 4);
+}
+
+static void cmd_execute_ro(std::vector<std::string> &commands, Buffer &out) {
+    size_t start = out.size();
+    epoch_enter((uint32_t)t_reader);
+    while (true) {
+        uint64_t seq = seq_read_begin();
+        auto exists = [seq](const std::string &key) {
+            return data_store.db.lookup_ro(key, EntryTraits::hash(key), seq) != NULL;
+        };
+        if (g_config.cluster && cluster_redirect(commands, false, out, exists)) {}
+        else if (commands.size() == 2 && commands[0] == "get") ro_get(commands, out, seq);
+        else if (commands.size() == 3 && commands[0] == "sscore") ro_sscore(commands, out, seq);
+        else if (commands.size() == 6 && commands[0] == "squery") ro_squery(commands, out, seq);
+        else out_err(out, ERR_UNKNOWN, "not served on the read port.");
+        if (!seq_read_retry(seq)) {
+            break;
+        }
+        out.resize(start);
+    }
+    epoch_exit((uint32_t)t_reader);
+}
+
+// A pending job completes before any later command on its destination or
+// one of its sources runs, so that the command sees the result instead of
+// holding an entry that the job is about to replace. All of the command's
+// keys count, see cmd_keys(), and `keys` waits for every job.
+static void jobs_before_command(const std::string &key) {
+    for (Conn *conn : g_jobs) {
+        SetOpJob *job = conn->job;
+        bool hit = !job->done && job->dest == key;
+        for (size_t i = 0; !hit && i < job->srcs.size(); i++) {
+            hit = job->srcs[i] && job->srcs[i]->key == key;
+        }
+        if (hit) {
+            setop_complete(job);
+        }
+    }
+}
+
+static void cmd_execute(Conn *conn, std::vector<std::string> &commands) {
+    Buffer &out = conn->outgoing;
+    if (g_config.cluster) {
+        bool asking = conn->asking;
+        conn->asking = false;
+        auto exists = [](const std::string &key) { return data_store.db.lookup(key) != NULL; };
+        if (cluster_redirect(commands, asking, out, exists)) {
+            return;
+        }
+        if (migrate_holds(commands)) {
+            return out_err(out, ERR_TRYAGAIN, "the key is being migrated, try again");
+        }
+    }
+    CmdKeys keys;
+    if (!g_jobs.empty() && cmd_keys(commands, keys)) {
+        for (size_t i = keys.first; i < keys.end; i++) {
+            if (i != keys.skip) {
+                jobs_before_command(commands[i]);
+            }
+        }
+    } else if (!g_jobs.empty() && commands.size() == 1 && commands[0] == "keys") {
+        for (Conn *job_conn : g_jobs) {
+            setop_complete(job_conn->job);
+        }
+    }
+    if (!commands.empty() && cmd_is_write(commands[0]) && !evict_before_write()) {
+        return out_err(out, ERR_OOM, "memory is over maxmemory.");
+    }
+    if (commands.size() == 2 && commands[0] == "get") return do_get(commands, out);
+    else if (commands.size() == 3 && commands[0] == "set") return do_set(commands, out);
+    else if (commands.size() == 2 && commands[0] == "del") return do_del(commands, out);
+    else if (commands.size() == 1 && commands[0] == "keys") return do_keys(commands, out);
+    else if (commands.size() == 2 && commands[0] == "incr") return do_incr(commands, out);
+    else if (commands.size() == 2 && commands[0] == "decr") return do_decr(commands, out);
+    else if (commands.size() == 3 && commands[0] == "incrby") return do_incrby(commands, out);
+    else if (commands.size() == 3 && commands[0] == "decrby") return do_decrby(commands, out);
+    else if (commands.size() == 3 && commands[0] == "incrbyfloat") return do_incrbyfloat(commands, out);
+    else if (commands.size() == 4 && commands[0] == "sadd") return do_sadd(commands, out);
+    else if (commands.size() == 3 && commands[0] == "srem") return do_srem(commands, out);
+    else if (commands.size() == 3 && commands[0] == "sscore") return do_sscore(commands, out);
+    else if (commands.size() == 6 && commands[0] == "squery") return do_squery(conn, commands, out);
+    else if (commands.size() == 6 && commands[0] == "srevquery") return do_srevquery(conn, commands, out);
+    else if (commands.size() == 3 && (commands[0] == "zrank" || commands[0] == "zrevrank")) return do_zrank(commands, out);
+    else if (commands.size() == 4 && commands[0] == "zcount") return do_zcount(commands, out);
+    else if ((commands.size() == 2 || commands.size() == 3) && (commands[0] == "zpopmin" || commands[0] == "zpopmax")) return do_zpop(commands, out);
+    else if (commands.size() >= 4 && (commands[0] == "zunionstore" || commands[0] == "zinterstore")) return do_zsetop(conn, commands, out);
+    else if (commands.size() == 3 && commands[0] == "memory" && commands[1] == "usage") return do_memory_usage(commands, out);
+    else if (commands.size() == 2 && commands[0] == "memory" && commands[1] == "stats") return do_memory_stats(commands, out);
+    else if (commands.size() == 2 && commands[0] == "maint" && commands[1] == "stats") return do_maint_stats(commands, out);
+    else if ((commands.size() == 2 || commands.size() == 3) && commands[0] == "slowlog" && commands[1] == "get") return do_slowlog_get(commands, out);
+    else if (commands.size() == 2 && commands[0] == "slowlog" && commands[1] == "len") return do_slowlog_len(commands, out);
+    else if (commands.size() == 2 && commands[0] == "slowlog" && commands[1] == "reset") return do_slowlog_reset(commands, out);
+    else if ((commands.size() == 2 || commands.size() == 3) && commands[0] == "slowlog" && commands[1] == "threshold") return do_slowlog_threshold(commands, out);
+    else if (commands.size() >= 2 && commands[0] == "subscribe") return do_subscribe(conn, commands, out);
+    else if (commands.size() >= 1 && commands[0] == "unsubscribe") return do_unsubscribe(conn, commands, out);
+    else if (commands.size() == 3 && commands[0] == "publish") return do_publish(commands, out);
+    else if (commands.size() == 2 && commands[0] == "pubsub" && commands[1] == "stats") return do_pubsub_stats(commands, out);
+    else if (commands.size() == 2 && commands[0] == "trace" && commands[1] == "stats") return do_trace_stats(commands, out);
+    else if (commands.size() == 2 && commands[0] == "trace" && commands[1] == "reset") return do_trace_reset(commands, out);
+    else if ((commands.size() == 2 || commands.size() == 3) && commands[0] == "trace" && commands[1] == "sample") return do_trace_sample(commands, out);
+    else if ((commands.size() == 2 || commands.size() == 3) && commands[0] == "trace" && commands[1] == "dump") return do_trace_dump(commands, out);
+    else if (commands.size() == 1 && commands[0] == "asking") return do_asking(conn, commands, out);
+    else if (commands.size() == 3 && commands[0] == "cluster" && commands[1] == "keyslot") return do_cluster_keyslot(commands, out);
+    else if (commands.size() == 2 && commands[0] == "cluster" && commands[1] == "slots") return do_cluster_slots(commands, out);
+    else if (commands.size() == 2 && commands[0] == "cluster" && commands[1] == "info") return do_cluster_info(commands, out);
+    else if (commands.size() == 4 && commands[0] == "cluster" && commands[1] == "setslot") return do_cluster_setslot(commands, out);
+    else if (commands.size() == 4 && commands[0] == "cluster" && commands[1] == "importing") return do_cluster_importing(commands, out);
+    else if (commands.size() == 4 && commands[0] == "cluster" && commands[1] == "migrate") return do_cluster_migrate(commands, out);
+    else if (commands.size() == 4 && commands[0] == "cluster" && commands[1] == "restore") return do_cluster_restore(commands, out);
+    else return out_err(out, ERR_UNKNOWN, "unknown command.");
+}
+
+// `hello [version]` switches the framing of the requests after it, on any port
+static void do_hello(Conn *conn, std::vector<std::string> &commands, Buffer &out) {
+    if (commands.size() == 2) {
+        int64_t proto = 0;
+        if (!arg_int(commands, 1, proto) || proto < 1 || proto > 2) {
+            return out_err(out, ERR_BAD_ARG, "unsupported protocol version");
+        }
+        if (proto != 2 && !conn->subs.empty()) {
+            return out_err(out, ERR_BAD_ARG, "unsubscribe first.");
+        }
+        conn->proto = (uint32_t)proto;
+    }
+    return out_int(out, conn->proto);
+}
+
+// v2 replies carry the request ID after the length
+static void response_begin(Buffer &out, size_t *header, uint32_t proto, uint32_t id) {
+    *header = out.size();
+    buf_push_back_u32(out, 0);
+    if (proto == 2) {
+        buf_push_back_u32(out, id);
+    }
+}
+
+static size_t response_size(Buffer &out, size_t header) {
+    return out.size() - header - 4;
+}
+
+// `pending` is the part of a streamed reply that is generated later
+static void response_end(Buffer &out, size_t header, size_t value, size_t pending) {
+    size_t message_size = response_size(out, header) + pending;
+    if (message_size > k_max_message) {
+        assert(pending == 0);
+        out.resize(value);
+        out_err(out, ERR_TOO_BIG, "response is too big.");
+        message_size = response_size(out, header);
+    }
+    uint32_t len = (uint32_t)message_size;
+    memcpy(&out[header], &len, 4);
+}
+
+static bool handle_single_request(Conn *conn) {
     if (conn->incoming.size() < 4) return false;
     uint32_t len = 0;
     memcpy(&len, conn->incoming.data(), 4);
@@ -450,83 +3800,395 @@ static bool handle_single_request(Conn *conn) {
         conn->want_close = true;
         return false;
     }
-    if (4 + len > conn->incoming.size()) return false;
-    const uint8_t *request = &conn->incoming[4];
-    std::vector<std::string> commands;
-    if (deserialize(request, len, commands) < 0) {
-        message("bad request");
-        conn->want_close = true;
-        return false;
+    if (4 + len > conn->incoming.size()) return false;
+    bool traced = trace_sampled();
+    uint64_t t_parse = traced ? trace_now() : 0;
+    const uint8_t *request = &conn->incoming[4];
+    std::vector<std::string> commands;
+    uint32_t proto = conn->proto, id = 0;
+    t_args.typed = 0;
+    int32_t err = proto == 2
+        ? deserialize_v2(request, len, commands, id)
+        : deserialize(request, len, commands);
+    if (err < 0) {
+        message("bad request");
+        conn->want_close = true;
+        return false;
+    }
+    TRACE_PROBE2(request__start, conn->id, commands.empty() ? "" : commands[0].c_str());
+    std::string name;   // commands may take the arguments apart
+    if (traced && !commands.empty()) {
+        name = commands[0];
+    }
+    uint64_t t_frame = traced ? trace_now() : 0;
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos, proto, id);
+    size_t value_pos = conn->outgoing.size();
+    uint64_t t_exec = traced ? trace_now() : 0;
+    uint64_t start_us = clock_usec(CLOCK_MONOTONIC);
+    t_now_ms = start_us / 1000;
+    if (!commands.empty() && commands[0] == "hello" && commands.size() <= 2) {
+        do_hello(conn, commands, conn->outgoing);
+    } else if (t_reader >= 0) {
+        cmd_execute_ro(commands, conn->outgoing);
+    } else {
+        // the steps readers could misread are write sections of their own
+        g_pubsub.executing = conn;
+        g_pubsub.reply_pos = header_pos;
+        cmd_execute(conn, commands);
+        g_pubsub.executing = NULL;
+        epoch_reclaim();
+    }
+    uint64_t t_reply = traced ? trace_now() : 0;
+    size_t pending = conn->stream ? conn->stream->size : 0;
+    if (conn->job) {
+        // the reply is framed when the job is delivered
+        conn->outgoing.resize(header_pos);
+        value_pos = header_pos;
+        conn->job->proto = proto;
+        conn->job->id = id;
+    } else {
+        response_end(conn->outgoing, header_pos, value_pos, pending);
+    }
+    if (conn->captured) {
+        // the reply without its request ID, so that replays can compare it
+        capture_record(conn->id, proto, request, len, conn->outgoing.data() + value_pos,
+            conn->outgoing.size() - value_pos, pending == 0 && !conn->job);
+    }
+    uint64_t duration_us = clock_usec(CLOCK_MONOTONIC) - start_us;
+    // the slowlog belongs to the writer thread
+    if (t_reader < 0 && g_slowlog.threshold_us >= 0
+        && duration_us >= (uint64_t)g_slowlog.threshold_us) {
+        slowlog_push(conn, proto, request, len, duration_us,
+            conn->outgoing.size() - value_pos + pending);
+    }
+    TRACE_PROBE2(request__done, conn->id, conn->outgoing.size() - value_pos + pending);
+    uint64_t t_pop = traced ? trace_now() : 0;
+    buf_pop_front(conn->incoming, 4 + len);
+    if (traced) {
+        uint64_t t_end = trace_now();
+        trace_record(PH_PARSE, t_parse, t_frame, &name);
+        trace_record(PH_FRAME, t_frame, t_exec, &name);
+        trace_record(PH_EXEC, t_exec, t_reply, &name);
+        trace_record(PH_REPLY, t_reply, t_pop, &name);
+        trace_record(PH_POP, t_pop, t_end, &name);
+        trace_record(PH_REQUEST, t_parse, t_end, &name);
+    }
+    return true;
+}
+
+// the 2nd argument of a raw request, if it is a string
+static bool request_key(const uint8_t *req, const uint8_t *req_end, uint32_t proto,
+                        const uint8_t *&key, uint32_t &key_len) {
+    if (proto == 2) {
+        uint32_t id = 0, nargs = 0;
+        ArgV2 arg;
+        if (!read_int(req, req_end, id) || req == req_end) return false;
+        uint8_t op = *req++;
+        if (!read_int(req, req_end, nargs) || nargs < (op == OP_NAMED ? 2u : 1u)) return false;
+        if (op == OP_NAMED && !read_arg_v2(req, req_end, arg)) return false;
+        if (!read_arg_v2(req, req_end, arg) || arg.tag != TAG_STR) return false;
+        key = arg.str;
+        key_len = arg.len;
+        return true;
+    }
+    uint32_t nstr = 0, cmd_len = 0;
+    if (!read_int(req, req_end, nstr) || nstr < 2
+        || !read_int(req, req_end, cmd_len) || cmd_len > (size_t)(req_end - req)) {
+        return false;
+    }
+    req += cmd_len;
+    if (!read_int(req, req_end, key_len) || key_len > (size_t)(req_end - req)) return false;
+    key = req;
+    return true;
+}
+
+// Hash the keys (the 2nd argument) of the next pipelined requests and
+// prefetch their hashtable chains together, instead of each command
+// stalling on its own cache misses. Returns the number of complete
+// requests looked at.
+static size_t prefetch_requests(Conn *conn) {
+    uint64_t hcodes[k_max_prefetch];
+    size_t nkeys = 0, nreqs = 0;
+    const uint8_t *cur = conn->incoming.data();
+    const uint8_t *end = cur + conn->incoming.size();
+    uint32_t len = 0;
+    while (nreqs < k_max_prefetch && read_int(cur, end, len) && len <= (size_t)(end - cur)) {
+        const uint8_t *req = cur;
+        cur += len;
+        nreqs++;
+        const uint8_t *key = NULL;
+        uint32_t key_len = 0;
+        if (request_key(req, cur, conn->proto, key, key_len)) {
+            hcodes[nkeys++] = str_hash(key, key_len);
+        }
+    }
+    if (nkeys > 1) {    // otherwise there is nothing to overlap
+        data_store.db.prefetch(hcodes, nkeys);
+    }
+    return nreqs;
+}
+
+// the state transitions below are shared by all I/O backends
+
+// Reading goes on while replies are pending, so that pipelined requests keep
+// being served and their replies leave in fewer, larger writes. Input only
+// pauses once enough of it waits behind a reply, a stream or a job.
+static void conn_update_interest(Conn *conn) {
+    bool pending = conn->outgoing.size() > 0 || !conn->pushq.empty();
+    bool blocked = pending || conn->stream || conn->job;
+    conn->want_write = pending;
+    conn->want_read = !conn->read_eof && !(blocked && conn->incoming.size() >= k_max_outgoing);
+    if (conn->read_eof && !blocked) {
+        conn->want_close = true;
+    }
+}
+
+static void handle_requests(Conn *conn) {
+    // pipelined requests past the output limit, a streamed reply or a job wait in `incoming`
+    size_t prefetched = 0;
+    while (!conn->stream && !conn->job && conn->outgoing.size() < k_max_outgoing) {
+        // reader threads must not touch the table outside of a validated read
+        if (prefetched == 0 && t_reader < 0) {
+            prefetched = prefetch_requests(conn);
+        }
+        if (!handle_single_request(conn)) {
+            break;
+        }
+        prefetched -= prefetched > 0 ? 1 : 0;
+    }
+    conn_update_interest(conn);
+}
+
+static void job_remove(Conn *conn) {
+    for (Conn *&other : g_jobs) {
+        if (other == conn) {
+            other = g_jobs.back();
+            g_jobs.pop_back();
+            break;
+        }
+    }
+    setop_free(conn->job);
+    conn->job = NULL;
+}
+
+// queues the reply of a finished job; with io_uring not while a send
+// still references `outgoing`
+static bool job_deliver(Conn *conn) {
+    if (!conn->job->done || conn->send_inflight) {
+        return false;
+    }
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos, conn->job->proto, conn->job->id);
+    size_t value_pos = conn->outgoing.size();
+    buf_push_back(conn->outgoing, conn->job->reply.data(), conn->job->reply.size());
+    response_end(conn->outgoing, header_pos, value_pos, 0);
+    job_remove(conn);
+    conn_update_interest(conn);
+    return true;
+}
+
+const size_t k_max_iovs = 64;
+
+// The output to write next: `outgoing` cut at the marks of the queued
+// messages, and the messages. It stops at a message that goes after the
+// part of a streamed reply not generated yet.
+static size_t conn_out_iov(Conn *conn, struct iovec *iov, size_t max) {
+    size_t n = 0, pos = 0;
+    for (size_t i = 0; i <= conn->pushq.size() && n < max; i++) {
+        bool push = i < conn->pushq.size();
+        uint64_t mark = push ? conn->pushq[i].mark - conn->out_popped : UINT64_MAX;
+        size_t end = mark < conn->outgoing.size() ? (size_t)mark : conn->outgoing.size();
+        if (end > pos) {
+            iov[n].iov_base = &conn->outgoing[pos];
+            iov[n].iov_len = end - pos;
+            n++;
+            pos = end;
+        }
+        if (!push || mark > pos || n == max) {
+            break;
+        }
+        PubMsg *msg = conn->pushq[i].msg;
+        size_t off = i == 0 ? conn->push_off : 0;
+        iov[n].iov_base = msg->data.data() + off;
+        iov[n].iov_len = msg->data.size() - off;
+        n++;
+    }
+    return n;
+}
+
+// drops `n` written bytes, in the order of conn_out_iov()
+static void conn_out_consume(Conn *conn, size_t n) {
+    size_t popped = 0;
+    while (n > 0) {
+        uint64_t pos = conn->out_popped + popped;
+        if (!conn->pushq.empty() && conn->pushq.front().mark == pos) {
+            PushRef &ref = conn->pushq.front();
+            size_t left = ref.msg->data.size() - conn->push_off;
+            if (n < left) {
+                conn->push_off += n;
+                break;
+            }
+            n -= left;
+            conn->push_off = 0;
+            conn->push_bytes -= ref.msg->data.size();
+            pubmsg_unref(ref.msg);
+            conn->pushq.pop_front();
+            continue;
+        }
+        size_t end = conn->outgoing.size();
+        if (!conn->pushq.empty() && conn->pushq.front().mark - conn->out_popped < end) {
+            end = (size_t)(conn->pushq.front().mark - conn->out_popped);
+        }
+        size_t take = std::min(n, end - popped);
+        assert(take > 0);
+        popped += take;
+        n -= take;
+    }
+    buf_pop_front(conn->outgoing, popped);
+    conn->out_popped += popped;
+}
+
+static void handle_written(Conn *conn, size_t n) {
+    bool traced = trace_sampled();
+    uint64_t start = traced ? trace_now() : 0;
+    conn_out_consume(conn, n);
+    if (traced) {
+        trace_record(PH_POP, start, trace_now(), NULL);
     }
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    cmd_execute(commands, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
-    buf_pop_front(conn->incoming, 4 + len);
-    return true;
+    if (conn->outgoing.size() == 0 && conn->stream) {
+        stream_step(conn);
+    }
+    if (conn->outgoing.size() == 0 && conn->job) {
+        job_deliver(conn);
+    }
+    handle_requests(conn);  // the input that waited behind the output
+}
+
+// Runs a step of every job and delivers the finished ones, whose conns
+// are added to `ready` for the event loop to pick up their new interest.
+static void jobs_run(std::vector<Conn *> &ready) {
+    if (t_reader >= 0 || g_jobs.empty()) {
+        return;
+    }
+    t_now_ms = clock_usec(CLOCK_MONOTONIC) / 1000;
+    for (size_t i = 0; i < g_jobs.size(); i++) {
+        SetOpJob *job = g_jobs[i]->job;
+        if (!job->done && setop_step(job, k_setop_chunk)) {
+            setop_complete(job);
+        }
+    }
+    epoch_reclaim();
+    for (size_t i = 0; i < g_jobs.size(); ) {
+        Conn *conn = g_jobs[i];
+        if (job_deliver(conn)) {    // removes g_jobs[i]
+            ready.push_back(conn);
+        } else {
+            i++;
+        }
+    }
+}
+
+static void handle_eof(Conn *conn) {
+    if (conn->incoming.size() == 0) message("client closed");
+    else message("unexpected EOF");
+    conn->read_eof = true;
+    conn_update_interest(conn);
 }
 
 static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    struct iovec iov[k_max_iovs];
+    size_t n = conn_out_iov(conn, iov, k_max_iovs);
+    assert(n > 0);
+    bool traced = trace_sampled();
+    uint64_t start = traced ? trace_now() : 0;
+    ssize_t rv = writev(conn->fd, iov, (int)n);
+    if (traced) {
+        trace_record(PH_WRITE, start, trace_now(), NULL);
+    }
+    TRACE_PROBE2(write, conn->fd, rv);
     if (rv < 0 && errno == EAGAIN) return;
     if (rv < 0) {
         message_errno("write() error");
         conn->want_close = true;
         return;
     }
-    buf_pop_front(conn->outgoing, (size_t)rv);
-    if (conn->outgoing.size() == 0) {
-        conn->want_read = true;
-        conn->want_write = false;
-    }
+    handle_written(conn, (size_t)rv);
 }
 
+// Reads until the socket is drained or the replies reach k_max_outgoing,
+// so that the one write at the end of the round answers everything that
+// arrived, including what came in while the earlier requests ran.
 static void handle_read(Conn *conn) {
     uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
-    if (rv < 0 && errno == EAGAIN) return;
-    if (rv < 0) {
-        message_errno("read() error");
-        conn->want_close = true;
-        return;
-    }
-    if (rv == 0) {
-        if (conn->incoming.size() == 0) message("client closed");
-        else message("unexpected EOF");
-        conn->want_close = true;
-        return;
+    while (conn->want_read && conn->outgoing.size() < k_max_outgoing) {
+        bool traced = trace_sampled();
+        uint64_t start = traced ? trace_now() : 0;
+        ssize_t rv = read(conn->fd, buf, sizeof(buf));
+        if (traced) {
+            trace_record(PH_READ, start, trace_now(), NULL);
+        }
+        TRACE_PROBE2(read, conn->fd, rv);
+        if (rv < 0 && errno == EAGAIN) return;
+        if (rv < 0) {
+            message_errno("read() error");
+            conn->want_close = true;
+            return;
+        }
+        if (rv == 0) {
+            return handle_eof(conn);
+        }
+        buf_push_back(conn->incoming, buf, (size_t)rv);
+        handle_requests(conn);  // the replies go out at the end of the round
     }
-    buf_push_back(conn->incoming, buf, (size_t)rv);
-    while (handle_single_request(conn)) {}
-    if (conn->outgoing.size() > 0) {
-        conn->want_read = false;
-        conn->want_write = true;
-        return handle_write(conn);
+}
+
+static void conn_put(std::vector<Conn *> &fd2conn, Conn *conn) {
+    if (fd2conn.size() <= (size_t)conn->fd) {
+        fd2conn.resize(conn->fd + 1);
     }
+    assert(!fd2conn[conn->fd]);
+    fd2conn[conn->fd] = conn;
 }
 
-int main() {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) die("socket()");
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv) die("bind()");
-    listen_set_nb(fd);
-    rv = listen(fd, SOMAXCONN);
-    if (rv) die("listen()");
+static void conn_destroy(std::vector<Conn *> &fd2conn, Conn *conn) {
+    if (conn->stream) {
+        stream_free(conn);
+    }
+    if (conn->job) {
+        job_remove(conn);
+    }
+    pubsub_drop(conn);
+    (void)close(conn->fd);
+    fd2conn[conn->fd] = NULL;
+    delete conn;
+}
 
+static void run_poll(const std::vector<int> &listeners) {
     std::vector<Conn *> fd2connMap;
     std::vector<struct pollfd> checklist;
+    std::vector<Conn *> ready;
+    std::vector<Conn *> flush;
+    std::vector<Conn *> pushed;
     while (true) {
+        ready.clear();
+        jobs_run(ready);    // the interest is recomputed below
+        // subscribers that got messages from other conns' requests
+        while (pubsub_take_pushed(pushed)) {
+            for (Conn *conn : pushed) {
+                if (conn->want_write && !conn->want_close) {
+                    handle_write(conn);
+                }
+                if (conn->want_close) {
+                    conn_destroy(fd2connMap, conn);
+                }
+            }
+        }
         checklist.clear();
-        struct pollfd tempollfd = {fd, POLLIN, 0};
-        checklist.push_back(tempollfd);
+        for (int fd : listeners) {
+            struct pollfd tempollfd = {fd, POLLIN, 0};
+            checklist.push_back(tempollfd);
+        }
         for (Conn *conn : fd2connMap) {
             if (!conn) continue;
             struct pollfd tempollfd = {conn->fd, POLLERR, 0};
@@ -534,38 +4196,771 @@ int main() {
             if (conn->want_write) tempollfd.events |= POLLOUT;
             checklist.push_back(tempollfd);
         }
-        int rv = poll(checklist.data(), (nfds_t)checklist.size(), -1);
+        size_t nconns_end = checklist.size();
+        uint32_t mig_events = 0, mig_id = 0;
+        int mig_fd = migrate_poll_fd(mig_events, mig_id);
+        if (mig_fd >= 0) {
+            struct pollfd tempollfd = {mig_fd, (short)mig_events, 0};
+            checklist.push_back(tempollfd);
+        }
+        int rv = poll(checklist.data(), (nfds_t)checklist.size(), maint_timeout_ms());
         if (rv < 0 && errno == EINTR) continue;
         if (rv < 0) die("poll");
+        maint_run(rv == 0);
+        if (mig_fd >= 0 && checklist.back().revents) {
+            migrate_io(mig_id, checklist.back().revents);
+        }
 
-        if (checklist[0].revents) {
-            if (Conn *conn = handle_new_conn(fd)) {
-                if (fd2connMap.size() <= (size_t)conn->fd) {
-                    fd2connMap.resize(conn->fd + 1);
-                }
-                assert(!fd2connMap[conn->fd]);
-                fd2connMap[conn->fd] = conn;
+        for (size_t i = 0; i < listeners.size(); ++i) {
+            if (!checklist[i].revents) continue;
+            if (Conn *conn = handle_new_conn(listeners[i])) {
+                conn_put(fd2connMap, conn);
             }
         }
 
-        for (size_t i = 1; i < checklist.size(); ++i) {
+        flush.clear();
+        for (size_t i = listeners.size(); i < nconns_end; ++i) {
             uint32_t doable = checklist[i].revents;
             if (doable == 0) continue;
             Conn *conn = fd2connMap[checklist[i].fd];
+            bool was_writing = conn->want_write;
             if (doable & POLLIN) {
                 assert(conn->want_read);
                 handle_read(conn);
             }
-            if (doable & POLLOUT) {
-                assert(conn->want_write);
-                handle_write(conn);
-            }
             if ((doable & POLLERR) || conn->want_close) {
-                (void)close(conn->fd);
-                fd2connMap[conn->fd] = NULL;
-                delete conn;
+                conn_destroy(fd2connMap, conn);
+                continue;
+            }
+            // a socket that was full is only retried once it is writable
+            if (conn->want_write && (!was_writing || (doable & POLLOUT))) {
+                flush.push_back(conn);
+            }
+        }
+        // one write per connection and round, whatever produced its replies
+        for (Conn *conn : flush) {
+            handle_write(conn);
+            if (conn->want_close) {
+                conn_destroy(fd2connMap, conn);
+            }
+        }
+    }
+}
+
+const int k_epoll_max_events = 256;
+
+static uint32_t epoll_interest(Conn *conn) {
+    uint32_t events = 0;
+    if (conn->want_read) events |= EPOLLIN;
+    if (conn->want_write) events |= EPOLLOUT;
+    return events;
+}
+
+static void epoll_sync(int epfd, std::vector<uint32_t> &interest, Conn *conn) {
+    uint32_t want = epoll_interest(conn);
+    if (want != interest[conn->fd]) {
+        struct epoll_event ev = {};
+        ev.events = interest[conn->fd] = want;
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev)) die("epoll_ctl()");
+    }
+}
+
+static bool is_listener(const std::vector<int> &listeners, int fd) {
+    for (int lfd : listeners) {
+        if (lfd == fd) return true;
+    }
+    return false;
+}
+
+// the migration socket, see migrate_poll_fd(); closing the previous one
+// took it out of the set
+static void epoll_sync_migrate(int epfd, int &fd, uint32_t &id, uint32_t &events) {
+    uint32_t want = 0, want_id = 0;
+    int want_fd = migrate_poll_fd(want, want_id);
+    if (want_fd < 0) {
+        fd = -1;
+        return;
+    }
+    bool same = want_fd == fd && want_id == id;
+    if (same && want == events) {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = want;   // POLLIN and POLLOUT are EPOLLIN and EPOLLOUT
+    ev.data.fd = want_fd;
+    if (epoll_ctl(epfd, same ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, want_fd, &ev)) die("epoll_ctl()");
+    fd = want_fd;
+    id = want_id;
+    events = want;
+}
+
+static void run_epoll(const std::vector<int> &listeners) {
+    int epfd = epoll_create1(0);
+    if (epfd < 0) die("epoll_create1()");
+    struct epoll_event ev = {};
+    for (int fd : listeners) {
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) die("epoll_ctl()");
+    }
+
+    std::vector<Conn *> fd2connMap;
+    std::vector<uint32_t> interest;     // events registered per fd
+    struct epoll_event events[k_epoll_max_events];
+    std::vector<Conn *> ready;
+    std::vector<Conn *> touched;
+    std::vector<Conn *> flush;
+    std::vector<Conn *> pushed;
+    int mig_fd = -1;
+    uint32_t mig_id = 0, mig_events = 0;
+    while (true) {
+        ready.clear();
+        jobs_run(ready);
+        for (Conn *conn : ready) {
+            ev.events = interest[conn->fd] = epoll_interest(conn);
+            ev.data.fd = conn->fd;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev)) die("epoll_ctl()");
+        }
+        while (pubsub_take_pushed(pushed)) {
+            for (Conn *conn : pushed) {
+                if (conn->want_write && !conn->want_close) {
+                    handle_write(conn);
+                }
+                if (conn->want_close) {
+                    conn_destroy(fd2connMap, conn);
+                } else {
+                    epoll_sync(epfd, interest, conn);
+                }
+            }
+        }
+        epoll_sync_migrate(epfd, mig_fd, mig_id, mig_events);
+        int rv = epoll_wait(epfd, events, k_epoll_max_events, maint_timeout_ms());
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) die("epoll_wait");
+        maint_run(rv == 0);
+
+        touched.clear();
+        flush.clear();
+        for (int i = 0; i < rv; ++i) {
+            uint32_t doable = events[i].events;
+            if (mig_fd >= 0 && events[i].data.fd == mig_fd) {
+                migrate_io(mig_id, doable);
+                continue;
+            }
+            if (is_listener(listeners, events[i].data.fd)) {
+                Conn *conn = handle_new_conn(events[i].data.fd);
+                if (!conn) continue;
+                conn_put(fd2connMap, conn);
+                if (interest.size() < fd2connMap.size()) {
+                    interest.resize(fd2connMap.size());
+                }
+                ev.events = interest[conn->fd] = epoll_interest(conn);
+                ev.data.fd = conn->fd;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev)) die("epoll_ctl()");
+                continue;
+            }
+
+            Conn *conn = fd2connMap[events[i].data.fd];
+            bool was_writing = conn->want_write;
+            if ((doable & EPOLLIN) && conn->want_read) {
+                handle_read(conn);
+            }
+            if ((doable & (EPOLLERR | EPOLLHUP)) || conn->want_close) {
+                conn_destroy(fd2connMap, conn);    // close() also deregisters it
+                continue;
+            }
+            touched.push_back(conn);
+            // a socket that was full is only retried once it is writable
+            if (conn->want_write && (!was_writing || (doable & EPOLLOUT))) {
+                flush.push_back(conn);
+            }
+        }
+        // one write per connection and round, see run_poll()
+        for (Conn *conn : flush) {
+            handle_write(conn);
+        }
+        for (Conn *conn : touched) {
+            if (conn->want_close) {
+                conn_destroy(fd2connMap, conn);
+                continue;
+            }
+            epoll_sync(epfd, interest, conn);
+        }
+    }
+}
+
+enum {
+    OP_ACCEPT   = 1,
+    OP_RECV     = 2,
+    OP_SEND     = 3,
+    OP_CANCEL   = 4,
+    OP_POLL     = 5,
+};
+
+const uint32_t k_uring_entries = 1024;
+const uint32_t k_uring_nbufs = 1024;
+const uint32_t k_uring_buf_size = 16 * 1024;
+const uint16_t k_uring_bgid = 0;
+
+static uint64_t uring_data(int fd, uint8_t op) {
+    return ((uint64_t)fd << 8) | op;
+}
+
+// one-shot, for the migration socket, see migrate_poll_fd()
+static void uring_arm_poll(URing *ring, int fd, uint32_t events) {
+    io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) die("io_uring sq full");
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = uring_data(fd, OP_POLL);
+}
+
+static void uring_arm_accept(URing *ring, int fd) {
+    io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) die("io_uring sq full");
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_data(fd, OP_ACCEPT);
+}
+
+// one multishot recv per connection, data lands in the provided buffer ring
+static void uring_arm_recv(URing *ring, Conn *conn) {
+    io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        conn->want_close = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = k_uring_bgid;
+    sqe->user_data = uring_data(conn->fd, OP_RECV);
+    conn->recv_armed = true;
+}
+
+// stop reading from a client that does not drain its replies
+static void uring_cancel_recv(URing *ring, Conn *conn) {
+    io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        conn->want_close = true;
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_data(conn->fd, OP_RECV);
+    sqe->user_data = uring_data(conn->fd, OP_CANCEL);
+    conn->recv_cancel = true;
+}
+
+// `outgoing` is left untouched until the send completes, the queued
+// messages are held by their references
+static void uring_arm_send(URing *ring, Conn *conn) {
+    io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        conn->want_close = true;
+        return;
+    }
+    sqe->fd = conn->fd;
+    if (conn->pushq.empty()) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)conn->outgoing.data();
+        sqe->len = (uint32_t)conn->outgoing.size();
+    } else {
+        conn->send_iov.resize(k_max_iovs);
+        conn->send_msg = {};
+        conn->send_msg.msg_iov = conn->send_iov.data();
+        conn->send_msg.msg_iovlen = conn_out_iov(conn, conn->send_iov.data(), k_max_iovs);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)(uintptr_t)&conn->send_msg;
+        sqe->len = 1;
+    }
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_data(conn->fd, OP_SEND);
+    conn->send_inflight = true;
+}
+
+static void uring_complete(UBufRing *bufs, Conn *conn, uint8_t op, int res, uint32_t flags) {
+    if (op == OP_RECV) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            conn->recv_armed = false;
+            conn->recv_cancel = false;
+        }
+        if (res > 0) {
+            uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            buf_push_back(conn->incoming, ubuf_ring_get(bufs, bid), (size_t)res);
+            ubuf_ring_recycle(bufs, bid);
+            // a send in flight references `outgoing`, the input waits for it
+            if (!conn->send_inflight && !conn->want_close) {
+                handle_requests(conn);
+            }
+        } else if (res == 0) {
+            if (!conn->want_close) {
+                handle_eof(conn);
+            }
+        } else if (res != -ENOBUFS && res != -ECANCELED) {    // these only end the multishot
+            errno = -res;
+            message_errno("recv() error");
+            conn->want_close = true;
+        }
+    } else if (op == OP_SEND) {
+        conn->send_inflight = false;
+        if (res < 0) {
+            errno = -res;
+            message_errno("send() error");
+            conn->want_close = true;
+            return;
+        }
+        handle_written(conn, (size_t)res);
+    }
+}
+
+static void uring_close(std::vector<Conn *> &fd2conn, Conn *conn) {
+    if (conn->recv_armed || conn->send_inflight) {
+        shutdown(conn->fd, SHUT_RDWR);  // flushes out the pending requests
+    } else {
+        conn_destroy(fd2conn, conn);
+    }
+}
+
+static void run_uring(const std::vector<int> &listeners) {
+    URing ring;
+    UBufRing bufs;
+    if (uring_init(&ring, k_uring_entries)) {
+        message_errno("io_uring unavailable, using poll");
+        return run_poll(listeners);
+    }
+    if (ubuf_ring_init(&ring, &bufs, k_uring_bgid, k_uring_nbufs, k_uring_buf_size)) {
+        message_errno("io_uring buffer ring unavailable, using poll");
+        uring_free(&ring);
+        return run_poll(listeners);
+    }
+    for (int fd : listeners) {
+        uring_arm_accept(&ring, fd);
+    }
+
+    std::vector<Conn *> fd2connMap;
+    std::vector<int> touched;
+    std::vector<Conn *> ready;
+    std::vector<Conn *> pushed;
+    bool mig_armed = false;     // a poll on the migration socket is in flight
+    uint32_t mig_id = 0;        // for that socket
+    while (true) {
+        ready.clear();
+        jobs_run(ready);
+        for (Conn *conn : ready) {
+            uring_arm_send(&ring, conn);    // delivered only with no send in flight
+        }
+        if (pubsub_take_pushed(pushed)) {
+            for (Conn *conn : pushed) {
+                if (conn->want_close) {
+                    uring_close(fd2connMap, conn);
+                } else if (conn->want_write && !conn->send_inflight) {
+                    uring_arm_send(&ring, conn);
+                }
+            }
+        }
+        // a closed socket is shut down first, which ends its poll
+        uint32_t mig_events = 0, id = 0;
+        int mig_fd = migrate_poll_fd(mig_events, id);
+        if (mig_fd >= 0 && !mig_armed) {
+            uring_arm_poll(&ring, mig_fd, mig_events);
+            mig_armed = true;
+            mig_id = id;
+        }
+        // everything prepared in the last round goes out in one io_uring_enter()
+        if (uring_submit_and_wait(&ring, 1, maint_timeout_ms()) < 0) die("io_uring_enter");
+        maint_run(!uring_peek_cqe(&ring));
+
+        touched.clear();
+        while (io_uring_cqe *cqe = uring_peek_cqe(&ring)) {
+            int cfd = (int)(cqe->user_data >> 8);
+            uint8_t op = (uint8_t)(cqe->user_data & 255);
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            if (op == OP_CANCEL) {
+                continue;
+            }
+            if (op == OP_POLL) {
+                mig_armed = false;
+                migrate_io(mig_id, res < 0 ? POLLERR : (uint32_t)res);
+                continue;
+            }
+            if (op == OP_ACCEPT) {
+                if (res >= 0) {
+                    struct sockaddr_storage client_addr = {};
+                    socklen_t addrlen = sizeof(client_addr);
+                    getpeername(res, (struct sockaddr *)&client_addr, &addrlen);
+                    conn_put(fd2connMap, conn_new(res, (struct sockaddr *)&client_addr));
+                    touched.push_back(res);
+                } else {
+                    errno = -res;
+                    message_errno("accept() error");
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uring_arm_accept(&ring, cfd);
+                }
+                continue;
+            }
+            uring_complete(&bufs, fd2connMap[cfd], op, res, flags);
+            touched.push_back(cfd);
+        }
+
+        // fds are only closed here, so they cannot be reused within a round
+        for (int cfd : touched) {
+            Conn *conn = fd2connMap[cfd];
+            if (!conn) continue;
+            if (conn->want_close) {
+                uring_close(fd2connMap, conn);
+                continue;
+            }
+            bool paused = !conn->want_read;
+            if (!conn->recv_armed && !paused) {
+                uring_arm_recv(&ring, conn);
+            } else if (conn->recv_armed && paused && !conn->recv_cancel) {
+                uring_cancel_recv(&ring, conn);
+            }
+            if (conn->want_write && !conn->send_inflight) {
+                uring_arm_send(&ring, conn);
+            }
+        }
+    }
+}
+
+// "addr" or "addr:port", IPv4 only
+static bool parse_bind(const std::string &spec, int64_t port, struct sockaddr_in &addr) {
+    std::string host = spec;
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        host = spec.substr(0, colon);
+        if (!str2int(spec.substr(colon + 1), port) || port <= 0 || port > 65535) {
+            return false;
+        }
+    }
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1;
+}
+
+static int listen_fd(int fd) {
+    listen_set_nb(fd);
+    if (listen(fd, (int)g_config.backlog)) die("listen()");
+    return fd;
+}
+
+// SO_REUSEPORT lets every reader thread accept on its own socket
+static int listen_tcp(const struct sockaddr_in &addr, bool reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) die("socket()");
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuseport) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr))) die("bind()");
+    return listen_fd(fd);
+}
+
+static int listen_unix(const std::string &path, mode_t perm) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) die("socket()");
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    // only a socket left behind by a previous run is replaced, not one
+    // that another instance still listens on
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) die("socket()");
+    if (connect(probe, (const sockaddr *)&addr, sizeof(addr)) == 0) {
+        errno = EADDRINUSE;
+        die("the unix socket is in use");
+    }
+    if (errno == ECONNREFUSED) {
+        unlink(path.c_str());
+    }
+    close(probe);
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr))) die("bind()");
+    if (chmod(path.c_str(), perm)) die("chmod()");
+    return listen_fd(fd);
+}
+
+static bool config_int(const std::string &value, int64_t lo, int64_t hi, int64_t &out) {
+    int64_t val = 0;
+    if (!str2int(value, val) || val < lo || val > hi) {
+        return false;
+    }
+    out = val;
+    return true;
+}
+
+static bool config_bool(const std::string &value, bool &out) {
+    if (value != "yes" && value != "no") {
+        return false;
+    }
+    out = value == "yes";
+    return true;
+}
+
+// the same names serve as `--name value` flags and `name value` config lines
+static bool config_set(const std::string &name, const std::string &value) {
+    if (name == "bind") {
+        // "bind" lines add to the list, each may hold several addresses
+        size_t pos = 0, n = 0;
+        while ((pos = value.find_first_not_of(' ', pos)) != std::string::npos) {
+            size_t end = value.find(' ', pos);
+            std::string spec = value.substr(pos, end == std::string::npos ? end : end - pos);
+            struct sockaddr_in addr;
+            if (!parse_bind(spec, 1, addr)) {
+                return false;
+            }
+            g_config.binds.push_back(spec);
+            pos = end;
+            n++;
+        }
+        return n > 0;
+    }
+    else if (name == "port") return config_int(value, 0, 65535, g_config.port);
+    else if (name == "unixsocket") {
+        if (value.size() >= sizeof(sockaddr_un::sun_path)) {
+            return false;
+        }
+        g_config.unixsocket = value;
+        return true;
+    }
+    else if (name == "unixsocketperm") {
+        char *endp = NULL;
+        long perm = strtol(value.c_str(), &endp, 8);
+        if (value.empty() || *endp != '\0' || perm < 0 || perm > 0777) {
+            return false;
+        }
+        g_config.unixsocketperm = perm;
+        return true;
+    }
+    else if (name == "backlog") return config_int(value, 1, INT32_MAX, g_config.backlog);
+    else if (name == "tcp-nodelay") return config_bool(value, g_config.tcp_nodelay);
+    else if (name == "tcp-keepalive") return config_int(value, 0, 32767, g_config.tcp_keepalive);
+    else if (name == "io") {
+        if (value != "poll" && value != "epoll" && value != "uring") {
+            return false;
+        }
+        g_config.io = value;
+        return true;
+    }
+    else if (name == "readers") return config_int(value, 0, k_max_readers, g_config.readers);
+    else if (name == "read-port") return config_int(value, 1, 65535, g_config.read_port);
+    else if (name == "compress-threshold") return config_int(value, 0, INT64_MAX, g_config.compress_threshold);
+    else if (name == "maxmemory") return config_int(value, 0, INT64_MAX, g_config.maxmemory);
+    else if (name == "maxmemory-policy") {
+        if (value == "noeviction") g_config.maxmemory_policy = EVICT_NONE;
+        else if (value == "allkeys-lru") g_config.maxmemory_policy = EVICT_LRU;
+        else if (value == "allkeys-lfu") g_config.maxmemory_policy = EVICT_LFU;
+        else if (value == "allkeys-random") g_config.maxmemory_policy = EVICT_RANDOM;
+        else return false;
+        return true;
+    }
+    else if (name == "maxmemory-samples") return config_int(value, 1, k_evict_max_samples, g_config.maxmemory_samples);
+    else if (name == "maint-hz") return config_int(value, 1, 1000, g_config.maint_hz);
+    else if (name == "maint-budget-us") return config_int(value, 0, 1000000, g_config.maint_budget_us);
+    else if (name == "activedefrag") return config_bool(value, g_config.activedefrag);
+    else if (name == "defrag-threshold") return config_int(value, 1, 1000, g_config.defrag_threshold);
+    else if (name == "defrag-ignore-bytes") return config_int(value, 0, INT64_MAX, g_config.defrag_ignore_bytes);
+    else if (name == "capture-file") {
+        g_config.capture_file = value;
+        return !value.empty();
+    }
+    else if (name == "capture-sample") return config_int(value, 1, UINT32_MAX, g_config.capture_sample);
+    else if (name == "logfile") {
+        g_config.logfile = value;
+        return true;
+    }
+    else if (name == "loglevel") {
+        if (value == "debug") g_config.loglevel = LL_DEBUG;
+        else if (value == "info") g_config.loglevel = LL_INFO;
+        else if (value == "warn") g_config.loglevel = LL_WARN;
+        else if (value == "error") g_config.loglevel = LL_ERROR;
+        else return false;
+        return true;
+    }
+    else if (name == "log-rate") return config_int(value, 0, UINT32_MAX, g_config.log_rate);
+    else if (name == "pubsub-output-limit") return config_int(value, 0, INT64_MAX, g_config.pubsub_output_limit);
+    else if (name == "trace-sample") return config_int(value, 0, UINT32_MAX, g_config.trace_sample);
+    else if (name == "cluster") return config_bool(value, g_config.cluster);
+    else if (name == "cluster-announce") {
+        struct sockaddr_in addr;
+        g_config.cluster_announce = value;
+        return parse_node_addr(value, addr);
+    }
+    else if (name == "cluster-map") {
+        // like "bind", lines add to the map, each may hold several ranges
+        size_t pos = 0, n = 0;
+        while ((pos = value.find_first_not_of(' ', pos)) != std::string::npos) {
+            size_t end = value.find(' ', pos);
+            std::string spec = value.substr(pos, end == std::string::npos ? end : end - pos);
+            uint32_t lo = 0, hi = 0;
+            std::string addr;
+            if (!parse_map_range(spec, lo, hi, addr)) {
+                return false;
+            }
+            g_config.cluster_map.push_back(spec);
+            pos = end;
+            n++;
+        }
+        return n > 0;
+    }
+    else if (name == "cluster-migrate-batch") return config_int(value, 1, 100000, g_config.cluster_migrate_batch);
+    else return false;
+}
+
+static bool config_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        message_errno("cannot open the config file");
+        return false;
+    }
+    const char *space = " \t\r\n";
+    char line[4096];
+    bool ok = true;
+    for (int lineno = 1; ok && fgets(line, sizeof(line), fp); lineno++) {
+        std::string s = line;
+        s.resize(s.find('#') == std::string::npos ? s.size() : s.find('#'));
+        size_t begin = s.find_first_not_of(space);
+        if (begin == std::string::npos) {
+            continue;   // blank or comment
+        }
+        size_t end = s.find_first_of(space, begin);
+        std::string name = s.substr(begin, end - begin);
+        std::string value;
+        if (end != std::string::npos && (begin = s.find_first_not_of(space, end)) != std::string::npos) {
+            value = s.substr(begin, s.find_last_not_of(space) + 1 - begin);
+        }
+        ok = config_set(name, value);
+        if (!ok) {
+            fprintf(stderr, "%s:%d: bad config `%s`\n", path, lineno, name.c_str());
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+struct ReaderArgs {
+    int index = 0;
+    std::vector<int> listeners;
+};
+
+static void *reader_main(void *arg) {
+    ReaderArgs *args = (ReaderArgs *)arg;
+    t_reader = args->index;
+    run_poll(args->listeners);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [--config FILE] [--bind ADDR[:PORT]]... [--port PORT]\n"
+        "    [--unixsocket PATH] [--unixsocketperm OCTAL] [--backlog N]\n"
+        "    [--tcp-nodelay yes|no] [--tcp-keepalive SECS] [--io poll|epoll|uring]\n"
+        "    [--readers N] [--read-port PORT] [--compress-threshold BYTES]\n"
+        "    [--maxmemory BYTES] [--maxmemory-samples N]\n"
+        "    [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|allkeys-random]\n"
+        "    [--maint-hz N] [--maint-budget-us USECS] [--activedefrag yes|no]\n"
+        "    [--defrag-threshold PERCENT] [--defrag-ignore-bytes BYTES]\n"
+        "    [--capture-file PATH] [--capture-sample N] [--logfile PATH]\n"
+        "    [--loglevel debug|info|warn|error] [--log-rate LINES_PER_SEC]\n"
+        "    [--pubsub-output-limit BYTES] [--trace-sample N] [--cluster yes|no]\n"
+        "    [--cluster-announce ADDR:PORT] [--cluster-map LO-HI=ADDR:PORT...]\n"
+        "    [--cluster-migrate-batch KEYS]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    // flags apply in order, so they override the config files before them;
+    // the lists add up within the flags, replacing those of the files
+    bool flag_binds = false, flag_map = false;
+    for (int i = 1; i < argc; ++i) {
+        bool ok = i + 1 < argc && !strncmp(argv[i], "--", 2);
+        if (ok && !strcmp(argv[i], "--config")) {
+            ok = config_load(argv[i + 1]);
+        } else if (ok) {
+            if (!strcmp(argv[i], "--bind") && !flag_binds) {
+                g_config.binds.clear();
+                flag_binds = true;
             }
+            if (!strcmp(argv[i], "--cluster-map") && !flag_map) {
+                g_config.cluster_map.clear();
+                flag_map = true;
+            }
+            ok = config_set(argv[i] + 2, argv[i + 1]);
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
         }
+        i++;
+    }
+    if (g_config.binds.empty()) {
+        g_config.binds.push_back("0.0.0.0");
+    }
+    if (!g_config.logfile.empty() && !log_open(g_config.logfile.c_str())) {
+        fprintf(stderr, "[errno:%d] cannot open the log file\n", errno);
+        return 1;
+    }
+    log_set_level(g_config.loglevel);
+    log_set_rate((uint32_t)g_config.log_rate);
+    trace_set_sample((uint32_t)g_config.trace_sample);
+    if (g_config.activedefrag) {
+        defrag_enable();
+    }
+    if (g_config.cluster && !cluster_init()) {
+        message("cluster mode needs a TCP port or cluster-announce, and at most 1024 nodes");
+        return 1;
+    }
+    if (!g_config.capture_file.empty() && !capture_open(g_config.capture_file.c_str())) {
+        message_errno("cannot open the capture file");
+        return 1;
+    }
+
+    std::vector<int> listeners;
+    for (size_t i = 0; g_config.port > 0 && i < g_config.binds.size(); i++) {
+        struct sockaddr_in addr;
+        parse_bind(g_config.binds[i], g_config.port, addr);
+        listeners.push_back(listen_tcp(addr, false));
+    }
+    if (!g_config.unixsocket.empty()) {
+        listeners.push_back(listen_unix(g_config.unixsocket, (mode_t)g_config.unixsocketperm));
+    }
+    if (listeners.empty()) {
+        message("no listeners, set a port or a unix socket");
+        return 1;
+    }
+
+    log_start();    // before the other threads, see log.hpp
+
+    // lookups on the read port are served by their own threads with poll()
+    epoch_init((uint32_t)g_config.readers);
+    for (int64_t i = 0; i < g_config.readers; i++) {
+        ReaderArgs *args = new ReaderArgs();
+        args->index = (int)i;
+        for (const std::string &spec : g_config.binds) {
+            struct sockaddr_in addr;
+            parse_bind(spec, g_config.read_port, addr);
+            addr.sin_port = htons((uint16_t)g_config.read_port);
+            args->listeners.push_back(listen_tcp(addr, true));
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &reader_main, args)) die("pthread_create()");
+        pthread_detach(thread);
+    }
+
+    if (g_config.io == "epoll") {
+        run_epoll(listeners);
+    } else if (g_config.io == "uring") {
+        run_uring(listeners);
+    } else {
+        run_poll(listeners);
     }
     return 0;
 }
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include "trace.hpp"
+
+
+const size_t k_trace_events = 1 << 16;  // a power of 2
+const size_t k_trace_buckets = 512;     // enough for any 64-bit duration, see bucket_of()
+const size_t k_trace_cmd_len = 16;      // longer command names are cut
+
+static const char *const k_phase_names[PH_MAX] = {
+    "read", "request", "parse", "frame", "exec", "reply", "pop", "write",
+};
+
+// a timed span, `seq` is its index + 1 once it is complete
+struct 
+TraceEvent {
+    uint64_t seq = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint32_t tid = 0;
+    uint32_t phase = 0;
+    char cmd[k_trace_cmd_len] = {};
+};
+
+static uint32_t g_sample = 0;
+static uint64_t g_hist[PH_MAX][k_trace_buckets];    // in ticks
+static uint64_t g_total[PH_MAX];
+static uint64_t g_max[PH_MAX];
+static TraceEvent g_events[k_trace_events];
+static uint64_t g_next = 0;         // events ever recorded
+static uint32_t g_threads = 0;
+static uint64_t g_origin_ticks = 0; // the counter is converted with the clock
+static uint64_t g_origin_ns = 0;    // advance since then
+
+static thread_local uint64_t t_rand = 0x9e3779b97f4a7c15;
+static thread_local uint32_t t_tid = 0;
+
+static uint64_t mono_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// log-linear: exact below 16, then 8 buckets per power of 2
+static size_t bucket_of(uint64_t ticks) {
+    if (ticks < 16) {
+        return (size_t)ticks;
+    }
+    int e = 63 - __builtin_clzll(ticks);
+    return 16 + (size_t)(e - 4) * 8 + (size_t)((ticks >> (e - 3)) & 7);
+}
+
+static uint64_t bucket_floor(size_t b) {
+    if (b < 16) {
+        return b;
+    }
+    size_t e = (b - 16) / 8 + 4;
+    return (uint64_t)(8 + (b - 16) % 8) << (e - 3);
+}
+
+static double ns_per_tick() {
+    uint64_t ticks = trace_now() - g_origin_ticks;
+    return ticks ? (double)(mono_nsec() - g_origin_ns) / (double)ticks : 1;
+}
+
+// called from main() before other threads start, so it sets the origin
+void trace_set_sample(uint32_t sample) {
+    if (!g_origin_ns) {
+        g_origin_ticks = trace_now();
+        g_origin_ns = mono_nsec();
+    }
+    __atomic_store_n(&g_sample, sample, __ATOMIC_RELAXED);
+}
+
+uint32_t trace_sample() {
+    return __atomic_load_n(&g_sample, __ATOMIC_RELAXED);
+}
+
+// random rather than every Nth call, which could always land on the same
+// kind of call in a regular pattern of reads, requests and writes
+bool trace_sampled() {
+    uint32_t sample = __atomic_load_n(&g_sample, __ATOMIC_RELAXED);
+    if (sample == 0) {
+        return false;
+    }
+    t_rand ^= t_rand << 13;     // xorshift64
+    t_rand ^= t_rand >> 7;
+    t_rand ^= t_rand << 17;
+    return t_rand % sample == 0;
+}
+
+void trace_record(int phase, uint64_t start, uint64_t end, const std::string *cmd) {
+    uint64_t ticks = end > start ? end - start : 0;
+    __atomic_add_fetch(&g_hist[phase][bucket_of(ticks)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_total[phase], ticks, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&g_max[phase], __ATOMIC_RELAXED);
+    while (ticks > max && !__atomic_compare_exchange_n(&g_max[phase], &max, ticks,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+
+    if (!t_tid) {
+        t_tid = __atomic_add_fetch(&g_threads, 1, __ATOMIC_RELAXED);
+    }
+    // a seqlock per slot: 0 while it is being written, see trace_dump()
+    uint64_t i = __atomic_fetch_add(&g_next, 1, __ATOMIC_RELAXED);
+    TraceEvent *ev = &g_events[i & (k_trace_events - 1)];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->start = start;
+    ev->end = end;
+    ev->tid = t_tid;
+    ev->phase = (uint32_t)phase;
+    size_t len = cmd ? cmd->size() : 0;
+    len = len < k_trace_cmd_len - 1 ? len : k_trace_cmd_len - 1;
+    memcpy(ev->cmd, cmd ? cmd->data() : "", len);
+    ev->cmd[len] = '\0';
+    __atomic_store_n(&ev->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+void trace_reset() {
+    for (int phase = 0; phase < PH_MAX; phase++) {
+        for (size_t b = 0; b < k_trace_buckets; b++) {
+            __atomic_store_n(&g_hist[phase][b], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&g_total[phase], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_max[phase], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// the lower bound of the bucket, within 1/8 of the value
+static uint64_t percentile(const uint64_t *counts, uint64_t total, uint64_t pct) {
+    uint64_t seen = 0;
+    for (size_t b = 0; total > 0 && b < k_trace_buckets; b++) {
+        seen += counts[b];
+        if (seen * 100 >= total * pct) {
+            return bucket_floor(b);
+        }
+    }
+    return 0;
+}
+
+void trace_phase_stats(int phase, TracePhaseStats &out) {
+    uint64_t counts[k_trace_buckets];
+    out.name = k_phase_names[phase];
+    out.count = 0;
+    for (size_t b = 0; b < k_trace_buckets; b++) {
+        counts[b] = __atomic_load_n(&g_hist[phase][b], __ATOMIC_RELAXED);
+        out.count += counts[b];
+    }
+    double scale = ns_per_tick();
+    out.p50_ns = (uint64_t)((double)percentile(counts, out.count, 50) * scale);
+    out.p99_ns = (uint64_t)((double)percentile(counts, out.count, 99) * scale);
+    out.total_ns = (uint64_t)((double)__atomic_load_n(&g_total[phase], __ATOMIC_RELAXED) * scale);
+    out.max_ns = (uint64_t)((double)__atomic_load_n(&g_max[phase], __ATOMIC_RELAXED) * scale);
+}
+
+static void json_str(std::string &out, const char *s) {
+    out += '"';
+    for (; *s; s++) {
+        uint8_t c = (uint8_t)*s;
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+// Complete ("X") events in microseconds, one track per thread. Slots that
+// are overwritten while being copied are skipped.
+std::string trace_dump(uint64_t window_ms) {
+    double scale = ns_per_tick();
+    uint64_t now = trace_now();
+    uint64_t window = window_ms ? (uint64_t)((double)window_ms * 1e6 / scale) : UINT64_MAX;
+    uint64_t last = __atomic_load_n(&g_next, __ATOMIC_ACQUIRE);
+    uint64_t first = last > k_trace_events ? last - k_trace_events : 0;
+
+    std::string out = "{\"traceEvents\":[";
+    bool empty = true;
+    for (uint64_t i = first; i < last; i++) {
+        const TraceEvent *slot = &g_events[i & (k_trace_events - 1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        TraceEvent ev;
+        memcpy((void *)&ev, (const void *)slot, sizeof(ev));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != i + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (now - ev.start > window) {
+            continue;
+        }
+        ev.cmd[k_trace_cmd_len - 1] = '\0';
+        char line[160];
+        snprintf(line, sizeof(line),
+            "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+            empty ? "" : ",\n", k_phase_names[ev.phase % PH_MAX], ev.tid,
+            (double)(ev.start - g_origin_ticks) * scale / 1000,
+            (double)(ev.end - ev.start) * scale / 1000);
+        out += line;
+        if (ev.cmd[0]) {
+            out += ",\"args\":{\"cmd\":";
+            json_str(out, ev.cmd);
+            out += '}';
+        }
+        out += '}';
+        empty = false;
+    }
+    out += "],\"displayTimeUnit\":\"ns\"}\n";
+    return out;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+
+// Request tracing. 1 in `sample` requests, reads and writes are timed by
+// phase with the CPU's cycle counter. The durations go to a histogram per
+// phase, and the timed spans to a ring that trace_dump() turns into Chrome
+// trace JSON, which chrome://tracing and ui.perfetto.dev open. Any thread
+// may record; the histograms and the ring are shared.
+
+enum {
+    PH_READ     = 0,    // the read() syscall
+    PH_REQUEST  = 1,    // a whole request, the phases below
+    PH_PARSE    = 2,    // deserialize()
+    PH_FRAME    = 3,    // starting the reply frame
+    PH_EXEC     = 4,    // the command, including writing its reply with out_*()
+    PH_REPLY    = 5,    // ending the reply frame, capture and slowlog
+    PH_POP      = 6,    // buf_pop_front() of a request, or of written output
+    PH_WRITE    = 7,    // the write() syscall
+    PH_MAX      = 8,
+};
+
+void trace_set_sample(uint32_t sample);     // 0 disables
+uint32_t trace_sample();
+bool trace_sampled();   // whether to time the next request, read or write
+void trace_record(int phase, uint64_t start, uint64_t end, const std::string *cmd);
+void trace_reset();
+
+struct 
+TracePhaseStats {
+    const char *name = "";
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t max_ns = 0;
+};
+
+void trace_phase_stats(int phase, TracePhaseStats &out);
+// the spans of the last `window_ms` milliseconds, 0 for all in the ring
+std::string trace_dump(uint64_t window_ms);
+
+// a cycle count, or nanoseconds where there is no cheap counter
+static inline uint64_t trace_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+#endif
+}
+
+// Static probes for perf and bpftrace, e.g.
+//   bpftrace -e 'usdt:./server:server:request__start { @[str(arg1)] = count(); }'
+// A probe is a nop and a .note.stapsdt entry naming its arguments, which
+// are all 64-bit. Without <sys/sdt.h> the note is emitted the same way here
+// on x86-64, and elsewhere the probes compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(server, name, a, b)
+#endif
+#endif
+
+#if !defined(TRACE_PROBE2) && defined(__x86_64__)
+#define TRACE_PROBE2(name, a, b) __asm__ __volatile__(                         \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b\n"                                                        \
+    ".8byte _.stapsdt.base\n"                                                   \
+    ".8byte 0\n"                                                                \
+    ".asciz \"server\"\n"                                                       \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"8@%0 8@%1\"\n"                                                    \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"                                                                  \
+    :: "nor"((uint64_t)(a)), "nor"((uint64_t)(b)))
+#endif
+
+#if !defined(TRACE_PROBE2)
+#define TRACE_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
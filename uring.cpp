@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.hpp"
+
+
+static int sys_setup(uint32_t entries, io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+    void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(URing *ring, uint32_t entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+    p.flags |= IORING_SETUP_CQSIZE;
+    int fd = sys_setup(entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    *ring = URing{};
+    ring->fd = fd;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (ring->cq_len > ring->sq_len) {
+        ring->sq_len = ring->cq_len;
+    }
+    ring->cq_len = ring->sq_len;    // one mapping serves both rings
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    ring->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ptr;
+    ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+    ring->sq_array = (uint32_t *)(sq + p.sq_off.array);
+    ring->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    uint8_t *cq = (uint8_t *)ring->cq_ptr;
+    ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    // identity mapping, so only the tail has to be published per SQE
+    for (uint32_t i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+void uring_free(URing *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    *ring = URing{};
+}
+
+// the SQEs are only visible to the kernel after the tail is released
+static void uring_flush(URing *ring) {
+    uint32_t tail = *ring->sq_tail + ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe *uring_get_sqe(URing *ring) {
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head >= ring->sq_entries) {
+        // full, submit what we have without waiting
+        if (uring_submit_and_wait(ring, 0, -1) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        tail = *ring->sq_tail;
+        if (tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+// A single io_uring_enter() submits the whole batch and reaps completions.
+// The wait gives up after `timeout_ms` unless it is negative, a timeout is
+// not an error.
+int uring_submit_and_wait(URing *ring, uint32_t wait_nr, int timeout_ms) {
+    uint32_t to_submit = ring->sq_pending;
+    uring_flush(ring);
+    ring->sq_pending = 0;
+    uint32_t flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    io_uring_getevents_arg arg = {};
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    if (wait_nr && timeout_ms >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    while (true) {
+        int rv = (flags & IORING_ENTER_EXT_ARG)
+            ? sys_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg))
+            : sys_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == ETIME) {
+            return (int)to_submit;
+        }
+        return rv;
+    }
+}
+
+io_uring_cqe *uring_peek_cqe(URing *ring) {
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    return head == tail ? NULL : &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int ubuf_ring_init(URing *ring, UBufRing *bufs, uint16_t bgid, uint32_t nbufs, uint32_t buf_size) {
+    if (nbufs == 0 || nbufs > 32768 || ((nbufs - 1) & nbufs) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t ring_len = nbufs * sizeof(io_uring_buf);
+    void *ptr = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return -1;
+    }
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ptr;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ptr, ring_len);
+        return -1;
+    }
+
+    bufs->br = (io_uring_buf_ring *)ptr;
+    bufs->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+    bufs->nbufs = nbufs;
+    bufs->buf_size = buf_size;
+    bufs->bgid = bgid;
+    bufs->br->tail = 0;
+    for (uint32_t i = 0; i < nbufs; i++) {
+        ubuf_ring_recycle(bufs, (uint16_t)i);
+    }
+    return 0;
+}
+
+void ubuf_ring_free(URing *ring, UBufRing *bufs) {
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bufs->bgid;
+    (void)sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(bufs->br, bufs->nbufs * sizeof(io_uring_buf));
+    free(bufs->bufs);
+    *bufs = UBufRing{};
+}
+
+uint8_t *ubuf_ring_get(UBufRing *bufs, uint16_t bid) {
+    return &bufs->bufs[(size_t)bid * bufs->buf_size];
+}
+
+// hand a consumed buffer back to the kernel
+void ubuf_ring_recycle(UBufRing *bufs, uint16_t bid) {
+    uint16_t tail = bufs->br->tail;
+    // not `br->bufs`: the empty struct in front of the flex array has size 1 in C++
+    io_uring_buf *buf = (io_uring_buf *)bufs->br + (tail & (bufs->nbufs - 1));
+    buf->addr = (uint64_t)(uintptr_t)ubuf_ring_get(bufs, bid);
+    buf->len = bufs->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&bufs->br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+
+// minimal io_uring wrapper on top of the raw syscalls
+struct 
+URing {
+    int fd = -1;
+    // submission queue
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t *sq_array = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+    uint32_t sq_pending = 0;    // prepared but not yet submitted
+    io_uring_sqe *sqes = NULL;
+    // completion queue
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    io_uring_cqe *cqes = NULL;
+    // mappings
+    void *sq_ptr = NULL;
+    size_t sq_len = 0;
+    void *cq_ptr = NULL;
+    size_t cq_len = 0;
+    size_t sqes_len = 0;
+};
+
+// kernel-provided buffer ring for IOSQE_BUFFER_SELECT
+struct 
+UBufRing {
+    io_uring_buf_ring *br = NULL;
+    uint8_t *bufs = NULL;
+    uint32_t nbufs = 0;
+    uint32_t buf_size = 0;
+    uint16_t bgid = 0;
+};
+
+int uring_init(URing *ring, uint32_t entries);
+void uring_free(URing *ring);
+io_uring_sqe *uring_get_sqe(URing *ring);
+int uring_submit_and_wait(URing *ring, uint32_t wait_nr, int timeout_ms);
+io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+
+int ubuf_ring_init(URing *ring, UBufRing *bufs, uint16_t bgid, uint32_t nbufs, uint32_t buf_size);
+void ubuf_ring_free(URing *ring, UBufRing *bufs);
+uint8_t *ubuf_ring_get(UBufRing *bufs, uint16_t bid);
+void ubuf_ring_recycle(UBufRing *bufs, uint16_t bid);